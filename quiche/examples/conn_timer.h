@@ -0,0 +1,74 @@
+#ifndef CONN_TIMER_H
+#define CONN_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include <quiche.h>
+
+/* Per-connection timer integrated in the GLib main loop.
+ *
+ * The timer is a bare GSource driven by its ready time, so it can be moved
+ * back and forth with microsecond resolution every time the connection is
+ * flushed, instead of removing and adding a new timeout source each time. It
+ * fires at the earliest of quiche's own timeout (loss detection, idle, ...)
+ * and the release time of the next paced packet. */
+
+/* Packets due within this delay are sent right away, since the main loop can't
+ * wake up much more precisely anyway. */
+#define PACING_GRANULARITY_US 1000
+
+static gboolean conn_timer_dispatch(GSource *source, GSourceFunc callback,
+                                    gpointer user_data) {
+    // one-shot, until the callback re-arms it
+    g_source_set_ready_time(source, -1);
+
+    return callback(user_data);
+}
+
+static GSourceFuncs conn_timer_funcs = {
+    NULL, NULL, conn_timer_dispatch, NULL
+};
+
+static inline GSource *conn_timer_new(GSourceFunc callback, gpointer data) {
+    GSource *timer = g_source_new(&conn_timer_funcs, sizeof(GSource));
+
+    g_source_set_callback(timer, callback, data, NULL);
+    g_source_attach(timer, NULL);
+
+    return timer;
+}
+
+static inline void conn_timer_free(GSource *timer) {
+    g_source_destroy(timer);
+    g_source_unref(timer);
+}
+
+/* quiche's send_info.at and g_get_monotonic_time() both use CLOCK_MONOTONIC. */
+static inline gint64 conn_timer_release_time(const quiche_send_info *send_info) {
+    return (gint64) send_info->at.tv_sec * G_USEC_PER_SEC +
+           send_info->at.tv_nsec / 1000;
+}
+
+/* Arms the timer for quiche's next timeout, or for the given pacing release
+ * time (-1 if none) if that's earlier. */
+static inline void conn_timer_rearm(GSource *timer, quiche_conn *conn,
+                                    gint64 release_time) {
+    gint64 ready_time = release_time;
+
+    uint64_t timeout_ns = quiche_conn_timeout_as_nanos(conn);
+    if (timeout_ns != UINT64_MAX) {
+        // round up, firing early would just re-arm the same timeout
+        gint64 expiry = g_get_monotonic_time() + (gint64) ((timeout_ns + 999) / 1000);
+
+        if (ready_time < 0 || expiry < ready_time) {
+            ready_time = expiry;
+        }
+    }
+
+    g_source_set_ready_time(timer, ready_time);
+}
+
+#endif
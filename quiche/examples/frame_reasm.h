@@ -0,0 +1,238 @@
+#ifndef FRAME_REASM_H
+#define FRAME_REASM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Reassembly of the frames received on streams, one frame per stream.
+ *
+ * Stream data is read straight into a buffer bound to the stream ID. Once the
+ * frame is complete the buffer is detached from the stream and handed over as
+ * is to a consumer, which gives it back with frame_reasm_release(), possibly
+ * from another thread. Buffers are recycled along with the memory they grew
+ * to, so once warmed up, frames don't need any allocation.
+ *
+ * Everything but frame_reasm_release() must be called from a single thread. */
+
+#define FRAME_REASM_INIT_CAP 65536
+#define FRAME_REASM_MIN_SLOTS 64 /* must be a power of two */
+
+struct frame_reasm;
+
+struct frame_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+
+    uint64_t stream_id;
+
+    struct frame_reasm *owner;
+
+    /* next buffer in the free lists */
+    struct frame_buf *next;
+};
+
+struct frame_reasm {
+    /* open addressing table of the frames being reassembled, keyed by stream
+     * ID with linear probing */
+    struct frame_buf **slots;
+    size_t num_slots;
+    size_t count;
+
+    /* buffers ready to be reused */
+    struct frame_buf *free;
+
+    /* buffers given back by consumers, moved to the free list when it runs
+     * out */
+    _Atomic(struct frame_buf *) released;
+
+    /* number of buffers allocated so far, and of frames completed */
+    size_t allocated;
+    uint64_t completed;
+};
+
+static inline bool frame_reasm_init(struct frame_reasm *r) {
+    r->slots = calloc(FRAME_REASM_MIN_SLOTS, sizeof(*r->slots));
+    if (r->slots == NULL) {
+        return false;
+    }
+
+    r->num_slots = FRAME_REASM_MIN_SLOTS;
+    r->count = 0;
+    r->free = NULL;
+    atomic_init(&r->released, NULL);
+    r->allocated = 0;
+    r->completed = 0;
+
+    return true;
+}
+
+static inline size_t frame_reasm_hash(const struct frame_reasm *r, uint64_t stream_id) {
+    return (size_t) ((stream_id * 0x9E3779B97F4A7C15ULL) >> 32) & (r->num_slots - 1);
+}
+
+/* Index of the slot holding the stream's frame, or of the empty slot where it
+ * would be inserted. The table is never full. */
+static inline size_t frame_reasm_slot(const struct frame_reasm *r, uint64_t stream_id) {
+    size_t i = frame_reasm_hash(r, stream_id);
+
+    while (r->slots[i] != NULL && r->slots[i]->stream_id != stream_id) {
+        i = (i + 1) & (r->num_slots - 1);
+    }
+
+    return i;
+}
+
+static inline bool frame_reasm_grow(struct frame_reasm *r) {
+    struct frame_buf **old = r->slots;
+    size_t old_num = r->num_slots;
+
+    struct frame_buf **slots = calloc(old_num * 2, sizeof(*slots));
+    if (slots == NULL) {
+        return false;
+    }
+
+    r->slots = slots;
+    r->num_slots = old_num * 2;
+
+    for (size_t i = 0; i < old_num; i++) {
+        if (old[i] != NULL) {
+            r->slots[frame_reasm_slot(r, old[i]->stream_id)] = old[i];
+        }
+    }
+
+    free(old);
+    return true;
+}
+
+static inline struct frame_buf *frame_reasm_alloc(struct frame_reasm *r) {
+    if (r->free == NULL) {
+        r->free = atomic_exchange_explicit(&r->released, NULL, memory_order_acquire);
+    }
+
+    struct frame_buf *b = r->free;
+    if (b != NULL) {
+        r->free = b->next;
+        return b;
+    }
+
+    b = malloc(sizeof(*b));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->data = malloc(FRAME_REASM_INIT_CAP);
+    if (b->data == NULL) {
+        free(b);
+        return NULL;
+    }
+
+    b->cap = FRAME_REASM_INIT_CAP;
+    b->owner = r;
+    r->allocated += 1;
+
+    return b;
+}
+
+/* Returns the frame being reassembled on the stream, starting an empty one if
+ * needed. Returns NULL if out of memory. */
+static inline struct frame_buf *frame_reasm_get(struct frame_reasm *r, uint64_t stream_id) {
+    size_t i = frame_reasm_slot(r, stream_id);
+    if (r->slots[i] != NULL) {
+        return r->slots[i];
+    }
+
+    // keep the load factor under 1/2, for short probe sequences
+    if ((r->count + 1) * 2 > r->num_slots) {
+        if (!frame_reasm_grow(r)) {
+            return NULL;
+        }
+
+        i = frame_reasm_slot(r, stream_id);
+    }
+
+    struct frame_buf *b = frame_reasm_alloc(r);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->len = 0;
+    b->stream_id = stream_id;
+    b->next = NULL;
+
+    r->slots[i] = b;
+    r->count += 1;
+
+    return b;
+}
+
+/* Makes sure at least n more bytes can be written at the end of the frame. */
+static inline bool frame_reasm_reserve(struct frame_buf *b, size_t n) {
+    if (b->cap - b->len >= n) {
+        return true;
+    }
+
+    size_t cap = b->cap;
+    while (cap - b->len < n) {
+        cap *= 2;
+    }
+
+    uint8_t *data = realloc(b->data, cap);
+    if (data == NULL) {
+        return false;
+    }
+
+    b->data = data;
+    b->cap = cap;
+
+    return true;
+}
+
+/* Removes the frame from its stream, after which the caller owns it until it
+ * is released. */
+static inline void frame_reasm_detach(struct frame_reasm *r, struct frame_buf *b) {
+    size_t i = frame_reasm_slot(r, b->stream_id);
+    if (r->slots[i] != b) {
+        return;
+    }
+
+    r->slots[i] = NULL;
+    r->count -= 1;
+    r->completed += 1;
+
+    // shift back the following entries which would no longer be reachable
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & (r->num_slots - 1);
+        if (r->slots[j] == NULL) {
+            break;
+        }
+
+        size_t home = frame_reasm_hash(r, r->slots[j]->stream_id);
+
+        // move it only if its home slot isn't cyclically in (i, j]
+        if (((j - home) & (r->num_slots - 1)) >= ((j - i) & (r->num_slots - 1))) {
+            r->slots[i] = r->slots[j];
+            r->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/* Gives a detached frame back for reuse. Can be called from any thread, and
+ * matches GDestroyNotify. */
+static inline void frame_reasm_release(void *ctx) {
+    struct frame_buf *b = ctx;
+    struct frame_reasm *r = b->owner;
+
+    b->next = atomic_load_explicit(&r->released, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&r->released, &b->next, b,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+#endif
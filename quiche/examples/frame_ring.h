@@ -0,0 +1,113 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounded lock-free multi-producer single-consumer queue of encoded frames.
+ *
+ * Pipeline threads push the frames they want to send, and the network thread,
+ * which is the only one calling into quiche, pops them. Each slot carries a
+ * sequence number telling whether it is free for the producer claiming that
+ * position, or filled for the consumer, so producers only contend on the tail
+ * index and never wait for the consumer. */
+
+#define FRAME_RING_SIZE 4096 /* must be a power of two */
+
+struct pending_frame {
+    const uint8_t *buf;
+    int len;
+    /* gives buf back to its owner once quiche doesn't need it anymore */
+    void (*release)(void *ctx);
+    void *release_ctx;
+    uint64_t stream_id;
+    int deadline_ms;
+    int priority;
+    uint64_t depend_id;
+    int pipeline_id;
+    bool eos; //end of all pipelines, sent without deadline
+    bool dgram; //sent as a datagram rather than on a stream
+};
+
+struct frame_ring_slot {
+    atomic_size_t seq;
+    struct pending_frame frame;
+};
+
+struct frame_ring {
+    struct frame_ring_slot slots[FRAME_RING_SIZE];
+
+    /* next position claimed by producers */
+    atomic_size_t tail;
+
+    /* next position read by the consumer, only used by the network thread */
+    size_t head;
+
+    /* number of frames rejected because the ring was full */
+    atomic_uint dropped;
+};
+
+static inline void frame_ring_init(struct frame_ring *ring) {
+    for (size_t i = 0; i < FRAME_RING_SIZE; i++) {
+        atomic_init(&ring->slots[i].seq, i);
+    }
+
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+    atomic_init(&ring->dropped, 0);
+}
+
+/* Called by any producer thread. Returns false without blocking if the ring
+ * is full, in which case the frame is still owned by the caller. */
+static inline bool frame_ring_push(struct frame_ring *ring,
+                                   const struct pending_frame *frame) {
+    struct frame_ring_slot *slot;
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (1) {
+        slot = &ring->slots[pos & (FRAME_RING_SIZE - 1)];
+
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->frame = *frame;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    return true;
+}
+
+/* Called by the network thread only. Returns false if the ring is empty. */
+static inline bool frame_ring_pop(struct frame_ring *ring,
+                                  struct pending_frame *frame) {
+    struct frame_ring_slot *slot = &ring->slots[ring->head & (FRAME_RING_SIZE - 1)];
+
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if ((intptr_t) seq - (intptr_t) (ring->head + 1) < 0) {
+        return false;
+    }
+
+    *frame = slot->frame;
+    atomic_store_explicit(&slot->seq, ring->head + FRAME_RING_SIZE,
+                          memory_order_release);
+    ring->head += 1;
+
+    return true;
+}
+
+#endif
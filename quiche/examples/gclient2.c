@@ -24,6 +24,8 @@
 // NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#define _GNU_SOURCE
+
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +46,10 @@
 
 #include <quiche.h>
 #include "gstsink.h"
+#include "conn_timer.h"
+#include "udp_batch.h"
+#include "stream_ids.h"
+#include "frame_reasm.h"
 
 #define LOCAL_CONN_ID_LEN 16
 
@@ -59,6 +65,9 @@
 #define APP_SYNTHETIC_DATA_PERIOD_IF_NEW_STREAM 1
 #define SYNTHETIC_DATA_LEN 1000000
 
+/* free space made available in a frame buffer before each stream read */
+#define FRAME_RECV_CHUNK 16384
+
 struct conn_io {
     int sock;
 
@@ -66,6 +75,13 @@ struct conn_io {
     socklen_t local_addr_len;
 
     quiche_conn *conn;
+
+    GSource *timer; //quiche timeout and pacing
+
+    /* next packet, held back until its pacing release time */
+    uint8_t paced_out[MAX_DATAGRAM_SIZE];
+    ssize_t paced_len;
+    quiche_send_info paced_info;
 };
 
 
@@ -84,6 +100,13 @@ SampleHandlerUserData *gl_pipeline_infos = NULL; //decode info
 static GMutex *gl_mutex = NULL;
 bool gl_if_init = false;
 
+/* frames being received, one per stream */
+static struct frame_reasm gl_reasm;
+
+/* receive batching statistics, packets per wake up of recv_cb */
+static uint64_t gl_recv_wakeups = 0;
+static uint64_t gl_recv_packets = 0;
+
 
 
 
@@ -99,68 +122,161 @@ static void debug_log(const char *line, void *argp) {
 }
 
 static void flush_egress(struct conn_io *conn_io) {
-    static uint8_t out[MAX_DATAGRAM_SIZE];
-
-    quiche_send_info send_info;
+    gint64 release_time = -1;
 
     while (1) {
-        ssize_t written = quiche_conn_send(conn_io->conn, out, sizeof(out),
-                                           &send_info);
+        if (conn_io->paced_len == 0) {
+            ssize_t written = quiche_conn_send(conn_io->conn, conn_io->paced_out,
+                                               sizeof(conn_io->paced_out),
+                                               &conn_io->paced_info);
 
-        if (written == QUICHE_ERR_DONE) {
-            //fprintf(stderr, "done writing\n");
-            break;
+            if (written == QUICHE_ERR_DONE) {
+                //fprintf(stderr, "done writing\n");
+                break;
+            }
+
+            if (written < 0) {
+                fprintf(stderr, "failed to create packet: %zd\n", written);
+                break;
+            }
+
+            conn_io->paced_len = written;
         }
 
-        if (written < 0) {
-            fprintf(stderr, "failed to create packet: %zd\n", written);
-            return;
+        // not due yet, the timer will resume flushing at the release time
+        release_time = conn_timer_release_time(&conn_io->paced_info);
+        if (release_time > g_get_monotonic_time() + PACING_GRANULARITY_US) {
+            break;
         }
+        release_time = -1;
 
-        ssize_t sent = sendto(conn_io->sock, out, written, 0,
-                              (struct sockaddr *) &send_info.to,
-                              send_info.to_len);
+        ssize_t written = conn_io->paced_len;
+        conn_io->paced_len = 0;
+
+        ssize_t sent = sendto(conn_io->sock, conn_io->paced_out, written, 0,
+                              (struct sockaddr *) &conn_io->paced_info.to,
+                              conn_io->paced_info.to_len);
 
         if (sent != written) {
             perror("failed to send");
-            return;
+            break;
         }
 
         //fprintf(stderr, "%ld, sent %zd bytes\n", getcurTime(), sent);
     }
+
+    conn_timer_rearm(conn_io->timer, conn_io->conn, release_time);
 }
 
-static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer data) {
-    if (gl_app_type == APP_H264_DATA) {
-        g_mutex_lock(gl_mutex);
+/* Runs on the main loop, like recv_cb. */
+static gboolean timeout_cb(gpointer data) {
+    struct conn_io *conn_io = data;
+
+    quiche_conn_on_timeout(conn_io->conn);
+
+    flush_egress(conn_io);
+
+    if (quiche_conn_is_closed(conn_io->conn)) {
+        quiche_stats stats;
+
+        quiche_conn_stats(conn_io->conn, &stats);
+        fprintf(stderr, "connection closed, recv=%zu sent=%zu lost=%zu rtt=%" PRIu64 "ns\n",
+                stats.recv, stats.sent, stats.lost, stats.paths[0].rtt);
+        fprintf(stderr, "recv batching: %" PRIu64 " packets in %" PRIu64 " wakeups\n",
+                gl_recv_packets, gl_recv_wakeups);
+        if (gl_app_type == APP_H264_DATA) {
+            fprintf(stderr, "frame reassembly: %" PRIu64 " frames with %zu buffers\n",
+                    gl_reasm.completed, gl_reasm.allocated);
+        }
+
+        g_main_loop_quit(gstreamer_receive_main_loop);
+        return G_SOURCE_REMOVE;
     }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Reads what is available on a stream into the frame being reassembled for it,
+ * and pushes the frame to its pipeline once the stream is finished or reset. */
+static void recv_frame(struct conn_io *conn_io, uint64_t s) {
+    bool fin = false;
+    ssize_t recv_len;
+
+    struct frame_buf *frame = frame_reasm_get(&gl_reasm, s);
+    if (frame == NULL) {
+        fprintf(stderr, "failed to allocate frame buffer\n");
+        return;
+    }
+
+    do {
+        if (!frame_reasm_reserve(frame, FRAME_RECV_CHUNK)) {
+            fprintf(stderr, "failed to grow frame buffer\n");
+            return;
+        }
+
+        recv_len = quiche_conn_stream_recv(conn_io->conn, s, frame->data + frame->len,
+                                           frame->cap - frame->len, &fin);
+        if (recv_len > 0) {
+            frame->len += recv_len;
+        }
+    } while (recv_len > 0 && !fin);
+
+    if (gl_if_debug) {
+        fprintf(stderr, "%ld stream_recv %zu bytes on stream id %" PRIu64 "\n", getcurTime(), frame->len, s);
+    }
+
+    if (recv_len < 0 && recv_len != QUICHE_ERR_DONE && recv_len != QUICHE_ERR_STREAM_RESET) {
+        fprintf(stderr, "other errors, recv len < 0\n");
+        return;
+    }
+
+    if (!fin && recv_len != QUICHE_ERR_STREAM_RESET) {
+        return;
+    }
+
+    // complete, or as much of it as will ever arrive
+    frame_reasm_detach(&gl_reasm, frame);
+
+    if (frame->len == 3 && memcmp(frame->data, "eos", 3) == 0) {
+        printf("get eos from srv\n");
+        frame_reasm_release(frame);
+        gstreamer_receive_stop_pipeline(gl_pipeline);
+        return;
+    }
+
+    if (frame->len == 0) {
+        fprintf(stderr, "empty frame on stream id %" PRIu64 "\n", s);
+        frame_reasm_release(frame);
+        return;
+    }
+
+    uint64_t pipelineId = (s - 9) % (4 * gl_num_pipeline) / 4;
+    fprintf(stderr, "gst push recv %zu bytes on pipeline %" PRIu64 ", stream id %" PRIu64 "\n",
+            frame->len, pipelineId, s);
+
+    // the pipeline gives the buffer back once done with it
+    gstreamer_receive_push_buffer_full(gl_pipeline, frame->data, frame->len, pipelineId,
+                                       frame_reasm_release, frame);
+}
+
+/* Reads and handles the packets received on the connection. Returns FALSE
+ * once nothing more can be received. */
+static gboolean recv_packets(gpointer data) {
     static bool req_sent = false;
 
     struct conn_io *conn_io = data;
 
     static uint8_t buf[65535];
-//    if (gl_app_type == APP_H264_DATA) {
-//        static char data_buf[40][500000]; //max number of concurrent streams
-//        static int data_buf_pos[40] = {0};
-//        static int data_buf_cur_avail = 0;
-//        static int sid_to_data_buf[1000000] = {0};
-//        if (!gl_if_init) {
-//            memset(data_buf_pos, 0, sizeof(data_buf_pos));
-//            memset(sid_to_data_buf, -1, sizeof(sid_to_data_buf));
-//            gl_if_init = true;
-//        }
-//    }
-
-    while (1) {
-        struct sockaddr_storage peer_addr;
-        socklen_t peer_addr_len = sizeof(peer_addr);
-        memset(&peer_addr, 0, peer_addr_len);
 
-        ssize_t read = recvfrom(conn_io->sock, buf, sizeof(buf), 0,
-                                (struct sockaddr *) &peer_addr,
-                                &peer_addr_len);
+    static struct udp_recv_batch batch;
+    static uint8_t *pkt_bufs[UDP_BATCH_RECV_MSGS * UDP_BATCH_MAX_SEGMENTS];
+    static size_t pkt_lens[UDP_BATCH_RECV_MSGS * UDP_BATCH_MAX_SEGMENTS];
+    static quiche_recv_info pkt_infos[UDP_BATCH_RECV_MSGS * UDP_BATCH_MAX_SEGMENTS];
+    unsigned int packets = 0;
 
-        if (read < 0) {
+    while (1) {
+        int n = udp_recv_batch(conn_io->sock, &batch);
+        if (n < 0) {
             if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
                 //fprintf(stderr, "recv would block\n");
                 break;
@@ -170,22 +286,37 @@ static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer d
             return FALSE;
         }
 
-        quiche_recv_info recv_info = {
-            (struct sockaddr *) &peer_addr,
-            peer_addr_len,
-
-            (struct sockaddr *) &conn_io->local_addr,
-            conn_io->local_addr_len,
-        };
+        // hand the whole batch to quiche in a single call
+        size_t count = 0;
+        struct udp_packet pkt;
+        while (udp_recv_batch_next(&batch, &pkt)) {
+            pkt_bufs[count] = pkt.buf;
+            pkt_lens[count] = pkt.len;
+            pkt_infos[count] = (quiche_recv_info) {
+                (struct sockaddr *) pkt.peer_addr,
+                pkt.peer_addr_len,
+
+                (struct sockaddr *) &conn_io->local_addr,
+                conn_io->local_addr_len,
+            };
+            count += 1;
+        }
 
-        ssize_t done = quiche_conn_recv(conn_io->conn, buf, read, &recv_info);
+        ssize_t done = quiche_conn_recv_batch(conn_io->conn, pkt_bufs, pkt_lens, pkt_infos, count);
 
         if (done < 0) {
-            fprintf(stderr, "failed to process packet %ld \n", done);
+            fprintf(stderr, "failed to process packets %ld \n", done);
             continue;
         }
 
-        //fprintf(stderr, "conn recv %zd bytes\n", done);
+        packets += done;
+        //fprintf(stderr, "conn recv %zd packets\n", done);
+    }
+
+    gl_recv_wakeups += 1;
+    gl_recv_packets += packets;
+    if (gl_if_debug) {
+        fprintf(stderr, "%ld recv cb processed %u packets\n", getcurTime(), packets);
     }
 
     //fprintf(stderr, "%ld done reading\n", getcurTime());
@@ -237,13 +368,20 @@ static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer d
         }
         else {
             uint64_t s = 0;
-            quiche_stream_iter *readable = quiche_conn_readable(conn_io->conn);
+            static struct stream_ids readable;
+            size_t num_readable = stream_ids_fill(&readable, conn_io->conn, quiche_conn_readable_into);
             static int total_size = 0;
             //fprintf(stderr, "%ld start iter stream \n", getcurTime());
 
 
-            while (quiche_stream_iter_next(readable, &s)) {
+            for (size_t i = 0; i < num_readable; i++) {
+                s = readable.ids[i];
                 //fprintf(stderr, "%ld, stream %" PRIu64 " is readable\n", getcurTime(), s);
+                if (gl_app_type == APP_H264_DATA) {
+                    recv_frame(conn_io, s);
+                    continue;
+                }
+
                 bool fin = false;
                 ssize_t recv_len = quiche_conn_stream_recv(conn_io->conn, s, buf, sizeof(buf), &fin);
                 total_size += recv_len;
@@ -256,52 +394,6 @@ static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer d
                     continue;
                 }
 
-                /*if (gl_app_type == APP_H264_DATA) {
-                    //if recv eos
-                    if (memcmp(buf, "eos", 3) == 0) {
-                        printf("get eos from srv\n");
-                        gstreamer_receive_stop_pipeline(gl_pipeline);
-                        break;
-                    }
-
-                    //push the recvd bytes back to the data buffer
-                    int sid = ((s - 1) / 4 - 1); //<1000000 sid_to_bufid
-                    if (sid_to_data_buf[sid] == -1) {
-                        //this is a new stream
-                        if (recv_len == QUICHE_ERR_STREAM_RESET) {
-                            fprintf(stderr, "reset on non-existing stream\n");
-                            continue;
-                        }
-                        int loop = 0;
-                        while (data_buf_pos[data_buf_cur_avail] != 0) {
-                            data_buf_cur_avail = (data_buf_cur_avail + 1) % 40;
-                            loop += 1;
-                            if (loop > 35) {
-                                fprintf(stderr, "error, exceed concurrent streams\n");
-                                exit(1);
-                            }
-                        }
-                        sid_to_data_buf[sid] = data_buf_cur_avail;
-                        data_buf_cur_avail = (data_buf_cur_avail + 1) % 40;
-                    }
-
-                    int buffer_id = sid_to_data_buf[sid];
-                    //int buffer_id = ((s - 1) / 4 - 1) % 40;
-                    //fprintf(stderr, "push to data buffer %d, cur pos %d, next pos %ld\n", buffer_id, data_buf_pos[buffer_id], data_buf_pos[buffer_id] + recv_len);
-                    if (recv_len != QUICHE_ERR_STREAM_RESET) {
-                        memcpy(data_buf[buffer_id] + data_buf_pos[buffer_id], buf, recv_len);
-                        data_buf_pos[buffer_id] += recv_len;
-                    }
-                    if (fin || recv_len == QUICHE_ERR_STREAM_RESET) {
-                        uint64_t pipelineId = (s - 9) % (4 * gl_num_pipeline) / 4;
-                        frame_cnt += 1;
-                        fprintf(stderr, "gst push recv %d bytes on pipeline %lu, stream id %ld\n",
-                                data_buf_pos[buffer_id], pipelineId, s);
-                        gstreamer_receive_push_buffer(gl_pipeline, data_buf[buffer_id], data_buf_pos[buffer_id],
-                                                      pipelineId);
-                        data_buf_pos[buffer_id] = 0;
-                    }
-                }*/
                 // send back an ack in application layer.
 //                static const uint8_t echo[] = "echo\n";
 //                if (quiche_conn_stream_send(conn_io->conn, 8, echo, sizeof(echo), false) < sizeof(echo)) {
@@ -310,15 +402,24 @@ static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer d
                 //flush_egress(conn_io);
             }
             //fprintf(stderr, "%ld end iter stream \n", getcurTime());
-            quiche_stream_iter_free(readable);
         }
     }
 
     flush_egress(conn_io);
+    return TRUE;
+}
+
+static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer data) {
+    if (gl_app_type == APP_H264_DATA) {
+        g_mutex_lock(gl_mutex);
+    }
+
+    gboolean ret = recv_packets(data);
+
     if (gl_app_type == APP_H264_DATA) {
         g_mutex_unlock(gl_mutex);
     }
-    return TRUE;
+    return ret;
 }
 
 void generate_pipeline_str(char * ppl_str){
@@ -421,6 +522,10 @@ int main(int argc, char *argv[]) {
         read_pipeline_conf("decode_ppl.txt", gl_pipeline_infos, gl_num_pipeline);
         gl_mutex = (GMutex *) malloc(sizeof(GMutex));
         g_mutex_init(gl_mutex);
+        if (!frame_reasm_init(&gl_reasm)) {
+            fprintf(stderr, "failed to allocate frame reassembly\n");
+            return -1;
+        }
     }
     else if (gl_app_type == APP_SYNTHETIC_DATA_PERIOD) {
         sscanf(argv[6], "%d", &gl_num_streams);
@@ -465,6 +570,8 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    udp_enable_gro(sock);
+
     quiche_config *config = quiche_config_new(0xbabababa);
     if (config == NULL) {
         fprintf(stderr, "failed to create config\n");
@@ -529,6 +636,8 @@ int main(int argc, char *argv[]) {
 
     conn_io->sock = sock;
     conn_io->conn = conn;
+    conn_io->paced_len = 0;
+    conn_io->timer = conn_timer_new(timeout_cb, conn_io);
 
     /* main thread waiting for recv IO event*/
     gpointer m_data = conn_io;
@@ -544,6 +653,7 @@ int main(int argc, char *argv[]) {
         generate_pipeline_str_save_to_file(pipelineStr);
         gl_pipeline = gstreamer_receive_create_pipeline(pipelineStr);
         gstreamer_receive_start_pipeline(gl_pipeline);
+        gstreamer_receive_bind_srcs(gl_pipeline, gl_num_pipeline);
     }
     flush_egress(conn_io);
 
@@ -551,6 +661,7 @@ int main(int argc, char *argv[]) {
 
     //gstreamer_receive_destroy_pipeline(gl_pipeline);
     freeaddrinfo(peer);
+    conn_timer_free(conn_io->timer);
     quiche_conn_free(conn);
     quiche_config_free(config);
 
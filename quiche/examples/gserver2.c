@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,8 +12,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
-#include <sys/time.h>
 
 #include <gio/gio.h>
 #include <glib.h>
@@ -21,8 +23,10 @@
 #include <quiche.h>
 
 #include "gstsrc.h"
-#define MAX_SEND_TIMES 4
-#define MAX_SEND_SIZE 1350*4
+#include "frame_ring.h"
+#include "conn_timer.h"
+#include "udp_batch.h"
+#include "stream_ids.h"
 
 #define LOCAL_CONN_ID_LEN 16
 
@@ -59,6 +63,18 @@ struct conn_io {
     struct sockaddr_storage peer_addr;
     socklen_t peer_addr_len;
 
+    GSource *timer; //quiche timeout and pacing
+
+    /* packets built by quiche but not sent yet, see flush_egress() */
+    uint8_t burst[UDP_BATCH_MAX_BYTES + MAX_DATAGRAM_SIZE];
+    size_t burst_len;
+    size_t seg_size; //size of the first packet of the burst
+    quiche_send_info burst_info;
+
+    /* packet that can't join the current burst, stored right after it */
+    size_t next_len;
+    quiche_send_info next_info;
+
     UT_hash_handle hh;
 };
 
@@ -84,12 +100,30 @@ static GThread **gl_pipeline_threads = NULL;
 
 struct conn_io * gl_recv_conn_io = NULL; //store client info for later use
 
+/* frames handed over by the pipeline threads to the network thread */
+static struct frame_ring *gl_frame_ring = NULL;
+static int gl_frame_ring_fd = -1; //eventfd waking up the network thread
+static atomic_bool gl_frame_ring_signaled = false;
+
+/* per pipeline, set by the network thread when quiche rejects a frame, so
+ * that the pipeline skips the frames depending on it until the next SPS */
+static atomic_bool *gl_pipeline_skip = NULL;
+
+/* receive batching statistics, packets per wake up of recv_cb */
+static uint64_t gl_recv_wakeups = 0;
+static uint64_t gl_recv_packets = 0;
 
+/* The synthetic apps call quiche from their sending thread under gl_mutex, the
+ * H.264 pipelines only push frames to gl_frame_ring instead, so that quiche is
+ * only called from the network thread. */
+static inline bool conn_needs_lock() {
+    return gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE;
+}
+
+
+// Same monotonic clock (in us) that quiche uses to evaluate stream deadlines.
 long getcurTime() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    long curtime = tv.tv_sec *1000000 + tv.tv_usec;
-    return curtime;
+    return (long) quiche_clock_micros();
 }
 
 
@@ -97,59 +131,158 @@ static void debug_log(const char *line, void *argp) {
     fprintf(stderr, "%s\n", line);
 }
 
-static void flush_egress(struct conn_io *conn_io, bool is_recv) {
-    static uint8_t out[MAX_DATAGRAM_SIZE];
-    static int send_times = 0;
-    static int send_size = 0;
-
-    quiche_send_info send_info;
-    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-        if (is_recv) {
-            send_times = 0;
-            send_size = 0;
-        }
+/* Packets can be sent in the same burst if they are released at the same time
+ * to the same peer. */
+static bool same_burst(const quiche_send_info *a, const quiche_send_info *b) {
+    return a->at.tv_sec == b->at.tv_sec && a->at.tv_nsec == b->at.tv_nsec &&
+           a->to_len == b->to_len && memcmp(&a->to, &b->to, a->to_len) == 0;
+}
+
+/* Whether another packet can be appended to the burst. The kernel splits a
+ * burst into segments of the size of its first packet, so it ends with the
+ * first shorter packet. */
+static bool burst_can_grow(const struct conn_io *conn_io, size_t quantum) {
+    if (conn_io->next_len > 0) {
+        return false;
+    }
+
+    if (conn_io->burst_len == 0) {
+        return true;
+    }
+
+    return conn_io->burst_len % conn_io->seg_size == 0 &&
+           conn_io->burst_len / conn_io->seg_size < UDP_BATCH_MAX_SEGMENTS &&
+           conn_io->burst_len + MAX_DATAGRAM_SIZE <= quantum;
+}
+
+/* Sends what quiche has to send as bursts of up to send_quantum bytes, each
+ * with a single GSO send once the pacer releases it. A burst that isn't due
+ * yet is kept, and the connection timer resumes flushing at its release
+ * time. */
+static void flush_egress(struct conn_io *conn_io) {
+    if (conn_needs_lock()) {
         g_mutex_lock(gl_mutex);
     }
+    gint64 release_time = -1;
     while (1) {
-        if (gl_app_type == APP_H264_DATA) {
-            if (send_times > MAX_SEND_TIMES && send_size > MAX_SEND_SIZE) {
+        size_t quantum = quiche_conn_send_quantum(conn_io->conn);
+        if (quantum > UDP_BATCH_MAX_BYTES) {
+            quantum = UDP_BATCH_MAX_BYTES;
+        }
+
+        bool done = false;
+        while (burst_can_grow(conn_io, quantum)) {
+            quiche_send_info send_info;
+            ssize_t written = quiche_conn_send(conn_io->conn, conn_io->burst + conn_io->burst_len,
+                                               MAX_DATAGRAM_SIZE, &send_info);
+
+            if (written == QUICHE_ERR_DONE) {
+                //fprintf(stderr, "%ld, flush egress done writing\n", getcurTime());
+                done = true;
+                break;
+            }
+
+            if (written < 0) {
+                fprintf(stderr, "%ld, flush egress failed to create packet: %zd\n", getcurTime(), written);
+                done = true;
                 break;
             }
+
+            if (conn_io->burst_len == 0) {
+                conn_io->burst_info = send_info;
+                conn_io->seg_size = written;
+            }
+            else if (!same_burst(&conn_io->burst_info, &send_info) || written > conn_io->seg_size) {
+                conn_io->next_len = written;
+                conn_io->next_info = send_info;
+                break;
+            }
+
+            conn_io->burst_len += written;
         }
-        ssize_t written = quiche_conn_send(conn_io->conn, out, sizeof(out), &send_info);
 
-        if (written == QUICHE_ERR_DONE) {
-            //fprintf(stderr, "%ld, flush egress done writing\n", getcurTime());
+        if (conn_io->burst_len == 0) {
             break;
         }
 
-        if (written < 0) {
-            fprintf(stderr, "%ld, flush egress failed to create packet: %zd\n", getcurTime(), written);
-            return;
+        // not due yet, the timer will resume flushing at the release time
+        release_time = conn_timer_release_time(&conn_io->burst_info);
+        if (release_time > g_get_monotonic_time() + PACING_GRANULARITY_US) {
+            break;
         }
+        release_time = -1;
 
-
-        ssize_t sent = sendto(conn_io->sock, out, written, 0,
-                              (struct sockaddr *) &send_info.to,
-                              send_info.to_len);
+        size_t written = conn_io->burst_len;
+        ssize_t sent = udp_send_batch(conn_io->sock, conn_io->burst, written, conn_io->seg_size,
+                                      (struct sockaddr *) &conn_io->burst_info.to,
+                                      conn_io->burst_info.to_len);
 
         gl_debug_total_size += sent;
         if (gl_if_debug == 1) {
             fprintf(stderr,
-                    "%ld, flush egress written size: %zd bytes, sent size: %zd bytes; total: %d bytes, cnt %d\n",
-                    getcurTime(), written, sent, gl_debug_total_size, send_times);
+                    "%ld, flush egress written size: %zu bytes, sent size: %zd bytes; total: %d bytes, segments %zu\n",
+                    getcurTime(), written, sent, gl_debug_total_size,
+                    (written + conn_io->seg_size - 1) / conn_io->seg_size);
         }
-        if (sent != written) {
+
+        // whatever wasn't sent is lost, and will be retransmitted by quiche
+        memmove(conn_io->burst, conn_io->burst + written, conn_io->next_len);
+        conn_io->burst_len = conn_io->next_len;
+        conn_io->seg_size = conn_io->next_len;
+        conn_io->burst_info = conn_io->next_info;
+        conn_io->next_len = 0;
+
+        if (sent != (ssize_t) written || (done && conn_io->burst_len == 0)) {
             //perror("flush egress failed to send");
             break;
         }
+    }
+    conn_timer_rearm(conn_io->timer, conn_io->conn, release_time);
+    if (conn_needs_lock()) {
+        g_mutex_unlock(gl_mutex);
+    }
+}
+
+static void close_conn(struct conn_io *conn_io) {
+    quiche_stats stats;
+
+    quiche_conn_stats(conn_io->conn, &stats);
+    fprintf(stderr, "connection closed, recv=%zu sent=%zu lost=%zu rtt=%" PRIu64 "ns cwnd=%zu\n",
+            stats.recv, stats.sent, stats.lost, stats.paths[0].rtt, stats.paths[0].cwnd);
+    fprintf(stderr, "recv batching: %" PRIu64 " packets in %" PRIu64 " wakeups\n",
+            gl_recv_packets, gl_recv_wakeups);
+    fprintf(stderr, "dropped blocks=%" PRIu64 " bytes=%" PRIu64 "\n",
+            stats.dropped_blocks, stats.dropped_bytes);
 
-        send_times += 1;
-        send_size += sent;
+    if (gl_recv_conn_io == conn_io) {
+        gl_recv_conn_io = NULL;
     }
-    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
+
+    HASH_DELETE(hh, gl_conns->h, conn_io);
+    conn_timer_free(conn_io->timer);
+    quiche_conn_free(conn_io->conn);
+    free(conn_io);
+}
+
+static gboolean timeout_cb(gpointer data) {
+    struct conn_io *conn_io = data;
+
+    if (conn_needs_lock()) {
+        g_mutex_lock(gl_mutex);
+    }
+    quiche_conn_on_timeout(conn_io->conn);
+    if (conn_needs_lock()) {
         g_mutex_unlock(gl_mutex);
     }
+
+    flush_egress(conn_io);
+
+    if (quiche_conn_is_closed(conn_io->conn)) {
+        close_conn(conn_io);
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
 }
 
 static void mint_token(const uint8_t *dcid, size_t dcid_len,
@@ -244,6 +377,8 @@ static struct conn_io *create_conn(uint8_t *scid, size_t scid_len,
     memcpy(&conn_io->peer_addr, peer_addr, peer_addr_len);
     conn_io->peer_addr_len = peer_addr_len;
 
+    conn_io->timer = conn_timer_new(timeout_cb, conn_io);
+
     HASH_ADD(hh, gl_conns->h, cid, LOCAL_CONN_ID_LEN, conn_io);
 
     fprintf(stderr, "new connection\n");
@@ -307,7 +442,7 @@ void pipeline_th_call(gpointer data) {
             }
             g_mutex_unlock(gl_mutex);
 
-            flush_egress(gl_recv_conn_io, false);
+            flush_egress(gl_recv_conn_io);
             usleep(sleep_ms * 1000);
 
             if (gl_app_syn_period_new_stream != APP_SYNTHETIC_DATA_PERIOD_IF_NEW_STREAM) {
@@ -346,7 +481,7 @@ void pipeline_th_call(gpointer data) {
                 urgency += 1;
             }
             g_mutex_unlock(gl_mutex);
-            flush_egress(gl_recv_conn_io, false);
+            flush_egress(gl_recv_conn_io);
             usleep(sleep_ms * 1000);
 
             cur_stream_id = 9;
@@ -393,288 +528,250 @@ static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer d
 
     struct conn_io *tmp, *conn_io = NULL;
 
+    static struct udp_recv_batch batch;
     static uint8_t buf[65535];
     static uint8_t out[MAX_DATAGRAM_SIZE];
 
-    while (1) {
-        if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-            g_mutex_lock(gl_mutex);
-        }
-
-        //fprintf(stderr, "%ld, recv cb get lock\n", getcurTime());
-        struct sockaddr_storage peer_addr;
-        socklen_t peer_addr_len = sizeof(peer_addr);
-        memset(&peer_addr, 0, peer_addr_len);
+    unsigned int packets = 0;
 
-        ssize_t read = recvfrom(gl_conns->sock, buf, sizeof(buf), 0,
-                                (struct sockaddr *) &peer_addr,
-                                &peer_addr_len);
-        if (read < 0) {
+    while (1) {
+        int n = udp_recv_batch(gl_conns->sock, &batch);
+        if (n < 0) {
             if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
                 //fprintf(stderr, "recv would block\n");
-                if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                    g_mutex_unlock(gl_mutex);
-                }
                 break;
             }
 
             perror("failed to read");
-            if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                g_mutex_unlock(gl_mutex);
-            }
             return FALSE;
         }
 
-        uint8_t type;
-        uint32_t version;
+        // the whole batch is fed to quiche under a single lock
+        if (conn_needs_lock()) {
+            g_mutex_lock(gl_mutex);
+        }
+
+        struct udp_packet pkt;
+        while (udp_recv_batch_next(&batch, &pkt)) {
+            packets += 1;
+
+            uint8_t type;
+            uint32_t version;
 
-        uint8_t scid[QUICHE_MAX_CONN_ID_LEN];
-        size_t scid_len = sizeof(scid);
+            uint8_t scid[QUICHE_MAX_CONN_ID_LEN];
+            size_t scid_len = sizeof(scid);
 
-        uint8_t dcid[QUICHE_MAX_CONN_ID_LEN];
-        size_t dcid_len = sizeof(dcid);
+            uint8_t dcid[QUICHE_MAX_CONN_ID_LEN];
+            size_t dcid_len = sizeof(dcid);
 
-        uint8_t odcid[QUICHE_MAX_CONN_ID_LEN];
-        size_t odcid_len = sizeof(odcid);
+            uint8_t odcid[QUICHE_MAX_CONN_ID_LEN];
+            size_t odcid_len = sizeof(odcid);
 
-        uint8_t token[MAX_TOKEN_LEN];
-        size_t token_len = sizeof(token);
+            uint8_t token[MAX_TOKEN_LEN];
+            size_t token_len = sizeof(token);
 
-        int rc = quiche_header_info(buf, read, LOCAL_CONN_ID_LEN, &version,
-                                    &type, scid, &scid_len, dcid, &dcid_len,
-                                    token, &token_len);
-        if (rc < 0) {
-            fprintf(stderr, "failed to parse header: %d\n", rc);
-            if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                g_mutex_unlock(gl_mutex);
+            int rc = quiche_header_info(pkt.buf, pkt.len, LOCAL_CONN_ID_LEN, &version,
+                                        &type, scid, &scid_len, dcid, &dcid_len,
+                                        token, &token_len);
+            if (rc < 0) {
+                fprintf(stderr, "failed to parse header: %d\n", rc);
+                continue;
             }
-            continue;
-        }
 
-        HASH_FIND(hh, gl_conns->h, dcid, dcid_len, conn_io);
+            HASH_FIND(hh, gl_conns->h, dcid, dcid_len, conn_io);
 
-        if (conn_io == NULL) {
-            if (!quiche_version_is_supported(version)) {
-                fprintf(stderr, "version negotiation\n");
+            if (conn_io == NULL) {
+                if (!quiche_version_is_supported(version)) {
+                    fprintf(stderr, "version negotiation\n");
 
-                ssize_t written = quiche_negotiate_version(scid, scid_len,
-                                                           dcid, dcid_len,
-                                                           out, sizeof(out));
+                    ssize_t written = quiche_negotiate_version(scid, scid_len,
+                                                               dcid, dcid_len,
+                                                               out, sizeof(out));
 
-                if (written < 0) {
-                    fprintf(stderr, "failed to create vneg packet: %zd\n",
-                            written);
-                    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                        g_mutex_unlock(gl_mutex);
+                    if (written < 0) {
+                        fprintf(stderr, "failed to create vneg packet: %zd\n",
+                                written);
+                        continue;
                     }
-                    continue;
-                }
 
-                ssize_t sent = sendto(gl_conns->sock, out, written, 0,
-                                      (struct sockaddr *) &peer_addr,
-                                      peer_addr_len);
-                if (sent != written) {
-                    perror("failed to send");
-                    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                        g_mutex_unlock(gl_mutex);
+                    ssize_t sent = sendto(gl_conns->sock, out, written, 0,
+                                          (struct sockaddr *) pkt.peer_addr,
+                                          pkt.peer_addr_len);
+                    if (sent != written) {
+                        perror("failed to send");
+                        continue;
                     }
+                    //fprintf(stderr, "%ld, sent %zd bytes\n", getcurTime(), sent);
                     continue;
                 }
-                //fprintf(stderr, "%ld, sent %zd bytes\n", getcurTime(), sent);
-                if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                    g_mutex_unlock(gl_mutex);
-                }
-                continue;
-            }
 
-            if (token_len == 0) {
-                fprintf(stderr, "stateless retry\n");
+                if (token_len == 0) {
+                    fprintf(stderr, "stateless retry\n");
 
-                mint_token(dcid, dcid_len, &peer_addr, peer_addr_len,
-                           token, &token_len);
+                    mint_token(dcid, dcid_len, pkt.peer_addr, pkt.peer_addr_len,
+                               token, &token_len);
 
-                uint8_t new_cid[LOCAL_CONN_ID_LEN];
+                    uint8_t new_cid[LOCAL_CONN_ID_LEN];
 
-                if (gen_cid(new_cid, LOCAL_CONN_ID_LEN) == NULL) {
-                    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                        g_mutex_unlock(gl_mutex);
+                    if (gen_cid(new_cid, LOCAL_CONN_ID_LEN) == NULL) {
+                        continue;
                     }
-                    continue;
-                }
 
-                ssize_t written = quiche_retry(scid, scid_len,
-                                               dcid, dcid_len,
-                                               new_cid, LOCAL_CONN_ID_LEN,
-                                               token, token_len,
-                                               version, out, sizeof(out));
-
-                if (written < 0) {
-                    fprintf(stderr, "failed to create retry packet: %zd\n",
-                            written);
-                    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                        g_mutex_unlock(gl_mutex);
+                    ssize_t written = quiche_retry(scid, scid_len,
+                                                   dcid, dcid_len,
+                                                   new_cid, LOCAL_CONN_ID_LEN,
+                                                   token, token_len,
+                                                   version, out, sizeof(out));
+
+                    if (written < 0) {
+                        fprintf(stderr, "failed to create retry packet: %zd\n",
+                                written);
+                        continue;
                     }
-                    continue;
-                }
 
-                ssize_t sent = sendto(gl_conns->sock, out, written, 0,
-                                      (struct sockaddr *) &peer_addr,
-                                      peer_addr_len);
-                if (sent != written) {
-                    perror("failed to send");
-                    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                        g_mutex_unlock(gl_mutex);
+                    ssize_t sent = sendto(gl_conns->sock, out, written, 0,
+                                          (struct sockaddr *) pkt.peer_addr,
+                                          pkt.peer_addr_len);
+                    if (sent != written) {
+                        perror("failed to send");
+                        continue;
                     }
+                    //fprintf(stderr, "%ld, sent %zd bytes\n", getcurTime(), sent);
                     continue;
                 }
-                //fprintf(stderr, "%ld, sent %zd bytes\n", getcurTime(), sent);
-                if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                    g_mutex_unlock(gl_mutex);
-                }
-                continue;
-            }
 
 
-            if (!validate_token(token, token_len, &peer_addr, peer_addr_len,
-                               odcid, &odcid_len)) {
-                fprintf(stderr, "invalid address validation token\n");
-                if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                    g_mutex_unlock(gl_mutex);
+                if (!validate_token(token, token_len, pkt.peer_addr, pkt.peer_addr_len,
+                                   odcid, &odcid_len)) {
+                    fprintf(stderr, "invalid address validation token\n");
+                    continue;
                 }
-                continue;
-            }
 
-            conn_io = create_conn(dcid, dcid_len, odcid, odcid_len,
-                                  gl_conns->local_addr, gl_conns->local_addr_len,
-                                  &peer_addr, peer_addr_len);
+                conn_io = create_conn(dcid, dcid_len, odcid, odcid_len,
+                                      gl_conns->local_addr, gl_conns->local_addr_len,
+                                      pkt.peer_addr, pkt.peer_addr_len);
 
-            if (conn_io == NULL) {
-                if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                    g_mutex_unlock(gl_mutex);
+                if (conn_io == NULL) {
+                    continue;
                 }
-                continue;
             }
-        }
 
-        quiche_recv_info recv_info = {
-            (struct sockaddr *)&peer_addr,
-            peer_addr_len,
+            quiche_recv_info recv_info = {
+                (struct sockaddr *)pkt.peer_addr,
+                pkt.peer_addr_len,
 
-            gl_conns->local_addr,
-            gl_conns->local_addr_len,
-        };
+                gl_conns->local_addr,
+                gl_conns->local_addr_len,
+            };
 
-        //process ACK, update rtt
-        ssize_t done = quiche_conn_recv(conn_io->conn, buf, read, &recv_info);
+            //process ACK, update rtt
+            ssize_t done = quiche_conn_recv(conn_io->conn, pkt.buf, pkt.len, &recv_info);
 
-        if (done < 0) {
-            fprintf(stderr, "failed to process packet: %zd\n", done);
-            if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                g_mutex_unlock(gl_mutex);
-            }
-            continue;
-        }
-        //fprintf(stderr, "%ld, recv %zd bytes\n", getcurTime(), done);
-
-        if (quiche_conn_is_established(conn_io->conn)) {
-            if (gl_use_dgram && quiche_conn_is_readable(conn_io->conn)) {
-                //for dgram recv
-                ssize_t recv_len = quiche_conn_dgram_recv(conn_io->conn, buf, sizeof(buf));
-                printf("RECV from client: %s", buf);
-                if (recv_len < 0) {
-                    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                        g_mutex_unlock(gl_mutex);
-                    }
-                    return FALSE;
-                }
-                ready_to_send = true;
-                gl_recv_conn_io = conn_io;
+            if (done < 0) {
+                fprintf(stderr, "failed to process packet: %zd\n", done);
+                continue;
             }
-            else {
-                //for stream recv
-                uint64_t s = 0;
-                quiche_stream_iter *readable = quiche_conn_readable(conn_io->conn);
-                while (quiche_stream_iter_next(readable, &s)) {
-                    //fprintf(stderr, "stream %" PRIu64 " is readable\n", s);
-                    bool fin = false;
-                    ssize_t recv_len = quiche_conn_stream_recv(conn_io->conn, s, buf, sizeof(buf), &fin);
-                    fprintf(stdout, "RECV from client: %s", buf);
+            //fprintf(stderr, "%ld, recv %zd bytes\n", getcurTime(), done);
+
+            if (quiche_conn_is_established(conn_io->conn)) {
+                if (gl_use_dgram && quiche_conn_is_readable(conn_io->conn)) {
+                    //for dgram recv
+                    ssize_t recv_len = quiche_conn_dgram_recv(conn_io->conn, buf, sizeof(buf));
+                    printf("RECV from client: %s", buf);
                     if (recv_len < 0) {
-                        if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
+                        if (conn_needs_lock()) {
                             g_mutex_unlock(gl_mutex);
                         }
-                        fprintf(stdout, "recv len <0");
                         return FALSE;
                     }
-                    if (fin && !ready_to_send) {
-                        ready_to_send = true;
-                        gl_recv_conn_io = conn_io;
-
-                        // For SYN APP
-                        if (gl_app_type == APP_SYNTHETIC_DATA) {
-                            //TODO: send same data on different streams
-                            int cur_stream_id = 9;
-                            static uint8_t foo_buffer[50000000]; //50MB
-                            int data_len_per_stream = 50000000 / gl_num_streams;
-                            for (int k = 1; k <= 3; k++) { // k: current urgency level
-                                for (int i = 0; i < gl_num_streams; i++) {
-                                    int size = quiche_conn_stream_send_full(gl_recv_conn_io->conn, cur_stream_id,
-                                                                            foo_buffer, data_len_per_stream, true, 0,
-                                                                            k, 0);
-                                    //int size = quiche_conn_stream_send(gl_recv_conn_io->conn, cur_stream_id, foo_buffer, data_len_per_stream, true);
-                                    if (gl_if_debug) {
-                                        fprintf(stderr, "%ld, stream_send %d/%d bytes on stream id %d on urgency %d\n",
-                                                getcurTime(),
-                                                size, data_len_per_stream, cur_stream_id, k);
+                    ready_to_send = true;
+                    gl_recv_conn_io = conn_io;
+                }
+                else {
+                    //for stream recv
+                    uint64_t s = 0;
+                    static struct stream_ids readable;
+                    size_t num_readable = stream_ids_fill(&readable, conn_io->conn, quiche_conn_readable_into);
+                    for (size_t i = 0; i < num_readable; i++) {
+                        s = readable.ids[i];
+                        //fprintf(stderr, "stream %" PRIu64 " is readable\n", s);
+                        bool fin = false;
+                        ssize_t recv_len = quiche_conn_stream_recv(conn_io->conn, s, buf, sizeof(buf), &fin);
+                        fprintf(stdout, "RECV from client: %s", buf);
+                        if (recv_len < 0) {
+                            if (conn_needs_lock()) {
+                                g_mutex_unlock(gl_mutex);
+                            }
+                            fprintf(stdout, "recv len <0");
+                            return FALSE;
+                        }
+                        if (fin && !ready_to_send) {
+                            ready_to_send = true;
+                            gl_recv_conn_io = conn_io;
+
+                            // For SYN APP
+                            if (gl_app_type == APP_SYNTHETIC_DATA) {
+                                //TODO: send same data on different streams
+                                int cur_stream_id = 9;
+                                static uint8_t foo_buffer[50000000]; //50MB
+                                int data_len_per_stream = 50000000 / gl_num_streams;
+                                for (int k = 1; k <= 3; k++) { // k: current urgency level
+                                    for (int i = 0; i < gl_num_streams; i++) {
+                                        int size = quiche_conn_stream_send_full(gl_recv_conn_io->conn, cur_stream_id,
+                                                                                foo_buffer, data_len_per_stream, true, 0,
+                                                                                k, 0);
+                                        //int size = quiche_conn_stream_send(gl_recv_conn_io->conn, cur_stream_id, foo_buffer, data_len_per_stream, true);
+                                        if (gl_if_debug) {
+                                            fprintf(stderr, "%ld, stream_send %d/%d bytes on stream id %d on urgency %d\n",
+                                                    getcurTime(),
+                                                    size, data_len_per_stream, cur_stream_id, k);
+                                        }
+                                        cur_stream_id += 4;
                                     }
-                                    cur_stream_id += 4;
                                 }
                             }
-                        }
-                        else if (gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
-                            int cur_stream_id = 44009;
-                            int urgency = 1;
-                            static uint8_t foo_buffer[10];
-                            for (int i = 0; i < gl_num_urgency; i++) {
-                                int size = quiche_conn_stream_send_full(gl_recv_conn_io->conn, cur_stream_id, foo_buffer, 10, true, 0, urgency, 0);
-                                //int size = quiche_conn_stream_send(gl_recv_conn_io->conn, cur_stream_id, foo_buffer, 10, true);
-                                if (gl_if_debug) {
-                                    fprintf(stderr, "%ld, stream_send %d/%d bytes on stream id %d\n", getcurTime(),
-                                            size, 10, cur_stream_id);
+                            else if (gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
+                                int cur_stream_id = 44009;
+                                int urgency = 1;
+                                static uint8_t foo_buffer[10];
+                                for (int i = 0; i < gl_num_urgency; i++) {
+                                    int size = quiche_conn_stream_send_full(gl_recv_conn_io->conn, cur_stream_id, foo_buffer, 10, true, 0, urgency, 0);
+                                    //int size = quiche_conn_stream_send(gl_recv_conn_io->conn, cur_stream_id, foo_buffer, 10, true);
+                                    if (gl_if_debug) {
+                                        fprintf(stderr, "%ld, stream_send %d/%d bytes on stream id %d\n", getcurTime(),
+                                                size, 10, cur_stream_id);
+                                    }
+                                    cur_stream_id += 4;
+                                    urgency += 1;
                                 }
-                                cur_stream_id += 4;
-                                urgency += 1;
+
                             }
 
                         }
-
                     }
                 }
-                quiche_stream_iter_free(readable);
-            }
 
+            }
         }
-        if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
+        if (conn_needs_lock()) {
             g_mutex_unlock(gl_mutex);
         }
     }
 
+    gl_recv_wakeups += 1;
+    gl_recv_packets += packets;
+    if (gl_if_debug == 1) {
+        fprintf(stderr, "%ld, recv cb processed %u packets\n", getcurTime(), packets);
+    }
+
     HASH_ITER(hh, gl_conns->h, conn_io, tmp) {
-        flush_egress(conn_io, true);//send ack frame, etc
+        flush_egress(conn_io);//send ack frame, etc
         if (quiche_conn_is_closed(conn_io->conn)) {
-            quiche_stats stats;
-
-            quiche_conn_stats(conn_io->conn, &stats);
-            fprintf(stderr, "connection closed, recv=%zu sent=%zu lost=%zu rtt=%" PRIu64 "ns cwnd=%zu\n",
-                    stats.recv, stats.sent, stats.lost, stats.paths[0].rtt, stats.paths[0].cwnd);
-
-            HASH_DELETE(hh, gl_conns->h, conn_io);
-            quiche_conn_free(conn_io->conn);
-            free(conn_io);
+            close_conn(conn_io);
         }
     }
 
-    //make sure the static buffer in flush_egress is init by the main thread
+    //start the pipelines once the connection is established
     if (gl_app_type == APP_H264_DATA) {
         if (ready_to_send && !is_sending) {
             printf("starting all pipelines\n");
@@ -695,75 +792,147 @@ static gboolean recv_cb (GIOChannel *channel, GIOCondition condition, gpointer d
     return TRUE;
 }
 
-void goHandlePipelineBuffer(void *buffer, int bufferLen, SampleHandlerUserData* s) {
-    if (s->pipelineId >= 0 && s->pipelineId < gl_num_pipeline) {
-        //copy buffer to somewhere else
-        if (quiche_conn_is_established(gl_recv_conn_io->conn)) {
-            if (gl_use_dgram) {
-                quiche_conn_dgram_send(gl_recv_conn_io->conn, (uint8_t *) buffer, bufferLen);
-                printf("dgram_send %d bytes\n", bufferLen);
-                //flush_egress(gl_recv_conn_io);
+/* Hands a frame over to the network thread without blocking. On success the
+ * ring owns frame->buf. */
+static bool submit_frame(const struct pending_frame *frame) {
+    if (!frame_ring_push(gl_frame_ring, frame)) {
+        return false;
+    }
+
+    // only the first frame pushed since the last drain needs to wake it up
+    if (!atomic_exchange(&gl_frame_ring_signaled, true)) {
+        uint64_t one = 1;
+        if (write(gl_frame_ring_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("failed to wake up network thread");
+        }
+    }
+
+    return true;
+}
+
+/* Runs on the network thread: feeds the frames submitted by the pipeline
+ * threads to quiche, then flushes them all at once. */
+static gboolean frame_ring_cb(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    uint64_t wakeups;
+    if (read(gl_frame_ring_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        perror("failed to read frame ring eventfd");
+    }
+
+    // frames pushed from now on need another wake up
+    atomic_store(&gl_frame_ring_signaled, false);
+
+    bool queued = false;
+    struct pending_frame frame;
+    while (frame_ring_pop(gl_frame_ring, &frame)) {
+        if (gl_recv_conn_io != NULL && quiche_conn_is_established(gl_recv_conn_io->conn)) {
+            int size;
+            if (frame.dgram) {
+                size = quiche_conn_dgram_send(gl_recv_conn_io->conn, frame.buf, frame.len);
+                printf("dgram_send %d/%d bytes\n", size, frame.len);
+            }
+            else if (frame.eos) {
+                size = quiche_conn_stream_send(gl_recv_conn_io->conn, frame.stream_id, frame.buf, frame.len, true);
+                fprintf(stderr, "EOS: %ld, pipeline %d stream_send %d/%d bytes on stream id %" PRIu64 "\n", getcurTime(), frame.pipeline_id, size, frame.len, frame.stream_id);
             }
             else {
-                //increase stream id
-                //static int cur_stream_id = 5;
-                //check rtp header marker bit
-                //unsigned char * tmp = (unsigned char *) buffer;
-                //int size = quiche_conn_stream_send(gl_recv_conn_io->conn, s->cur_stream_id, (uint8_t *) buffer, bufferLen, true);
-                int deadline_ms = s->deadline_ms;
-                int priority = s->priority;
-                int depend_id = s->cur_stream_id;
-                if (gl_app_type == APP_H264_DATA) {
-                    g_mutex_lock(gl_mutex);
-                }
-                unsigned char * tmp = (unsigned char *) buffer;
-//                if (tmp[12] == 0x67) {
-//                    //meta data
-//                    deadline_ms = 1000;
-//                    priority = 0;
-//                }
-//                else if (tmp[12] == 0x68) {
-//                    //meta data
-//                    deadline_ms = 1000;
-//                    priority = 1;
-//                }
-//                else if (tmp[12] == 0x06) {
-//                    //meta data
-//                    deadline_ms = 1000;
-//                    priority = 2;
-//                }
-//                else if (tmp[12] == 0x65) {
-//                    priority += 10;
-//                }
-//                else {
-//                    priority += 20;
-//                }
-
-                if (tmp[12] == 0x67){
-                    //SPS
-                }
-                else if (tmp[12] == 0x68 || tmp[12] == 0x65 || tmp[12] == 0x61) {
-                    //PPS I-frame P-frame
-                    depend_id = s->cur_stream_id - 4 * gl_num_pipeline;
+                // quiche keeps the whole frame and releases it once acked,
+                // or releases it right away if it couldn't queue all of it
+                size = quiche_conn_stream_send_full_owned(gl_recv_conn_io->conn, frame.stream_id, frame.buf, frame.len, true, frame.deadline_ms, frame.priority, frame.depend_id, frame.release, frame.release_ctx);
+                frame.release = NULL;
+                fprintf(stderr, "%ld, pipeline %d stream_send %d/%d bytes on stream id %" PRIu64 ", ddl %d, prior %d\n", getcurTime(), frame.pipeline_id, size, frame.len, frame.stream_id, frame.deadline_ms, frame.priority);
+
+                // the frame is lost, either because it can't make its deadline
+                // or for lack of send capacity, and so are the frames after it
+                if (size == QUICHE_ERR_BLOCK_REJECTED || size == QUICHE_ERR_DONE) {
+                    atomic_store(&gl_pipeline_skip[frame.pipeline_id], true);
                 }
+            }
+            queued = true;
+        }
+
+        if (frame.release != NULL) {
+            frame.release(frame.release_ctx);
+        }
+    }
 
+    if (queued) {
+        flush_egress(gl_recv_conn_io);
+    }
 
-                //deadline_ms = 200;
-                //priority = s->cur_stream_id * 10;
-                int size = quiche_conn_stream_send_full(gl_recv_conn_io->conn, s->cur_stream_id, (uint8_t *) buffer, bufferLen, true, deadline_ms, priority, depend_id);
-                if (gl_app_type == APP_H264_DATA) {
-                    g_mutex_unlock(gl_mutex);
-                }
-                fprintf(stderr, "%ld, pipeline %d stream_send %d/%d bytes on stream id %d, ddl %d, prior %d\n", getcurTime(), s->pipelineId, size, bufferLen, s->cur_stream_id, deadline_ms, priority);
-                s->cur_stream_id += 4 * gl_num_pipeline;
-                flush_egress(gl_recv_conn_io, false);
+    return TRUE;
+}
+
+void goHandlePipelineBuffer(const void *buffer, int bufferLen, SampleHandlerUserData* s,
+                            void (*release)(void *ctx), void *release_ctx) {
+    if (s->pipelineId >= 0 && s->pipelineId < gl_num_pipeline) {
+        //copy buffer to somewhere else
+        if (gl_use_dgram) {
+            // quiche copies datagrams, but only the network thread may use it
+            struct pending_frame frame = {
+                .buf = (const uint8_t *) buffer,
+                .len = bufferLen,
+                .release = release,
+                .release_ctx = release_ctx,
+                .pipeline_id = s->pipelineId,
+                .dgram = true,
+            };
+
+            if (submit_frame(&frame)) {
+                return;
+            }
+
+            fprintf(stderr, "%ld, pipeline %d frame ring full, dropped %d bytes dgram (%u dropped)\n",
+                    getcurTime(), s->pipelineId, bufferLen, atomic_load(&gl_frame_ring->dropped));
+        }
+        else {
+            //check rtp header marker bit
+            int deadline_ms = s->deadline_ms;
+            int priority = s->priority;
+            int depend_id = s->cur_stream_id;
+            const unsigned char * tmp = (const unsigned char *) buffer;
+
+            if (tmp[12] == 0x67 || tmp[12] == 0x65) {
+                //SPS IDR-frame: decoding can start over from here
+                atomic_store(&gl_pipeline_skip[s->pipelineId], false);
+            }
+            if (tmp[12] == 0x68 || tmp[12] == 0x65 || tmp[12] == 0x61) {
+                //PPS I-frame P-frame
+                depend_id = s->cur_stream_id - 4 * gl_num_pipeline;
+            }
+
+            // a frame it depends on was rejected, so it can't be decoded
+            if (atomic_load(&gl_pipeline_skip[s->pipelineId])) {
+                fprintf(stderr, "%ld, pipeline %d skipped %d bytes after rejected frame\n",
+                        getcurTime(), s->pipelineId, bufferLen);
+                release(release_ctx);
+                return;
             }
+
+            struct pending_frame frame = {
+                .buf = (const uint8_t *) buffer,
+                .len = bufferLen,
+                .release = release,
+                .release_ctx = release_ctx,
+                .stream_id = s->cur_stream_id,
+                .deadline_ms = deadline_ms,
+                .priority = priority,
+                .depend_id = depend_id,
+                .pipeline_id = s->pipelineId,
+                .eos = false,
+            };
+            s->cur_stream_id += 4 * gl_num_pipeline;
+
+            if (submit_frame(&frame)) {
+                return;
+            }
+
+            fprintf(stderr, "%ld, pipeline %d frame ring full, dropped %d bytes on stream id %" PRIu64 " (%u dropped)\n",
+                    getcurTime(), s->pipelineId, bufferLen, frame.stream_id, atomic_load(&gl_frame_ring->dropped));
         }
     }
     //fprintf(stderr, "free buffer %ld\n", getcurTime());
 
-    free(buffer);
-    buffer = NULL;
+    release(release_ctx);
     //
 }
 
@@ -779,12 +948,20 @@ void goHandleSendEOS(gpointer data) {
     SampleHandlerUserData * rtp_stream_info = (SampleHandlerUserData * )data;
     fprintf(stderr, "pipline id: %d\n", rtp_stream_info->pipelineId);
     if (eos_cnt == gl_num_pipeline) {
-        uint8_t *buffer = "eos";
-        if (quiche_conn_is_established(gl_recv_conn_io->conn)) {
-            //quiche_conn_stream_send(recv_conn_io->conn, s, (uint8_t *)resp, 5, true);
-            int size = quiche_conn_stream_send(gl_recv_conn_io->conn, rtp_stream_info->cur_stream_id, buffer, 3, true);
-            fprintf(stderr, "EOS: %ld, pipeline %d stream_send %d/%d bytes on stream id %d\n", getcurTime(), rtp_stream_info->pipelineId, size, 3, rtp_stream_info->cur_stream_id);
-            flush_egress(gl_recv_conn_io, false);
+        uint8_t *eos = malloc(3);
+        memcpy(eos, "eos", 3);
+
+        struct pending_frame frame = {
+            .buf = eos,
+            .len = 3,
+            .release = free,
+            .release_ctx = eos,
+            .stream_id = rtp_stream_info->cur_stream_id,
+            .pipeline_id = rtp_stream_info->pipelineId,
+            .eos = true,
+        };
+        if (!submit_frame(&frame)) {
+            free(eos);
         }
         fprintf(stderr, "eos sent.\n");
     }
@@ -851,8 +1028,17 @@ int main(int argc, char *argv[]) {
         fprintf(stdout, "Running H264 video app, num_pipeline: %d\n", gl_num_pipeline);
         gl_pipeline_infos = (SampleHandlerUserData *) malloc(gl_num_pipeline * sizeof(SampleHandlerUserData));
         read_pipeline_conf("ppl.txt", gl_pipeline_infos, gl_num_pipeline);
-        gl_mutex = (GMutex *) malloc(sizeof(GMutex));
-        g_mutex_init(gl_mutex);
+        gl_pipeline_skip = (atomic_bool *) malloc(gl_num_pipeline * sizeof(atomic_bool));
+        for (int i = 0; i < gl_num_pipeline; i++) {
+            atomic_init(&gl_pipeline_skip[i], false);
+        }
+        gl_frame_ring = (struct frame_ring *) malloc(sizeof(struct frame_ring));
+        frame_ring_init(gl_frame_ring);
+        gl_frame_ring_fd = eventfd(0, EFD_NONBLOCK);
+        if (gl_frame_ring_fd < 0) {
+            perror("failed to create eventfd");
+            return -1;
+        }
     }
     else if (gl_app_type == APP_SYNTHETIC_DATA_PERIOD) {
         sscanf(argv[6], "%d", &gl_num_streams);
@@ -900,6 +1086,8 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    udp_enable_gro(sock);
+
     if (bind(sock, local->ai_addr, local->ai_addrlen) < 0) {
         perror("failed to connect socket");
         return -1;
@@ -927,6 +1115,10 @@ int main(int argc, char *argv[]) {
     //quiche_config_set_cc_algorithm(gl_config, QUICHE_CC_RENO);
     quiche_config_set_cc_algorithm(gl_config, QUICHE_CC_BBR);
     quiche_config_enable_dgram(gl_config, true, 1000, 1000);
+    if (gl_app_type == APP_H264_DATA) {
+        // let the scheduler pick frames by deadline, priority and dependency
+        quiche_config_enable_deadline_scheduling(gl_config, true);
+    }
     //quiche_config_set_scheduler_name(gl_config, "Basic");
     //quiche_config_set_scheduler_name(gl_config, "PF");
     //!!! only use one connection here
@@ -961,6 +1153,13 @@ int main(int argc, char *argv[]) {
     g_io_add_watch(channel, G_IO_IN, (GIOFunc) recv_cb, m_data);
     g_io_channel_unref(channel);
 
+    /* frames submitted by the pipeline threads are also sent from here */
+    if (gl_frame_ring != NULL) {
+        GIOChannel* ring_channel = g_io_channel_unix_new(gl_frame_ring_fd);
+        g_io_add_watch(ring_channel, G_IO_IN, (GIOFunc) frame_ring_cb, NULL);
+        g_io_channel_unref(ring_channel);
+    }
+
 
     /* start main thread */
     gl_gstreamer_send_main_loop = g_main_loop_new(NULL, FALSE);
@@ -981,9 +1180,14 @@ int main(int argc, char *argv[]) {
 
     freeaddrinfo(local);
     quiche_config_free(gl_config);
-    if (gl_app_type == APP_H264_DATA || gl_app_type == APP_SYNTHETIC_DATA_PERIOD || gl_app_type == APP_SYNTHETIC_DATA_STATIC_SCHEDULE) {
+    if (conn_needs_lock()) {
         free(gl_mutex);
         g_mutex_clear(gl_mutex);
     }
+    if (gl_frame_ring != NULL) {
+        close(gl_frame_ring_fd);
+        free(gl_frame_ring);
+    }
+    free(gl_pipeline_skip);
     return 0;
 }
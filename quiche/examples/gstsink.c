@@ -4,6 +4,16 @@
 #include <stdio.h>
 
 GMainLoop *gstreamer_receive_main_loop = NULL;
+
+/* appsrc elements of the pipeline, indexed by pipeline id, looked up once
+ * instead of searching the bin by name on every push */
+static GPtrArray *gstreamer_receive_srcs = NULL;
+
+static void gstreamer_receive_unref_src(gpointer src) {
+    if (src != NULL) {
+        gst_object_unref(src);
+    }
+}
 void gstreamer_receive_start_mainloop(void) {
   gstreamer_receive_main_loop = g_main_loop_new(NULL, FALSE);
 
@@ -57,22 +67,57 @@ void gstreamer_receive_stop_pipeline(GstElement* pipeline) {
 }
 
 void gstreamer_receive_destroy_pipeline(GstElement* pipeline) {
+    if (gstreamer_receive_srcs != NULL) {
+        g_ptr_array_unref(gstreamer_receive_srcs);
+        gstreamer_receive_srcs = NULL;
+    }
+
     gst_element_set_state(pipeline, GST_STATE_NULL);
     gst_object_unref(pipeline);
 }
 
-void gstreamer_receive_push_buffer(GstElement *pipeline, void *buffer, int len, uint64_t pipelineId) {
-    char appsrc[100];
-    sprintf(appsrc, "src_%lu", pipelineId);
-    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), appsrc);
+void gstreamer_receive_bind_srcs(GstElement *pipeline, guint num_srcs) {
+    if (gstreamer_receive_srcs != NULL) {
+        g_ptr_array_unref(gstreamer_receive_srcs);
+    }
+
+    gstreamer_receive_srcs = g_ptr_array_new_full(num_srcs, gstreamer_receive_unref_src);
+
+    for (guint i = 0; i < num_srcs; i++) {
+        char appsrc[32];
+        snprintf(appsrc, sizeof(appsrc), "src_%u", i);
+
+        // keeps the reference returned by the lookup until the pipeline is destroyed
+        GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), appsrc);
+        if (src == NULL) {
+            printf("\nno appsrc named %s!!!!\n", appsrc);
+        }
+        g_ptr_array_add(gstreamer_receive_srcs, src);
+    }
+}
+
+void gstreamer_receive_push_buffer_full(GstElement *pipeline, void *buffer, int len, uint64_t pipelineId,
+                                        GDestroyNotify release, gpointer release_ctx) {
+    GstBuffer *gst_buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, buffer, len, 0, len,
+                                                        release_ctx, release);
+
+    GstElement *src = NULL;
+    if (gstreamer_receive_srcs != NULL && pipelineId < gstreamer_receive_srcs->len) {
+        src = g_ptr_array_index(gstreamer_receive_srcs, pipelineId);
+    }
+
     if (src != NULL) {
-        //printf("push %s\n", appsrc);
-        gpointer p = g_memdup(buffer, len);
-        GstBuffer *buffer = gst_buffer_new_wrapped(p, len);
-        gst_app_src_push_buffer(GST_APP_SRC(src), buffer);
-        gst_object_unref(src);
+        //printf("push src_%lu\n", pipelineId);
+        // takes ownership of the buffer
+        gst_app_src_push_buffer(GST_APP_SRC(src), gst_buffer);
     }
     else {
-        printf("\nnot push!!!!%s\n", appsrc);
+        printf("\nnot push!!!!src_%lu\n", pipelineId);
+        gst_buffer_unref(gst_buffer);
     }
 }
+
+void gstreamer_receive_push_buffer(GstElement *pipeline, void *buffer, int len, uint64_t pipelineId) {
+    gpointer p = g_memdup(buffer, len);
+    gstreamer_receive_push_buffer_full(pipeline, p, len, pipelineId, g_free, p);
+}
@@ -14,13 +14,22 @@ typedef struct SampleHandlerUserData {
     int cur_stream_id;
 } SampleHandlerUserData;
 
+extern GMainLoop *gstreamer_receive_main_loop;
 void gstreamer_receive_start_mainloop(void);
 
 GstElement *gstreamer_receive_create_pipeline(char *pipeline);
 void gstreamer_receive_start_pipeline(GstElement *pipeline);
 void gstreamer_receive_stop_pipeline(GstElement* pipeline);
 void gstreamer_receive_destroy_pipeline(GstElement* pipeline);
+// Resolves the pipeline's appsrc elements, named src_0 to src_<num_srcs - 1>,
+// once before buffers are pushed to them.
+void gstreamer_receive_bind_srcs(GstElement *pipeline, guint num_srcs);
+// Pushes a copy of the buffer.
 void gstreamer_receive_push_buffer(GstElement *pipeline, void *buffer, int len, uint64_t pipelineId);
+// Pushes the buffer without copying it, release(release_ctx) is called once
+// GStreamer is done with it.
+void gstreamer_receive_push_buffer_full(GstElement *pipeline, void *buffer, int len, uint64_t pipelineId,
+                                        GDestroyNotify release, gpointer release_ctx);
 
 //extern void goHandleReceiveEOS();
 
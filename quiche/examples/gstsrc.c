@@ -42,11 +42,23 @@ static gboolean go_gst_bus_call(GstBus *bus, GstMessage *msg, gpointer data) {
     return TRUE;
 }
 
+/* A buffer pulled from the appsink, kept mapped until quiche is done with it. */
+struct mapped_sample {
+    GstBuffer *buffer;
+    GstMapInfo map;
+};
+
+static void release_mapped_sample(void *ctx) {
+    struct mapped_sample *m = (struct mapped_sample *) ctx;
+
+    gst_buffer_unmap(m->buffer, &m->map);
+    gst_buffer_unref(m->buffer);
+    g_free(m);
+}
+
 GstFlowReturn go_gst_send_new_sample_handler(GstElement *object, gpointer user_data) {
     GstSample *sample = NULL;
     GstBuffer *buffer = NULL;
-    gpointer copy = NULL;
-    gsize copy_size = 0;
     SampleHandlerUserData *s = (SampleHandlerUserData*) user_data;
 
     g_signal_emit_by_name (object, "pull-sample", &sample);
@@ -54,9 +66,19 @@ GstFlowReturn go_gst_send_new_sample_handler(GstElement *object, gpointer user_d
     if (sample) {
         buffer = gst_sample_get_buffer(sample);
         if (buffer) {
-            gst_buffer_extract_dup(buffer, 0, gst_buffer_get_size(buffer), &copy, &copy_size);
-            //g_print ("*");
-            goHandlePipelineBuffer(copy, copy_size, s);
+            // the buffer outlives the sample, and its memory is handed over
+            // as is instead of being copied
+            struct mapped_sample *m = g_new(struct mapped_sample, 1);
+            m->buffer = gst_buffer_ref(buffer);
+
+            if (gst_buffer_map(m->buffer, &m->map, GST_MAP_READ)) {
+                //g_print ("*");
+                goHandlePipelineBuffer(m->map.data, m->map.size, s,
+                                       release_mapped_sample, m);
+            } else {
+                gst_buffer_unref(m->buffer);
+                g_free(m);
+            }
         }
         gst_sample_unref(sample);
     }
@@ -14,7 +14,10 @@ typedef struct SampleHandlerUserData {
 } SampleHandlerUserData;
 
 extern void goHandleSendEOS(gpointer data);
-extern void goHandlePipelineBuffer(void *buffer, int bufferLen, SampleHandlerUserData* s);
+// The buffer stays valid until release(release_ctx) is called, which must
+// happen exactly once, from any thread.
+extern void goHandlePipelineBuffer(const void *buffer, int bufferLen, SampleHandlerUserData* s,
+                                   void (*release)(void *ctx), void *release_ctx);
 
 //void gstreamer_send_start_mainloop(GMainLoop *gstreamer_send_main_loop);
 //void gstreamer_send_quit_mainloop(GMainLoop *gstreamer_send_main_loop);
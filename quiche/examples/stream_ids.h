@@ -0,0 +1,52 @@
+#ifndef STREAM_IDS_H
+#define STREAM_IDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <quiche.h>
+
+/* Reusable array of stream IDs, filled by quiche_conn_readable_into() or
+ * quiche_conn_writable_into().
+ *
+ * The array only grows when more streams than ever before are returned at
+ * once, so iterating over streams on every wake up doesn't allocate. A zeroed
+ * struct is an empty array. */
+
+#define STREAM_IDS_INIT_CAP 64
+
+struct stream_ids {
+    uint64_t *ids;
+    size_t cap;
+};
+
+typedef size_t (*stream_ids_fill_fn)(quiche_conn *conn, uint64_t *out, size_t out_len);
+
+/* Fills the array with the streams returned by fill, and returns how many
+ * there are. */
+static inline size_t stream_ids_fill(struct stream_ids *l, quiche_conn *conn,
+                                     stream_ids_fill_fn fill) {
+    size_t n = fill(conn, l->ids, l->cap);
+    if (n <= l->cap) {
+        return n;
+    }
+
+    size_t cap = l->cap > 0 ? l->cap : STREAM_IDS_INIT_CAP;
+    while (cap < n) {
+        cap *= 2;
+    }
+
+    uint64_t *ids = realloc(l->ids, cap * sizeof(*ids));
+    if (ids == NULL) {
+        // make do with the streams that fit
+        return l->cap;
+    }
+
+    l->ids = ids;
+    l->cap = cap;
+
+    return fill(conn, l->ids, l->cap);
+}
+
+#endif
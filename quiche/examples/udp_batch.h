@@ -0,0 +1,247 @@
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+/* Needs _GNU_SOURCE to be defined before any system header is included, for
+ * sendmmsg() and recvmmsg(). */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* Upper bound of a single GSO send, which has to fit in one UDP datagram and
+ * can't hold more than 64 segments. */
+#define UDP_BATCH_MAX_BYTES 64800
+#define UDP_BATCH_MAX_SEGMENTS 64
+
+/* Number of datagrams read by a single recvmmsg(). With GRO, each of them can
+ * hold several coalesced packets. */
+#define UDP_BATCH_RECV_MSGS 32
+#define UDP_BATCH_RECV_BUF 65535
+
+/* Whether the socket accepts UDP_SEGMENT, decided the first time a batch is
+ * sent: -1 unknown, 0 no, 1 yes. */
+static int udp_gso_supported = -1;
+
+static inline bool udp_gso_probe(int sock) {
+    if (udp_gso_supported < 0) {
+        int seg = 0;
+        udp_gso_supported =
+            setsockopt(sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0;
+    }
+
+    return udp_gso_supported == 1;
+}
+
+/* Sends buf as segments of seg_size bytes, the last one possibly shorter,
+ * using a single sendmsg() with UDP_SEGMENT. */
+static inline ssize_t udp_send_gso(int sock, const uint8_t *buf, size_t len,
+                                   size_t seg_size, const struct sockaddr *to,
+                                   socklen_t to_len) {
+    struct iovec iov = { (void *) buf, len };
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *) to;
+    msg.msg_namelen = to_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (len > seg_size) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+        uint16_t gso_size = seg_size;
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+
+    return sendmsg(sock, &msg, 0);
+}
+
+/* Same as udp_send_gso(), with one message per segment in a single
+ * sendmmsg(). Returns the number of bytes of the segments that were sent. */
+static inline ssize_t udp_send_mmsg(int sock, const uint8_t *buf, size_t len,
+                                    size_t seg_size, const struct sockaddr *to,
+                                    socklen_t to_len) {
+    struct mmsghdr msgs[UDP_BATCH_MAX_SEGMENTS];
+    struct iovec iovs[UDP_BATCH_MAX_SEGMENTS];
+
+    unsigned int n = 0;
+    for (size_t off = 0; off < len && n < UDP_BATCH_MAX_SEGMENTS; off += seg_size, n++) {
+        iovs[n].iov_base = (void *) (buf + off);
+        iovs[n].iov_len = len - off < seg_size ? len - off : seg_size;
+
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_hdr.msg_name = (void *) to;
+        msgs[n].msg_hdr.msg_namelen = to_len;
+        msgs[n].msg_hdr.msg_iov = &iovs[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = sendmmsg(sock, msgs, n, 0);
+    if (sent < 0) {
+        return -1;
+    }
+
+    ssize_t bytes = 0;
+    for (int i = 0; i < sent; i++) {
+        bytes += msgs[i].msg_len;
+    }
+
+    return bytes;
+}
+
+/* Sends a batch of equally sized packets (except the last one) to the same
+ * peer with as few syscalls as possible. Returns the number of bytes sent. */
+static inline ssize_t udp_send_batch(int sock, const uint8_t *buf, size_t len,
+                                     size_t seg_size, const struct sockaddr *to,
+                                     socklen_t to_len) {
+    if (udp_gso_probe(sock)) {
+        ssize_t sent = udp_send_gso(sock, buf, len, seg_size, to, to_len);
+
+        // EIO is returned when the device can't do checksum offload
+        if (sent >= 0 || errno != EIO) {
+            return sent;
+        }
+
+        udp_gso_supported = 0;
+    }
+
+    return udp_send_mmsg(sock, buf, len, seg_size, to, to_len);
+}
+
+/* Datagrams read at once from a socket, and iteration over the packets they
+ * hold. */
+struct udp_recv_batch {
+    struct mmsghdr msgs[UDP_BATCH_RECV_MSGS];
+    struct iovec iovs[UDP_BATCH_RECV_MSGS];
+    struct sockaddr_storage addrs[UDP_BATCH_RECV_MSGS];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        size_t align; //cmsghdr alignment
+    } control[UDP_BATCH_RECV_MSGS];
+    uint8_t bufs[UDP_BATCH_RECV_MSGS][UDP_BATCH_RECV_BUF];
+
+    /* number of datagrams read by the last udp_recv_batch() */
+    int count;
+
+    /* datagram being split, and offset of its next packet */
+    int pos;
+    size_t off;
+};
+
+struct udp_packet {
+    uint8_t *buf;
+    size_t len;
+    struct sockaddr_storage *peer_addr;
+    socklen_t peer_addr_len;
+};
+
+/* Lets the kernel coalesce consecutive packets from the same flow. This is
+ * best effort, the batch falls back to one packet per datagram. */
+static inline void udp_enable_gro(int sock) {
+    int one = 1;
+    setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one));
+}
+
+/* Reads as many datagrams as available, up to UDP_BATCH_RECV_MSGS, with a
+ * single recvmmsg(). Returns the number of datagrams read, or -1 with errno
+ * set (EAGAIN when none is available). */
+static inline int udp_recv_batch(int sock, struct udp_recv_batch *b) {
+    for (int i = 0; i < UDP_BATCH_RECV_MSGS; i++) {
+        b->iovs[i].iov_base = b->bufs[i];
+        b->iovs[i].iov_len = sizeof(b->bufs[i]);
+
+        memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_control = b->control[i].buf;
+        b->msgs[i].msg_hdr.msg_controllen = sizeof(b->control[i].buf);
+    }
+
+    b->count = 0;
+    b->pos = 0;
+    b->off = 0;
+
+    int n = recvmmsg(sock, b->msgs, UDP_BATCH_RECV_MSGS, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        return -1;
+    }
+
+    b->count = n;
+    return n;
+}
+
+/* Size of the packets coalesced by GRO in the given datagram, or its whole
+ * length if it holds a single packet. */
+static inline size_t udp_gro_segment_size(struct msghdr *msg, size_t len) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+
+            if (gso_size > 0) {
+                return gso_size;
+            }
+        }
+    }
+
+    return len;
+}
+
+/* Returns the next packet of the batch, splitting coalesced datagrams, or
+ * false once all of them were returned. */
+static inline bool udp_recv_batch_next(struct udp_recv_batch *b,
+                                       struct udp_packet *pkt) {
+    while (b->pos < b->count) {
+        struct mmsghdr *msg = &b->msgs[b->pos];
+        size_t len = msg->msg_len;
+
+        if (b->off >= len) {
+            b->pos += 1;
+            b->off = 0;
+            continue;
+        }
+
+        size_t seg_size = udp_gro_segment_size(&msg->msg_hdr, len);
+
+        pkt->buf = b->bufs[b->pos] + b->off;
+        pkt->len = len - b->off < seg_size ? len - b->off : seg_size;
+        pkt->peer_addr = &b->addrs[b->pos];
+        pkt->peer_addr_len = msg->msg_hdr.msg_namelen;
+
+        b->off += pkt->len;
+        return true;
+    }
+
+    return false;
+}
+
+#endif
@@ -115,15 +115,64 @@ enum quiche_error {
 
     // Error in congestion control.
     QUICHE_ERR_CONGESTION_CONTROL = -14,
+
+    // The block was rejected by the scheduler's admission control, because it
+    // can't be delivered before its deadline, or because the block it depends
+    // on was dropped.
+    QUICHE_ERR_BLOCK_REJECTED = -20,
 };
 
 // Returns a human readable string with the quiche version number.
 const char *quiche_version(void);
 
+// Returns the current time in microseconds on the monotonic clock used to
+// evaluate stream deadlines. Its origin is arbitrary.
+uint64_t quiche_clock_micros(void);
+
 // Enables logging. |cb| will be called with log messages
 int quiche_enable_debug_logging(void (*cb)(const char *line, void *argp),
                                 void *argp);
 
+enum quiche_trace_level {
+    QUICHE_TRACE_OFF = 0,
+    QUICHE_TRACE_INFO = 1,
+    QUICHE_TRACE_DEBUG = 2,
+};
+
+enum quiche_trace_event_type {
+    QUICHE_TRACE_BLOCK_SKIPPED = 1,
+    QUICHE_TRACE_BLOCK_EVALUATED = 2,
+    QUICHE_TRACE_BLOCK_WEIGHTED = 3,
+    QUICHE_TRACE_BLOCK_SELECTED = 4,
+    QUICHE_TRACE_BLOCK_DROPPED = 5,
+    QUICHE_TRACE_STREAM_RESET = 6,
+    QUICHE_TRACE_RESET_RECEIVED = 7,
+    QUICHE_TRACE_PARTIAL_WRITE = 8,
+    QUICHE_TRACE_CONNECTION_BLOCKED = 9,
+};
+
+typedef struct {
+    // Time of the event, as returned by quiche_clock_micros().
+    uint64_t time;
+
+    enum quiche_trace_event_type type;
+
+    uint64_t stream_id;
+
+    // Type-specific arguments, floating point values are stored as the bit
+    // pattern of a double.
+    uint64_t args[4];
+} quiche_trace_event;
+
+// Sets the level of the scheduler and stream events to record. Events are
+// only recorded when quiche is built with the "trace" feature.
+void quiche_set_trace_level(enum quiche_trace_level level);
+
+// Calls |cb| with the events recorded by the calling thread, oldest first, and
+// discards them. Returns the number of events.
+size_t quiche_trace_drain(void (*cb)(const quiche_trace_event *ev, void *argp),
+                          void *argp);
+
 // Stores configuration shared between multiple connections.
 typedef struct Config quiche_config;
 
@@ -232,13 +281,73 @@ void quiche_config_set_stateless_reset_token(quiche_config *config, const uint8_
 enum quiche_scheduler_type {
     SCHE_BASIC = 0,
     SCHE_DTP = 1,
-    SCHE_DYN = 3
+    SCHE_DTP_SKIP = 2,
+    SCHE_DYN = 3,
+    SCHE_PF = 4,
+    SCHE_DTP_BW = 5,
+    SCHE_EDF = 6,
+    SCHE_PLUGIN = 7
 };
 
 // Sets schduler type
-void quiche_config_set_scheduler_type(quiche_config *config);
+void quiche_config_set_scheduler_type(quiche_config *config, enum quiche_scheduler_type sche);
+
+int quiche_config_set_scheduler_name(quiche_config *config, const char* name);
 
-void quiche_config_set_scheduler_name(quiche_config *config, const char* name);
+// A block queued for sending, that is, the data written to a stream.
+typedef struct {
+    // ID of the stream carrying the block.
+    uint64_t block_id;
+    // Deadline relative to the creation time, in milliseconds.
+    uint64_t block_deadline;
+    uint64_t block_priority;
+    // Creation time, as returned by quiche_clock_micros().
+    uint64_t block_create_time;
+    uint64_t block_size;
+    // Bytes left to send.
+    uint64_t remaining_size;
+    uint64_t depend_id;
+    // Non-zero while the block it depends on still has data left to send.
+    uint64_t unsatisfied_deps;
+} quiche_block;
+
+// Network estimates given to scheduler plugins.
+typedef struct {
+    // Current pacing rate in bytes per second.
+    double pacing_rate;
+    // Smoothed RTT in milliseconds.
+    double rtt;
+    // Bottleneck bandwidth in bytes per second, or 0 if unknown.
+    double btlbw;
+    // Minimum RTT in milliseconds, or 0 if unknown.
+    double min_rtt;
+    uint64_t next_packet_id;
+    // Current time, as returned by quiche_clock_micros().
+    uint64_t current_time;
+} quiche_scheduler_info;
+
+// Functions of a scheduler implemented by the application. The pointers they
+// are given are only valid during the call.
+typedef struct {
+    // Returns the ID of the block to send next, among the |len| queued blocks.
+    uint64_t (*select_block)(void *ctx, const quiche_block *blocks, size_t len,
+                             const quiche_scheduler_info *info);
+    // Returns whether the block should be dropped. Optional, if NULL blocks
+    // are never dropped.
+    bool (*should_drop_block)(void *ctx, const quiche_block *block,
+                              const quiche_scheduler_info *info);
+    // Passed as is to the functions above.
+    void *ctx;
+} quiche_scheduler_ops;
+
+// Schedules blocks with the given functions, instead of one of the built-in
+// schedulers. This also sets the scheduler type to SCHE_PLUGIN.
+void quiche_config_set_scheduler_ops(quiche_config *config,
+                                     const quiche_scheduler_ops *ops);
+
+// Configures whether STREAM frames are scheduled by the configured scheduler,
+// based on each block's deadline, priority and dependency.
+void quiche_config_enable_deadline_scheduling(quiche_config *config, bool v);
 
 
 // Frees the config object.
@@ -322,6 +431,13 @@ typedef struct {
 ssize_t quiche_conn_recv(quiche_conn *conn, uint8_t *buf, size_t buf_len,
                          const quiche_recv_info *info);
 
+// Processes `count` UDP datagrams received from the peer, stored in `bufs`
+// with their lengths in `buf_lens` and their addresses in `infos`. Returns the
+// number of datagrams processed, or a negative error code.
+ssize_t quiche_conn_recv_batch(quiche_conn *conn, uint8_t *const *bufs,
+                               const size_t *buf_lens,
+                               const quiche_recv_info *infos, size_t count);
+
 typedef struct {
     // The local address the packet should be sent from.
     struct sockaddr_storage from;
@@ -339,6 +455,14 @@ typedef struct {
 ssize_t quiche_conn_send(quiche_conn *conn, uint8_t *out, size_t out_len,
                          quiche_send_info *out_info);
 
+// Writes up to `count` UDP datagrams to be sent to the peer, in the buffers
+// `outs` of sizes `out_lens`. Returns the number of buffers filled, whose
+// lengths are replaced by the number of bytes written and whose `out_infos`
+// are set, or QUICHE_ERR_DONE if there was nothing to write.
+ssize_t quiche_conn_send_batch(quiche_conn *conn, uint8_t *const *outs,
+                               size_t *out_lens, quiche_send_info *out_infos,
+                               size_t count);
+
 // Returns the size of the send quantum, in bytes.
 size_t quiche_conn_send_quantum(quiche_conn *conn);
 
@@ -346,14 +470,46 @@ size_t quiche_conn_send_quantum(quiche_conn *conn);
 ssize_t quiche_conn_stream_recv(quiche_conn *conn, uint64_t stream_id,
                                 uint8_t *out, size_t buf_len, bool *fin);
 
+// Returns the contiguous data at the current read offset of a stream in `out`,
+// without copying it, and its length. The pointer is valid until the next call
+// on the connection. The data is only read once passed to
+// quiche_conn_stream_recv_consume().
+ssize_t quiche_conn_stream_recv_peek(quiche_conn *conn, uint64_t stream_id,
+                                     const uint8_t **out, bool *fin);
+
+// Reads up to `len` bytes from a stream, discarding them.
+ssize_t quiche_conn_stream_recv_consume(quiche_conn *conn, uint64_t stream_id,
+                                        size_t len, bool *fin);
+
 // Writes data to a stream.
 ssize_t quiche_conn_stream_send(quiche_conn *conn, uint64_t stream_id,
                                 const uint8_t *buf, size_t buf_len, bool fin);
 
+// Same as quiche_conn_stream_send(), but ownership of the data is handed over
+// to quiche instead of it being copied. `release` is called with `release_ctx`,
+// exactly once, when the data was all acked or the stream was reset, or from
+// within this call if no data was written.
+//
+// The data is either written whole or not at all: if the connection or the
+// stream can't take all of it, QUICHE_ERR_DONE is returned and `release` is
+// called before returning, so there is never a tail left to send.
+ssize_t quiche_conn_stream_send_owned(quiche_conn *conn, uint64_t stream_id,
+                                      const uint8_t *buf, size_t buf_len, bool fin,
+                                      void (*release)(void *ctx), void *release_ctx);
+
 //Writes data to a stream with priority and ddl
 ssize_t quiche_conn_stream_send_full(quiche_conn *conn, uint64_t stream_id,
                                 const uint8_t *buf, size_t buf_len, bool fin,
                                 uint64_t deadline, uint64_t priority, uint64_t depend_id);
+
+// Same as quiche_conn_stream_send_full(), but ownership of the data is handed
+// over to quiche, as with quiche_conn_stream_send_owned(), including writing
+// it whole or not at all.
+ssize_t quiche_conn_stream_send_full_owned(quiche_conn *conn, uint64_t stream_id,
+                                const uint8_t *buf, size_t buf_len, bool fin,
+                                uint64_t deadline, uint64_t priority, uint64_t depend_id,
+                                void (*release)(void *ctx), void *release_ctx);
+
 enum quiche_shutdown {
     QUICHE_SHUTDOWN_READ = 0,
     QUICHE_SHUTDOWN_WRITE = 1,
@@ -382,6 +538,14 @@ quiche_stream_iter *quiche_conn_readable(quiche_conn *conn);
 // Returns an iterator over streams that can be written to.
 quiche_stream_iter *quiche_conn_writable(quiche_conn *conn);
 
+// Copies the IDs of the streams that have outstanding data to read into `out`,
+// without allocating. Returns the total number of such streams, of which only
+// the first `out_len` are copied.
+size_t quiche_conn_readable_into(quiche_conn *conn, uint64_t *out, size_t out_len);
+
+// Same as quiche_conn_readable_into(), for the streams that can be written to.
+size_t quiche_conn_writable_into(quiche_conn *conn, uint64_t *out, size_t out_len);
+
 // Returns the maximum possible size of egress UDP payloads.
 size_t quiche_conn_max_send_udp_payload_size(quiche_conn *conn);
 
@@ -557,6 +721,13 @@ typedef struct {
     // The number of stream bytes retransmitted.
     uint64_t stream_retrans_bytes;
 
+    // The number of blocks dropped before being fully sent, including those
+    // rejected by admission control.
+    uint64_t dropped_blocks;
+
+    // The number of unsent stream bytes discarded with the dropped blocks.
+    uint64_t dropped_bytes;
+
     // The maximum idle timeout.
     uint64_t peer_max_idle_timeout;
 
@@ -107,6 +107,11 @@ pub extern fn quiche_version() -> *const u8 {
     VERSION.as_ptr()
 }
 
+#[no_mangle]
+pub extern fn quiche_clock_micros() -> u64 {
+    clock_micros()
+}
+
 struct Logger {
     cb: extern fn(line: *const u8, argp: *mut c_void),
     argp: std::sync::atomic::AtomicPtr<c_void>,
@@ -141,6 +146,18 @@ pub extern fn quiche_enable_debug_logging(
     0
 }
 
+#[no_mangle]
+pub extern fn quiche_set_trace_level(level: TraceLevel) {
+    set_trace_level(level);
+}
+
+#[no_mangle]
+pub extern fn quiche_trace_drain(
+    cb: extern fn(ev: &TraceEvent, argp: *mut c_void), argp: *mut c_void,
+) -> size_t {
+    drain_trace_events(|ev| cb(ev, argp))
+}
+
 #[no_mangle]
 pub extern fn quiche_config_new(version: u32) -> *mut Config {
     match Config::new(version) {
@@ -345,6 +362,20 @@ pub extern fn quiche_config_set_scheduler_type(
     config.set_scheduler_type(sche);
 }
 
+#[no_mangle]
+pub extern fn quiche_config_set_scheduler_ops(
+    config: &mut Config, ops: &scheduler::SchedulerOps,
+) {
+    config.set_scheduler_ops(*ops);
+}
+
+#[no_mangle]
+pub extern fn quiche_config_enable_deadline_scheduling(
+    config: &mut Config, v: bool,
+) {
+    config.enable_deadline_scheduling(v);
+}
+
 
 
 
@@ -738,6 +769,38 @@ pub extern fn quiche_conn_recv(
     }
 }
 
+#[no_mangle]
+pub extern fn quiche_conn_recv_batch(
+    conn: &mut Connection, bufs: *const *mut u8, buf_lens: *const size_t,
+    infos: *const RecvInfo, count: size_t,
+) -> ssize_t {
+    if count == 0 {
+        return 0;
+    }
+
+    let bufs = unsafe { slice::from_raw_parts(bufs, count) };
+    let buf_lens = unsafe { slice::from_raw_parts(buf_lens, count) };
+    let infos = unsafe { slice::from_raw_parts(infos, count) };
+
+    let datagrams = bufs.iter().zip(buf_lens).zip(infos).map(
+        |((&buf, &buf_len), info)| {
+            if buf_len > <ssize_t>::max_value() as usize {
+                panic!("The provided buffer is too large");
+            }
+
+            let buf = unsafe { slice::from_raw_parts_mut(buf, buf_len) };
+
+            (buf, info.into())
+        },
+    );
+
+    match conn.recv_batch(datagrams) {
+        Ok(v) => v as ssize_t,
+
+        Err(e) => e.to_c(),
+    }
+}
+
 #[repr(C)]
 pub struct SendInfo {
     from: sockaddr_storage,
@@ -771,6 +834,49 @@ pub extern fn quiche_conn_send(
     }
 }
 
+#[no_mangle]
+pub extern fn quiche_conn_send_batch(
+    conn: &mut Connection, outs: *const *mut u8, out_lens: *mut size_t,
+    out_infos: *mut SendInfo, count: size_t,
+) -> ssize_t {
+    if count == 0 {
+        return 0;
+    }
+
+    let out_infos = unsafe { slice::from_raw_parts_mut(out_infos, count) };
+
+    // Each length is read when its buffer is handed to quiche, and replaced by
+    // the number of bytes written once it's filled.
+    let bufs = (0..count).map(|i| {
+        let out_len = unsafe { *out_lens.add(i) };
+
+        if out_len > <ssize_t>::max_value() as usize {
+            panic!("The provided buffer is too large");
+        }
+
+        unsafe { slice::from_raw_parts_mut(*outs.add(i), out_len) }
+    });
+
+    let mut i = 0;
+
+    let on_datagram = |v: usize, info: crate::SendInfo| {
+        let out_info = &mut out_infos[i];
+
+        unsafe { *out_lens.add(i) = v };
+        out_info.from_len = std_addr_to_c(&info.from, &mut out_info.from);
+        out_info.to_len = std_addr_to_c(&info.to, &mut out_info.to);
+        std_time_to_c(&info.at, &mut out_info.at);
+
+        i += 1;
+    };
+
+    match conn.send_batch(bufs, on_datagram) {
+        Ok(v) => v as ssize_t,
+
+        Err(e) => e.to_c(),
+    }
+}
+
 #[no_mangle]
 pub extern fn quiche_conn_stream_recv(
     conn: &mut Connection, stream_id: u64, out: *mut u8, out_len: size_t,
@@ -793,6 +899,37 @@ pub extern fn quiche_conn_stream_recv(
     out_len as ssize_t
 }
 
+#[no_mangle]
+pub extern fn quiche_conn_stream_recv_peek(
+    conn: &mut Connection, stream_id: u64, out: &mut *const u8, fin: &mut bool,
+) -> ssize_t {
+    let (data, data_fin) = match conn.stream_recv_peek(stream_id) {
+        Ok(v) => v,
+
+        Err(e) => return e.to_c(),
+    };
+
+    *out = data.as_ptr();
+    *fin = data_fin;
+
+    data.len() as ssize_t
+}
+
+#[no_mangle]
+pub extern fn quiche_conn_stream_recv_consume(
+    conn: &mut Connection, stream_id: u64, len: size_t, fin: &mut bool,
+) -> ssize_t {
+    let (len, out_fin) = match conn.stream_recv_consume(stream_id, len) {
+        Ok(v) => v,
+
+        Err(e) => return e.to_c(),
+    };
+
+    *fin = out_fin;
+
+    len as ssize_t
+}
+
 #[no_mangle]
 pub extern fn quiche_conn_stream_send_full(
     conn: &mut Connection, stream_id: u64, buf: *const u8, buf_len: size_t,
@@ -813,6 +950,45 @@ pub extern fn quiche_conn_stream_send_full(
     }
 }
 
+#[no_mangle]
+pub extern fn quiche_conn_stream_send_full_owned(
+    conn: &mut Connection, stream_id: u64, buf: *const u8, buf_len: size_t,
+    fin: bool, deadline: u64, priority: u64, depend_id: u64,
+    release: extern fn(*mut c_void), release_ctx: *mut c_void,
+) -> ssize_t {
+    if buf_len > <ssize_t>::max_value() as usize {
+        panic!("The provided buffer is too large");
+    }
+
+    let buf = unsafe { ForeignBuf::new(buf, buf_len, release, release_ctx) };
+
+    match conn.stream_send_full_owned(
+        stream_id, buf, fin, deadline, priority, depend_id,
+    ) {
+        Ok(v) => v as ssize_t,
+
+        Err(e) => e.to_c(),
+    }
+}
+
+#[no_mangle]
+pub extern fn quiche_conn_stream_send_owned(
+    conn: &mut Connection, stream_id: u64, buf: *const u8, buf_len: size_t,
+    fin: bool, release: extern fn(*mut c_void), release_ctx: *mut c_void,
+) -> ssize_t {
+    if buf_len > <ssize_t>::max_value() as usize {
+        panic!("The provided buffer is too large");
+    }
+
+    let buf = unsafe { ForeignBuf::new(buf, buf_len, release, release_ctx) };
+
+    match conn.stream_send_owned(stream_id, buf, fin) {
+        Ok(v) => v as ssize_t,
+
+        Err(e) => e.to_c(),
+    }
+}
+
 #[no_mangle]
 pub extern fn quiche_conn_stream_send(
     conn: &mut Connection, stream_id: u64, buf: *const u8, buf_len: size_t,
@@ -888,6 +1064,34 @@ pub extern fn quiche_conn_writable(conn: &Connection) -> *mut StreamIter {
     Box::into_raw(Box::new(conn.writable()))
 }
 
+#[no_mangle]
+pub extern fn quiche_conn_readable_into(
+    conn: &Connection, out: *mut u64, out_len: size_t,
+) -> size_t {
+    // Allow querying the number of streams with a NULL buffer.
+    let out = if out_len == 0 {
+        &mut []
+    } else {
+        unsafe { slice::from_raw_parts_mut(out, out_len) }
+    };
+
+    conn.readable_into(out)
+}
+
+#[no_mangle]
+pub extern fn quiche_conn_writable_into(
+    conn: &Connection, out: *mut u64, out_len: size_t,
+) -> size_t {
+    // Allow querying the number of streams with a NULL buffer.
+    let out = if out_len == 0 {
+        &mut []
+    } else {
+        unsafe { slice::from_raw_parts_mut(out, out_len) }
+    };
+
+    conn.writable_into(out)
+}
+
 #[no_mangle]
 pub extern fn quiche_conn_max_send_udp_payload_size(conn: &Connection) -> usize {
     conn.max_send_udp_payload_size()
@@ -1142,6 +1346,8 @@ pub struct Stats {
     recv_bytes: u64,
     lost_bytes: u64,
     stream_retrans_bytes: u64,
+    dropped_blocks: u64,
+    dropped_bytes: u64,
     peer_max_idle_timeout: u64,
     peer_max_udp_payload_size: u64,
     peer_initial_max_data: u64,
@@ -1171,6 +1377,8 @@ pub extern fn quiche_conn_stats(conn: &Connection, out: &mut Stats) {
     out.recv_bytes = stats.recv_bytes;
     out.lost_bytes = stats.lost_bytes;
     out.stream_retrans_bytes = stats.stream_retrans_bytes;
+    out.dropped_blocks = stats.dropped_blocks;
+    out.dropped_bytes = stats.dropped_bytes;
     out.peer_max_idle_timeout = stats.peer_max_idle_timeout;
     out.peer_max_udp_payload_size = stats.peer_max_udp_payload_size;
     out.peer_initial_max_data = stats.peer_initial_max_data;
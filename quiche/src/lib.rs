@@ -376,6 +376,8 @@ use std::str::FromStr;
 use std::collections::HashSet;
 use std::collections::VecDeque;
 
+pub use crate::scheduler::SchedulerInfo;
+pub use crate::scheduler::SchedulerOps;
 pub use crate::scheduler::SchedulerType;
 
 /// The current QUIC wire version.
@@ -528,6 +530,11 @@ pub enum Error {
     /// Error in scheduler type
     SchedulerType,
 
+    /// The block was rejected by the scheduler's admission control, because
+    /// it can't be delivered before its deadline, or because the block it
+    /// depends on was dropped. The stream was not created.
+    BlockRejected,
+
 }
 
 impl Error {
@@ -566,6 +573,7 @@ impl Error {
             Error::IdLimit => -17,
             Error::OutOfIdentifiers => -18,
             Error::SchedulerType => -19,
+            Error::BlockRejected => -20,
         }
     }
 }
@@ -686,6 +694,11 @@ pub struct Config {
     /// Type of the scheduler
     /// default: scheduler::SchedulerType::Dynamic
     scheduler_type: scheduler::SchedulerType,
+
+    /// Functions of the scheduler plugin, used with `SchedulerType::Plugin`
+    scheduler_ops: Option<scheduler::SchedulerOps>,
+
+    deadline_scheduling: bool,
 }
 
 // See https://quicwg.org/base-drafts/rfc9000.html#section-15
@@ -745,6 +758,10 @@ impl Config {
             disable_dcid_reuse: false,
 
             scheduler_type: SchedulerType::Dynamic, // default scheduler
+
+            scheduler_ops: None,
+
+            deadline_scheduling: false,
         })
     }
 
@@ -1088,6 +1105,34 @@ impl Config {
         self.scheduler_type = sche;
     }
 
+    /// Schedules blocks with the given plugin functions, instead of one of
+    /// the built-in schedulers.
+    ///
+    /// This also sets the scheduler type to `SchedulerType::Plugin`. Each
+    /// connection created from this configuration calls the same functions,
+    /// with the same context pointer.
+    pub fn set_scheduler_ops(&mut self, ops: SchedulerOps) {
+        self.scheduler_type = SchedulerType::Plugin;
+        self.scheduler_ops = Some(ops);
+    }
+
+    /// Configures whether STREAM frames are scheduled by the configured
+    /// scheduler.
+    ///
+    /// When enabled, incremental streams are treated as blocks, and the block
+    /// to send next is chosen by the scheduler (see [`set_scheduler_type()`])
+    /// based on the block's deadline, priority and dependency, as well as the
+    /// current pacing rate and RTT estimates. Blocks that the scheduler
+    /// decides to drop are reset. Otherwise streams are sent in order of
+    /// their urgency.
+    ///
+    /// The default value is `false`.
+    ///
+    /// [`set_scheduler_type()`]: struct.Config.html#method.set_scheduler_type
+    pub fn enable_deadline_scheduling(&mut self, v: bool) {
+        self.deadline_scheduling = v;
+    }
+
     /// Configures whether to enable HyStart++.
     ///
     /// The default value is `true`.
@@ -1508,6 +1553,16 @@ pub fn version_is_supported(version: u32) -> bool {
     )
 }
 
+/// Returns the current time on the scheduler clock, in microseconds.
+///
+/// This is the monotonic clock used to timestamp blocks and to evaluate their
+/// deadlines. It doesn't follow wall-clock adjustments, and its origin is
+/// arbitrary, so it should only be used to measure intervals.
+#[inline]
+pub fn clock_micros() -> u64 {
+    stream::clock_micros(time::Instant::now())
+}
+
 /// Pushes a frame to the output packet if there is enough space.
 ///
 /// Returns `true` on success, `false` otherwise. In case of failure it means
@@ -1560,6 +1615,37 @@ macro_rules! qlog_with_type {
     }};
 }
 
+/// Records a tracing event.
+///
+/// The event is only recorded if the trace feature is enabled and the given
+/// level is within the configured trace level, otherwise the arguments are not
+/// converted. Without the trace feature they are not evaluated either: they
+/// are only referenced from a closure that is never called, so that values
+/// computed just for tracing don't trigger unused warnings.
+macro_rules! trace_event {
+    ($level:ident, $ty:ident, $stream_id:expr, [$($arg:expr),*]) => {{
+        #[cfg(feature = "trace")]
+        {
+            if crate::trace::enabled(crate::trace::TraceLevel::$level) {
+                use crate::trace::TraceArg;
+
+                crate::trace::record(
+                    crate::trace::TraceEventType::$ty,
+                    $stream_id,
+                    &[$($arg.into_arg()),*],
+                );
+            }
+        }
+
+        #[cfg(not(feature = "trace"))]
+        {
+            let _ = || {
+                let _ = (&$stream_id, $(&$arg),*);
+            };
+        }
+    }};
+}
+
 #[cfg(feature = "qlog")]
 const QLOG_PARAMS_SET: EventType =
     EventType::TransportEventType(TransportEventType::ParametersSet);
@@ -1998,14 +2084,71 @@ impl Connection {
     /// # Ok::<(), quiche::Error>(())
     /// ```
     pub fn recv(&mut self, buf: &mut [u8], info: RecvInfo) -> Result<usize> {
+        let recv_pid = self.paths.path_id_from_addrs(&(info.to, info.from));
+
+        let done =
+            self.recv_datagram(buf, &info, recv_pid, time::Instant::now())?;
+
+        self.recv_undecryptable_pkts()?;
+
+        Ok(done)
+    }
+
+    /// Processes a batch of UDP datagrams received from the peer.
+    ///
+    /// This is equivalent to calling [`recv()`] for each datagram, in order,
+    /// except that the clock is only sampled once for the whole batch, and
+    /// that the path a datagram was received on is only looked up when its
+    /// addresses differ from the previous datagram's.
+    ///
+    /// On success the number of datagrams processed is returned. On error,
+    /// the connection is closed as with [`recv()`], and the remaining
+    /// datagrams are not processed.
+    ///
+    /// [`recv()`]: struct.Connection.html#method.recv
+    pub fn recv_batch<'b, I>(&mut self, datagrams: I) -> Result<usize>
+    where
+        I: IntoIterator<Item = (&'b mut [u8], RecvInfo)>,
+    {
+        let now = time::Instant::now();
+
+        // Path of the last datagram received on a known path.
+        let mut last: Option<(RecvInfo, usize)> = None;
+
+        let mut count = 0;
+
+        for (buf, info) in datagrams {
+            let recv_pid = match last {
+                Some((last_info, pid)) if last_info == info => Some(pid),
+
+                _ => self.paths.path_id_from_addrs(&(info.to, info.from)),
+            };
+
+            self.recv_datagram(buf, &info, recv_pid, now)?;
+
+            // Creating a new path might have evicted the cached one.
+            last = recv_pid.map(|pid| (info, pid));
+
+            count += 1;
+        }
+
+        self.recv_undecryptable_pkts()?;
+
+        Ok(count)
+    }
+
+    /// Processes the packets coalesced in a single UDP datagram, received on
+    /// the given path.
+    fn recv_datagram(
+        &mut self, buf: &mut [u8], info: &RecvInfo, recv_pid: Option<usize>,
+        now: time::Instant,
+    ) -> Result<usize> {
         let len = buf.len();
 
         if len == 0 {
             return Err(Error::BufferTooShort);
         }
 
-        let recv_pid = self.paths.path_id_from_addrs(&(info.to, info.from));
-
         if let Some(recv_pid) = recv_pid {
             let recv_path = self.paths.get_mut(recv_pid)?;
 
@@ -2042,8 +2185,9 @@ impl Connection {
         while left > 0 {
             let read = match self.recv_single(
                 &mut buf[len - left..len],
-                &info,
+                info,
                 recv_pid,
+                now,
             ) {
                 Ok(v) => v,
 
@@ -2061,8 +2205,12 @@ impl Connection {
             left -= read;
         }
 
-        // Process previously undecryptable 0-RTT packets if the decryption key
-        // is now available.
+        Ok(done)
+    }
+
+    /// Processes previously undecryptable 0-RTT packets if the decryption key
+    /// is now available.
+    fn recv_undecryptable_pkts(&mut self) -> Result<()> {
         if self.pkt_num_spaces[packet::EPOCH_APPLICATION]
             .crypto_0rtt_open
             .is_some()
@@ -2080,7 +2228,7 @@ impl Connection {
             }
         }
 
-        Ok(done)
+        Ok(())
     }
 
     /// Processes a single QUIC packet received from the peer.
@@ -2099,9 +2247,8 @@ impl Connection {
     /// [`Done`]: enum.Error.html#variant.Done
     fn recv_single(
         &mut self, buf: &mut [u8], info: &RecvInfo, recv_pid: Option<usize>,
+        now: time::Instant,
     ) -> Result<usize> {
-        let now = time::Instant::now();
-
         if buf.is_empty() {
             return Err(Error::Done);
         }
@@ -2889,6 +3036,68 @@ impl Connection {
             return Err(Error::BufferTooShort);
         }
 
+        self.send_prepare()?;
+
+        self.send_datagram(out, from, to, time::Instant::now())
+    }
+
+    /// Writes a batch of UDP datagrams to be sent to the peer, one in each of
+    /// the given buffers.
+    ///
+    /// This is equivalent to calling [`send()`] until either all the buffers
+    /// are filled or [`Done`] is returned, except that the handshake and
+    /// pending 0-RTT packets are only processed once, and that the clock is
+    /// only sampled once for the whole batch.
+    ///
+    /// `on_datagram` is called with the number of bytes written and the
+    /// [`SendInfo`] of each buffer that was filled, in order. On success the
+    /// number of buffers filled is returned, or [`Done`] if there was nothing
+    /// to write.
+    ///
+    /// [`send()`]: struct.Connection.html#method.send
+    /// [`Done`]: enum.Error.html#variant.Done
+    /// [`SendInfo`]: struct.SendInfo.html
+    pub fn send_batch<'b, I, F>(
+        &mut self, outs: I, mut on_datagram: F,
+    ) -> Result<usize>
+    where
+        I: IntoIterator<Item = &'b mut [u8]>,
+        F: FnMut(usize, SendInfo),
+    {
+        self.send_prepare()?;
+
+        let now = time::Instant::now();
+
+        let mut count = 0;
+
+        for out in outs {
+            if out.is_empty() {
+                return Err(Error::BufferTooShort);
+            }
+
+            match self.send_datagram(out, None, None, now) {
+                Ok((written, info)) => on_datagram(written, info),
+
+                Err(Error::Done) => break,
+
+                Err(e) => return Err(e),
+            }
+
+            count += 1;
+        }
+
+        if count == 0 {
+            return Err(Error::Done);
+        }
+
+        Ok(count)
+    }
+
+    /// Performs the work needed before writing datagrams, returning [`Done`]
+    /// if none can be written.
+    ///
+    /// [`Done`]: enum.Error.html#variant.Done
+    fn send_prepare(&mut self) -> Result<()> {
         if self.is_closed() || self.is_draining() {
             return Err(Error::Done);
         }
@@ -2925,6 +3134,19 @@ impl Connection {
             return Err(Error::Done);
         }
 
+        Ok(())
+    }
+
+    /// Writes the packets coalesced in a single UDP datagram.
+    fn send_datagram(
+        &mut self, out: &mut [u8], from: Option<SocketAddr>,
+        to: Option<SocketAddr>, now: time::Instant,
+    ) -> Result<(usize, SendInfo)> {
+        // The connection might have been closed by the previous datagram.
+        if self.is_closed() || self.is_draining() {
+            return Err(Error::Done);
+        }
+
         let mut has_initial = false;
 
         let mut done = 0;
@@ -2956,6 +3178,7 @@ impl Connection {
                 &mut out[done..done + left],
                 send_pid,
                 has_initial,
+                now,
             ) {
                 Ok(v) => v,
 
@@ -3023,9 +3246,8 @@ impl Connection {
 
     fn send_single(
         &mut self, out: &mut [u8], send_pid: usize, has_initial: bool,
+        now: time::Instant,
     ) -> Result<(packet::Type, usize)> {
-        let now = time::Instant::now();
-
         if out.is_empty() {
             return Err(Error::BufferTooShort);
         }
@@ -3095,6 +3317,8 @@ impl Connection {
                             );
                         }
 
+                        self.streams.update_block(stream_id);
+
                         self.stream_retrans_bytes += length as u64;
                         p.stream_retrans_bytes += length as u64;
 
@@ -3775,24 +3999,21 @@ impl Connection {
             self.paths.get(send_pid)?.active() &&
             !dgram_emitted
         {
-            // // // log network and cc stats
-            // let rtt = self.paths.get(send_pid)?.recovery.rtt().as_millis() as f64;
-            // let bandwidth = self.paths.get(send_pid)?.recovery.pacer.rate() as f64; // bytes / sec
-            // let now_time_ms = match time::SystemTime::now()
-            //     .duration_since(time::SystemTime::UNIX_EPOCH)
-            // {
-            //     Ok(n) => n.as_millis(),
-            //     Err(_) => panic!("SystemTime before UNIX EPOCH!"),
-            // };
-            // //eprintln!("{} ms; bw: {} Bytes/s; rtt: {} ms; ", now_time_ms, bandwidth, rtt);
-            //
-            // while let Some(stream_id) = self.streams.peek_flushable(
-            //     bandwidth as f64,
-            //     rtt,
-            //     pn, // next_packet_id
-            //     now_time_ms as u64,
-            // ) {
-            while let Some(stream_id) = self.streams.pop_flushable() {
+            // Network estimates used by the scheduler when deadline scheduling
+            // is enabled.
+            let recovery = &self.paths.get(send_pid)?.recovery;
+            let rtt = recovery.rtt().as_millis() as f64;
+            let bandwidth = recovery.pacer.rate() as f64; // bytes / sec
+            let now_us = stream::clock_micros(now);
+
+            self.streams.update_path_estimates(&scheduler::PathEstimates {
+                btlbw: recovery.bottleneck_bandwidth() as f64,
+                min_rtt: recovery.min_rtt().as_secs_f64() * 1000.0,
+            });
+
+            while let Some(stream_id) =
+                self.streams.peek_flushable(bandwidth, rtt, pn, now_us)
+            {
                 let stream = match self.streams.get_mut(stream_id) {
                     // Avoid sending frames for streams that were already stopped.
                     //
@@ -3800,7 +4021,7 @@ impl Connection {
                     // flushed on the wire when a STOP_SENDING frame is received.
                     Some(v) if !v.send.is_stopped() => v,
                     _ => {
-                        self.streams.remove_flushable();
+                        self.streams.remove_peeked(stream_id);
                         continue;
                     },
                 };
@@ -3832,7 +4053,7 @@ impl Connection {
                     Some(v) => v,
 
                     None => {
-                        self.streams.remove_flushable();
+                        self.streams.remove_peeked(stream_id);
                         continue;
                     },
                 };
@@ -3878,7 +4099,9 @@ impl Connection {
 
                 // If the stream is no longer flushable, remove it from the queue
                 if !stream.is_flushable() {
-                    self.streams.remove_flushable();
+                    self.streams.remove_peeked(stream_id);
+                } else {
+                    self.streams.update_block(stream_id);
                 }
 
                 break;
@@ -4185,6 +4408,94 @@ impl Connection {
     pub fn stream_recv(
         &mut self, stream_id: u64, out: &mut [u8],
     ) -> Result<(usize, bool)> {
+        self.stream_read(stream_id, |recv| recv.emit(out))
+    }
+
+    /// Returns the contiguous data at the current read offset of a stream,
+    /// without copying it.
+    ///
+    /// This is the first of the chunks buffered by the stream, so more data
+    /// might be available once it has been read. The data isn't considered
+    /// read until [`stream_recv_consume()`][consume] is called.
+    ///
+    /// On success the data and a flag indicating whether it reaches the end of
+    /// the stream are returned as a tuple, or [`Done`] if there is no data to
+    /// read.
+    ///
+    /// [consume]: struct.Connection.html#method.stream_recv_consume
+    /// [`Done`]: enum.Error.html#variant.Done
+    ///
+    /// ## Examples:
+    ///
+    /// ```no_run
+    /// # let socket = std::net::UdpSocket::bind("127.0.0.1:0").unwrap();
+    /// # let mut config = quiche::Config::new(quiche::PROTOCOL_VERSION)?;
+    /// # let scid = quiche::ConnectionId::from_ref(&[0xba; 16]);
+    /// # let peer = "127.0.0.1:1234".parse().unwrap();
+    /// # let local = socket.local_addr().unwrap();
+    /// # let mut conn = quiche::accept(&scid, None, local, peer, &mut config)?;
+    /// # let stream_id = 0;
+    /// while let Ok((data, fin)) = conn.stream_recv_peek(stream_id) {
+    ///     let len = data.len();
+    ///     println!("Got {} bytes on stream {}", len, stream_id);
+    ///
+    ///     conn.stream_recv_consume(stream_id, len)?;
+    /// }
+    /// # Ok::<(), quiche::Error>(())
+    /// ```
+    pub fn stream_recv_peek(&mut self, stream_id: u64) -> Result<(&[u8], bool)> {
+        // We can't read on our own unidirectional streams.
+        if !stream::is_bidi(stream_id) &&
+            stream::is_local(stream_id, self.is_server)
+        {
+            return Err(Error::InvalidStreamState(stream_id));
+        }
+
+        let stream = self
+            .streams
+            .get(stream_id)
+            .ok_or(Error::InvalidStreamState(stream_id))?;
+
+        if !stream.is_readable() {
+            return Err(Error::Done);
+        }
+
+        // Let errors, and the state changes they trigger (e.g. collecting a
+        // reset stream), go through the regular read path.
+        if let Some(e) = stream.recv.peek().err() {
+            self.stream_read(stream_id, |_| Err(e))?;
+
+            return Err(e);
+        }
+
+        match self.streams.get(stream_id) {
+            Some(stream) => stream.recv.peek(),
+
+            None => Err(Error::InvalidStreamState(stream_id)),
+        }
+    }
+
+    /// Reads up to `len` bytes of contiguous data from a stream, discarding
+    /// them.
+    ///
+    /// This is meant to be called after [`stream_recv_peek()`], once the
+    /// application is done with the data. It behaves like [`stream_recv()`]
+    /// without the copy.
+    ///
+    /// [`stream_recv_peek()`]: struct.Connection.html#method.stream_recv_peek
+    /// [`stream_recv()`]: struct.Connection.html#method.stream_recv
+    pub fn stream_recv_consume(
+        &mut self, stream_id: u64, len: usize,
+    ) -> Result<(usize, bool)> {
+        self.stream_read(stream_id, |recv| recv.consume(len))
+    }
+
+    /// Reads from a stream through `read`, which is given the stream's receive
+    /// buffer, and updates the stream and connection state accordingly.
+    fn stream_read<F>(&mut self, stream_id: u64, read: F) -> Result<(usize, bool)>
+    where
+        F: FnOnce(&mut stream::RecvBuf) -> Result<(usize, bool)>,
+    {
         // We can't read on our own unidirectional streams.
         if !stream::is_bidi(stream_id) &&
             stream::is_local(stream_id, self.is_server)
@@ -4206,7 +4517,7 @@ impl Connection {
         #[cfg(feature = "qlog")]
         let offset = stream.recv.off_front();
 
-        let (read, fin) = match stream.recv.emit(out) {
+        let (read, fin) = match read(&mut stream.recv) {
             Ok(v) => v,
 
             Err(e) => {
@@ -4326,6 +4637,84 @@ impl Connection {
         &mut self, stream_id: u64, buf: &[u8], fin: bool, deadline: u64,
         priority: u64, depend_id: u64,
     ) -> Result<usize> {
+        self.stream_write(
+            stream_id,
+            buf.len(),
+            fin,
+            deadline,
+            priority,
+            depend_id,
+            true,
+            |send, len, fin| send.write(&buf[..len], fin),
+        )
+    }
+
+    /// Writes an owned buffer to a stream, without copying it.
+    ///
+    /// This is the same as [`stream_send()`], except that quiche keeps `buf`
+    /// instead of copying its data, and drops it once none of its data is
+    /// needed anymore, that is, once it was all acked or the stream was reset.
+    ///
+    /// Unlike [`stream_send()`], the buffer is either written whole or not at
+    /// all: if the connection or the stream can't take all of it,
+    /// [`Done`] is returned and `buf` is dropped before returning.
+    ///
+    /// `buf` can be a `Vec<u8>`, an `Arc<[u8]>` or a [`ForeignBuf`].
+    ///
+    /// [`stream_send()`]: struct.Connection.html#method.stream_send
+    /// [`Done`]: enum.Error.html#variant.Done
+    /// [`ForeignBuf`]: struct.ForeignBuf.html
+    pub fn stream_send_owned<B: Into<stream::OwnedBuf>>(
+        &mut self, stream_id: u64, buf: B, fin: bool,
+    ) -> Result<usize> {
+        self.stream_send_full_owned(
+            stream_id,
+            buf,
+            fin,
+            stream::MAX_DEADLINE,
+            stream::DEFAULT_PRIORITY,
+            stream_id, // default: no depend
+        )
+    }
+
+    /// Writes an owned buffer to a stream, without copying it, with the given
+    /// deadline, priority and dependency.
+    ///
+    /// See [`stream_send_full()`] and [`stream_send_owned()`].
+    ///
+    /// [`stream_send_full()`]: struct.Connection.html#method.stream_send_full
+    /// [`stream_send_owned()`]: struct.Connection.html#method.stream_send_owned
+    pub fn stream_send_full_owned<B: Into<stream::OwnedBuf>>(
+        &mut self, stream_id: u64, buf: B, fin: bool, deadline: u64,
+        priority: u64, depend_id: u64,
+    ) -> Result<usize> {
+        let buf = buf.into();
+
+        self.stream_write(
+            stream_id,
+            buf.len(),
+            fin,
+            deadline,
+            priority,
+            depend_id,
+            false,
+            |send, _, fin| send.write_owned(buf, fin),
+        )
+    }
+
+    /// Writes `len` bytes to a stream, through `write`, which is given the
+    /// stream's send buffer, the number of bytes to write and the fin flag,
+    /// after they have been adjusted to the connection's send capacity.
+    ///
+    /// Unless `partial` is set, `Error::Done` is returned instead of writing
+    /// only part of the data when the send capacity is too low.
+    fn stream_write<F>(
+        &mut self, stream_id: u64, len: usize, fin: bool, deadline: u64,
+        priority: u64, depend_id: u64, partial: bool, write: F,
+    ) -> Result<usize>
+    where
+        F: FnOnce(&mut stream::SendBuf, usize, bool) -> Result<usize>,
+    {
         // We can't write on the peer's unidirectional streams.
         if !stream::is_bidi(stream_id) &&
             !stream::is_local(stream_id, self.is_server)
@@ -4338,8 +4727,13 @@ impl Connection {
         //
         // Note that this is separate from "send capacity" as that also takes
         // congestion control into consideration.
-        if self.max_tx_data - self.tx_data < buf.len() as u64 {
-            eprintln!("congestion control into consideration {}, {}, {}", self.max_tx_data, self.tx_data, buf.len());
+        if self.max_tx_data - self.tx_data < len as u64 {
+            trace_event!(Info, ConnectionBlocked, stream_id, [
+                self.max_tx_data,
+                self.tx_data,
+                len
+            ]);
+
             self.blocked_limit = Some(self.max_tx_data);
         }
 
@@ -4349,15 +4743,25 @@ impl Connection {
         // When the cap is zero, the method returns Ok(0) *only* when the passed
         // buffer is empty. We return Error::Done otherwise.
         let cap = self.tx_cap;
-        if cap == 0 && !(fin && buf.is_empty()) {
+        if (cap == 0 || (cap < len && !partial)) && !(fin && len == 0) {
             return Err(Error::Done);
         }
-        //eprintln!("fin {} cap {} buflen {}", fin, cap, buf.len());
-        let (buf, fin) = if cap < buf.len() {
-            (&buf[..cap], false)
-        } else {
-            (buf, fin)
-        };
+
+        // New blocks go through the scheduler's admission control, with the
+        // size of the whole block rather than of what fits in the send
+        // capacity.
+        if self.streams.get(stream_id).is_none() &&
+            !self.streams.is_collected(stream_id) &&
+            !self.streams.admit_block(
+                stream_id, len, deadline, priority, depend_id,
+            )
+        {
+            return Err(Error::BlockRejected);
+        }
+
+        //eprintln!("fin {} cap {} buflen {}", fin, cap, len);
+        let (len, fin) = if cap < len { (cap, false) } else { (len, fin) };
+
         // Get existing stream or create a new one.
         let stream = self.get_or_create_stream_full(stream_id, true, deadline, priority, depend_id,)?;
 
@@ -4366,16 +4770,15 @@ impl Connection {
 
         let was_flushable = stream.is_flushable();
 
-        let sent = match stream.send.write(buf, fin) {
+        let sent = match write(&mut stream.send, len, fin) {
             Ok(v) => v,
 
             Err(e) => {
                 self.streams.mark_writable(stream_id, false);
-                println!("error2");
                 return Err(e);
             },
         };
-        //eprintln!("sent size {}, {}", sent, buf.len());
+        //eprintln!("sent size {}, {}", sent, len);
 
         let urgency = stream.urgency;
         let incremental = stream.incremental;
@@ -4384,9 +4787,11 @@ impl Connection {
 
         let writable = stream.is_writable();
 
-        let empty_fin = buf.is_empty() && fin;
+        let empty_fin = len == 0 && fin;
+
+        if sent < len {
+            trace_event!(Info, PartialWrite, stream_id, [len, sent]);
 
-        if sent < buf.len() {
             let max_off = stream.send.max_off();
 
             if stream.send.blocked_at() != Some(max_off) {
@@ -4405,6 +4810,8 @@ impl Connection {
         // frame that has the fin flag set.
         if (flushable || empty_fin) && !was_flushable {
             self.streams.push_flushable(stream_id, urgency, incremental);
+        } else {
+            self.streams.update_block(stream_id);
         }
 
         if !writable {
@@ -4429,8 +4836,7 @@ impl Connection {
             q.add_event_data_with_instant(ev_data, now).ok();
         });
 
-        if sent == 0 && !buf.is_empty() {
-            println!("error3");
+        if sent == 0 && len != 0 {
             return Err(Error::Done);
         }
 
@@ -4520,6 +4926,8 @@ impl Connection {
 
                 // Once shutdown, the stream is guaranteed to be non-writable.
                 self.streams.mark_writable(stream_id, false);
+
+                self.streams.update_block(stream_id);
             },
         }
 
@@ -4720,6 +5128,42 @@ impl Connection {
         self.streams.readable()
     }
 
+    /// Copies the IDs of the streams that have outstanding data to read into
+    /// `out`, without allocating.
+    ///
+    /// This is the same as [`readable()`], except that the streams are written
+    /// into a buffer provided by the application. The total number of readable
+    /// streams is returned, and only the first `out.len()` of them are copied
+    /// if the buffer is too small.
+    ///
+    /// [`readable()`]: struct.Connection.html#method.readable
+    ///
+    /// ## Examples:
+    ///
+    /// ```no_run
+    /// # let mut buf = [0; 512];
+    /// # let socket = std::net::UdpSocket::bind("127.0.0.1:0").unwrap();
+    /// # let mut config = quiche::Config::new(quiche::PROTOCOL_VERSION)?;
+    /// # let scid = quiche::ConnectionId::from_ref(&[0xba; 16]);
+    /// # let peer = "127.0.0.1:1234".parse().unwrap();
+    /// # let local = socket.local_addr().unwrap();
+    /// # let mut conn = quiche::accept(&scid, None, local, peer, &mut config)?;
+    /// let mut ids = [0; 64];
+    ///
+    /// let n = conn.readable_into(&mut ids).min(ids.len());
+    ///
+    /// for &stream_id in &ids[..n] {
+    ///     while let Ok((read, fin)) = conn.stream_recv(stream_id, &mut buf) {
+    ///         println!("Got {} bytes on stream {}", read, stream_id);
+    ///     }
+    /// }
+    /// # Ok::<(), quiche::Error>(())
+    /// ```
+    #[inline]
+    pub fn readable_into(&self, out: &mut [u64]) -> usize {
+        self.streams.readable_into(out)
+    }
+
     /// Returns an iterator over streams that can be written to.
     ///
     /// A "writable" stream is a stream that has enough flow control capacity to
@@ -4762,6 +5206,25 @@ impl Connection {
         self.streams.writable()
     }
 
+    /// Copies the IDs of the streams that can be written to into `out`,
+    /// without allocating.
+    ///
+    /// This is the same as [`writable()`], except that the streams are written
+    /// into a buffer provided by the application. The total number of writable
+    /// streams is returned, and only the first `out.len()` of them are copied
+    /// if the buffer is too small.
+    ///
+    /// [`writable()`]: struct.Connection.html#method.writable
+    pub fn writable_into(&self, out: &mut [u64]) -> usize {
+        // If there is not enough connection-level send capacity, none of the
+        // streams are writable.
+        if self.tx_cap == 0 {
+            return 0;
+        }
+
+        self.streams.writable_into(out)
+    }
+
     /// Returns the maximum possible size of egress UDP payloads.
     ///
     /// This is the maximum size of UDP payloads that can be sent, and depends
@@ -5761,6 +6224,7 @@ impl Connection {
     #[inline]
     pub fn stats(&self) -> Stats {
         let paths = self.paths.iter().map(|(_, p)| p.stats()).collect();
+        let (dropped_blocks, dropped_bytes) = self.streams.dropped();
         Stats {
             recv: self.recv_count,
             sent: self.sent_count,
@@ -5770,6 +6234,8 @@ impl Connection {
             recv_bytes: self.recv_bytes,
             lost_bytes: self.lost_bytes,
             stream_retrans_bytes: self.stream_retrans_bytes,
+            dropped_blocks,
+            dropped_bytes,
             peer_max_idle_timeout: self.peer_transport_params.max_idle_timeout,
             peer_max_udp_payload_size: self
                 .peer_transport_params
@@ -6205,7 +6671,11 @@ impl Connection {
 
                     Err(e) => return Err(e),
                 };
-                eprintln!("Reset frame stream id {}", stream_id);
+                trace_event!(Info, ResetReceived, stream_id, [
+                    error_code,
+                    final_size
+                ]);
+
                 let was_readable = stream.is_readable();
 
                 let max_off_delta =
@@ -6965,6 +7435,13 @@ pub struct Stats {
     /// The number of stream bytes retranmitted.
     pub stream_retrans_bytes: u64,
 
+    /// The number of blocks dropped before being fully sent, e.g. because
+    /// they missed their deadline or were rejected by admission control.
+    pub dropped_blocks: u64,
+
+    /// The number of unsent stream bytes discarded with the dropped blocks.
+    pub dropped_bytes: u64,
+
     /// The maximum idle timeout.
     pub peer_max_idle_timeout: u64,
 
@@ -7023,6 +7500,12 @@ impl std::fmt::Debug for Stats {
             self.sent_bytes, self.recv_bytes, self.lost_bytes,
         )?;
 
+        write!(
+            f,
+            " dropped_blocks={} dropped_bytes={}",
+            self.dropped_blocks, self.dropped_bytes,
+        )?;
+
         write!(f, " peer_tps={{")?;
 
         write!(f, " max_idle_timeout={},", self.peer_max_idle_timeout)?;
@@ -8594,6 +9077,141 @@ mod tests {
         assert!(pipe.server.stream_finished(4));
     }
 
+    #[test]
+    fn stream_recv_peek_consume() {
+        let mut pipe = testing::Pipe::default().unwrap();
+        assert_eq!(pipe.handshake(), Ok(()));
+
+        assert_eq!(pipe.client.stream_send(4, b"hello, world", true), Ok(12));
+        assert_eq!(pipe.advance(), Ok(()));
+
+        assert_eq!(
+            pipe.server.stream_recv_peek(4),
+            Ok((&b"hello, world"[..], true))
+        );
+
+        // Peeking doesn't read anything.
+        assert_eq!(
+            pipe.server.stream_recv_peek(4),
+            Ok((&b"hello, world"[..], true))
+        );
+
+        assert_eq!(pipe.server.stream_recv_consume(4, 7), Ok((7, false)));
+        assert_eq!(pipe.server.stream_recv_peek(4), Ok((&b"world"[..], true)));
+        assert!(!pipe.server.stream_finished(4));
+
+        assert_eq!(pipe.server.stream_recv_consume(4, 5), Ok((5, true)));
+        assert!(pipe.server.stream_finished(4));
+
+        assert_eq!(
+            pipe.server.stream_recv_peek(4),
+            Err(Error::InvalidStreamState(4))
+        );
+    }
+
+    #[test]
+    fn readable_writable_into() {
+        let mut pipe = testing::Pipe::default().unwrap();
+        assert_eq!(pipe.handshake(), Ok(()));
+
+        assert_eq!(pipe.client.stream_send(4, b"aaaaa", false), Ok(5));
+        assert_eq!(pipe.client.stream_send(8, b"aaaaa", false), Ok(5));
+        assert_eq!(pipe.advance(), Ok(()));
+
+        let mut ids = [0; 4];
+
+        assert_eq!(pipe.server.readable_into(&mut ids), 2);
+        ids[..2].sort_unstable();
+        assert_eq!(&ids[..2], &[4, 8]);
+
+        // Only the streams that fit are copied.
+        let mut one = [0; 1];
+        assert_eq!(pipe.server.readable_into(&mut one), 2);
+        assert!(one[0] == 4 || one[0] == 8);
+
+        let mut b = [0; 15];
+        pipe.server.stream_recv(4, &mut b).unwrap();
+
+        assert_eq!(pipe.server.readable_into(&mut ids), 1);
+        assert_eq!(ids[0], 8);
+
+        assert_eq!(
+            pipe.server.writable_into(&mut ids),
+            pipe.server.writable().len()
+        );
+    }
+
+    #[test]
+    fn send_recv_batch() {
+        fn transfer(
+            from: &mut Connection, to: &mut Connection, bufs: &mut [Vec<u8>],
+        ) -> Result<usize> {
+            let mut lens = Vec::new();
+            let mut infos = Vec::new();
+
+            from.send_batch(bufs.iter_mut().map(|b| b.as_mut_slice()), |len, si| {
+                lens.push(len);
+                infos.push(RecvInfo {
+                    to: si.to,
+                    from: si.from,
+                });
+            })?;
+
+            let datagrams = bufs
+                .iter_mut()
+                .zip(lens)
+                .zip(infos)
+                .map(|((b, len), info)| (&mut b[..len], info));
+
+            to.recv_batch(datagrams)
+        }
+
+        let mut pipe = testing::Pipe::default().unwrap();
+
+        let mut bufs = vec![vec![0; 1350]; 8];
+
+        // Handshake using only the batch APIs.
+        assert_eq!(
+            transfer(&mut pipe.client, &mut pipe.server, &mut bufs),
+            Ok(1)
+        );
+        assert!(transfer(&mut pipe.server, &mut pipe.client, &mut bufs).is_ok());
+        assert!(pipe.client.is_established());
+
+        assert!(transfer(&mut pipe.client, &mut pipe.server, &mut bufs).is_ok());
+        assert!(pipe.server.is_established());
+
+        assert_eq!(pipe.client.stream_send(4, b"hello, world", true), Ok(12));
+        assert_eq!(pipe.client.stream_send(8, b"hello", true), Ok(5));
+        assert!(transfer(&mut pipe.client, &mut pipe.server, &mut bufs).is_ok());
+
+        let mut b = [0; 15];
+        assert_eq!(pipe.server.stream_recv(4, &mut b), Ok((12, true)));
+        assert_eq!(&b[..12], b"hello, world");
+        assert_eq!(pipe.server.stream_recv(8, &mut b), Ok((5, true)));
+
+        // Everything was flushed by the previous batch.
+        let mut bufs = vec![vec![0; 1350]; 8];
+        assert_eq!(
+            pipe.client
+                .send_batch(bufs.iter_mut().map(|b| b.as_mut_slice()), |_, _| ()),
+            Err(Error::Done)
+        );
+
+        // Empty buffers are rejected.
+        let active_path = pipe.server.paths.get_active().unwrap();
+        let info = RecvInfo {
+            to: active_path.local_addr(),
+            from: active_path.peer_addr(),
+        };
+
+        let mut empty = [0; 0];
+        assert_eq!(
+            pipe.server.recv_batch(vec![(&mut empty[..], info)]),
+            Err(Error::BufferTooShort)
+        );
+    }
+
     #[test]
     fn zero_rtt() {
         let mut buf = [0; 65535];
@@ -10250,6 +10868,77 @@ mod tests {
         );
     }
 
+    #[test]
+    /// Tests that with deadline scheduling enabled, the block chosen by the
+    /// scheduler is sent first, rather than the first one written.
+    fn stream_deadline_scheduling() {
+        let mut buf = [0; 65535];
+
+        let mut config = Config::new(crate::PROTOCOL_VERSION).unwrap();
+        config
+            .load_cert_chain_from_pem_file("examples/cert.crt")
+            .unwrap();
+        config
+            .load_priv_key_from_pem_file("examples/cert.key")
+            .unwrap();
+        config
+            .set_application_protos(&[b"proto1", b"proto2"])
+            .unwrap();
+        config.set_initial_max_data(30);
+        config.set_initial_max_stream_data_bidi_local(15);
+        config.set_initial_max_stream_data_bidi_remote(15);
+        config.set_initial_max_streams_bidi(3);
+        config.verify_peer(false);
+        config.set_scheduler_type(SchedulerType::DTP);
+        config.enable_deadline_scheduling(true);
+
+        let mut pipe = testing::Pipe::with_config(&mut config).unwrap();
+        assert_eq!(pipe.handshake(), Ok(()));
+
+        // Low priority block with a relaxed deadline.
+        assert_eq!(
+            pipe.client.stream_send_full(0, b"aaaaa", true, 1000, 2, 0),
+            Ok(5)
+        );
+
+        // High priority block with a tight deadline.
+        assert_eq!(
+            pipe.client.stream_send_full(4, b"bbbbb", true, 100, 0, 4),
+            Ok(5)
+        );
+
+        let (len, _) = pipe.client.send(&mut buf).unwrap();
+
+        let frames =
+            testing::decode_pkt(&mut pipe.server, &mut buf, len).unwrap();
+
+        let mut iter = frames.iter();
+
+        // Skip ACK frame.
+        iter.next();
+
+        assert_eq!(
+            iter.next(),
+            Some(&frame::Frame::Stream {
+                stream_id: 4,
+                data: stream::RangeBuf::from(b"bbbbb", 0, true),
+            })
+        );
+
+        let (len, _) = pipe.client.send(&mut buf).unwrap();
+
+        let frames =
+            testing::decode_pkt(&mut pipe.server, &mut buf, len).unwrap();
+
+        assert_eq!(
+            frames.iter().next(),
+            Some(&frame::Frame::Stream {
+                stream_id: 0,
+                data: stream::RangeBuf::from(b"aaaaa", 0, true),
+            })
+        );
+    }
+
     #[test]
     /// Tests the readable iterator.
     fn stream_readable() {
@@ -12355,7 +13044,7 @@ mod tests {
             pipe.client.paths.get_active_path_id().expect("no active");
         let (ty, len) = pipe
             .client
-            .send_single(&mut buf, active_pid, false)
+            .send_single(&mut buf, active_pid, false, time::Instant::now())
             .unwrap();
         assert_eq!(ty, Type::Initial);
 
@@ -12364,7 +13053,7 @@ mod tests {
         // Client sends Handshake packet.
         let (ty, len) = pipe
             .client
-            .send_single(&mut buf, active_pid, false)
+            .send_single(&mut buf, active_pid, false, time::Instant::now())
             .unwrap();
         assert_eq!(ty, Type::Handshake);
 
@@ -14538,8 +15227,16 @@ pub use crate::path::SocketAddrIter;
 
 pub use crate::recovery::CongestionControlAlgorithm;
 
+pub use crate::stream::ForeignBuf;
+pub use crate::stream::OwnedBuf;
 pub use crate::stream::StreamIter;
 
+pub use crate::trace::drain_trace_events;
+pub use crate::trace::set_trace_level;
+pub use crate::trace::TraceEvent;
+pub use crate::trace::TraceEventType;
+pub use crate::trace::TraceLevel;
+
 mod cid;
 mod crypto;
 mod dgram;
@@ -14556,4 +15253,5 @@ mod ranges;
 mod recovery;
 mod stream;
 mod tls;
+mod trace;
 mod scheduler;
\ No newline at end of file
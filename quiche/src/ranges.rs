@@ -107,6 +107,21 @@ impl RangeSet {
         }
     }
 
+    pub fn pop_first(&mut self) -> Option<Range<u64>> {
+        let (&start, &end) = self.inner.iter().next()?;
+        self.inner.remove(&start);
+
+        Some(start..end)
+    }
+
+    pub fn contains(&self, item: u64) -> bool {
+        match self.prev_to(item) {
+            Some(r) => r.contains(&item),
+
+            None => false,
+        }
+    }
+
     pub fn push_item(&mut self, item: u64) {
         self.insert(item..item + 1);
     }
@@ -284,6 +299,24 @@ mod tests {
         assert_eq!(&r.flatten().collect::<Vec<u64>>(), &[4, 5, 6, 9, 10, 11]);
     }
 
+    #[test]
+    fn contains() {
+        let mut r = RangeSet::default();
+        assert!(!r.contains(0));
+
+        r.insert(4..7);
+        r.insert(9..12);
+
+        assert!(!r.contains(3));
+        assert!(r.contains(4));
+        assert!(r.contains(6));
+        assert!(!r.contains(7));
+        assert!(!r.contains(8));
+        assert!(r.contains(9));
+        assert!(r.contains(11));
+        assert!(!r.contains(12));
+    }
+
     #[test]
     fn insert_contained() {
         let mut r = RangeSet::default();
@@ -534,6 +567,19 @@ mod tests {
         assert_eq!(&r.flatten().collect::<Vec<u64>>(), &empty);
     }
 
+    #[test]
+    fn pop_first() {
+        let mut r = RangeSet::default();
+
+        r.insert(9..11);
+        r.insert(3..6);
+
+        assert_eq!(r.pop_first(), Some(3..6));
+        assert_eq!(r.pop_first(), Some(9..11));
+        assert_eq!(r.pop_first(), None);
+        assert_eq!(r.len(), 0);
+    }
+
     #[test]
     fn eq_range() {
         let mut r = RangeSet::default();
@@ -249,6 +249,17 @@ impl State {
             prior_bytes_in_flight: 0,
         }
     }
+
+    /// Returns the estimated bottleneck bandwidth in bytes per second, or 0
+    /// before the first estimate.
+    pub fn btlbw(&self) -> u64 {
+        self.btlbw
+    }
+
+    /// Returns whether Startup found the bandwidth to be fully used.
+    pub fn filled_pipe(&self) -> bool {
+        self.filled_pipe
+    }
 }
 
 // When entering the recovery episode.
@@ -174,6 +174,11 @@ impl Rate {
         self.rate_sample.rtt
     }
 
+    /// Returns whether the latest ACK produced a rate sample.
+    pub fn sample_is_valid(&self) -> bool {
+        !self.rate_sample.interval.is_zero()
+    }
+
     pub fn sample_is_app_limited(&self) -> bool {
         self.rate_sample.is_app_limited
     }
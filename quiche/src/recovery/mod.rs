@@ -61,6 +61,14 @@ const RTT_WINDOW: Duration = Duration::from_secs(300);
 
 const MAX_PTO_PROBES_COUNT: usize = 2;
 
+// Number of RTTs over which the maximum delivery rate is taken as the
+// bottleneck bandwidth, when the congestion control doesn't estimate it.
+const BTLBW_WINDOW_RTTS: u32 = 10;
+
+// Number of delivery rate samples needed before the bottleneck bandwidth
+// estimate is trusted, when the congestion control doesn't estimate it.
+const BTLBW_MIN_SAMPLES: usize = 10;
+
 // Congestion Control
 const INITIAL_WINDOW_PACKETS: usize = 10;
 
@@ -113,6 +121,14 @@ pub struct Recovery {
 
     delivery_rate: delivery_rate::Rate,
 
+    // Windowed maximum of the delivery rate, and the number of samples it was
+    // fed, backing bottleneck_bandwidth() for algorithms other than BBR.
+    btlbw_filter: minmax::Minmax<u64>,
+
+    btlbw: u64,
+
+    btlbw_samples: usize,
+
     pkt_thresh: u64,
 
     time_thresh: f64,
@@ -254,6 +270,12 @@ impl Recovery {
 
             delivery_rate: delivery_rate::Rate::default(),
 
+            btlbw_filter: minmax::Minmax::new(0),
+
+            btlbw: 0,
+
+            btlbw_samples: 0,
+
             cubic_state: cubic::State::default(),
 
             app_limited: false,
@@ -667,6 +689,63 @@ impl Recovery {
         self.delivery_rate.sample_delivery_rate()
     }
 
+    /// Returns the estimated bottleneck bandwidth in bytes per second, or 0
+    /// until the estimate can be relied on.
+    ///
+    /// With BBR this is its windowed maximum of the delivery rate, which,
+    /// unlike the pacing rate, doesn't follow the pacing gain cycles, once
+    /// Startup found the pipe filled. Other algorithms don't filter the
+    /// delivery rate, so its maximum over the last `BTLBW_WINDOW_RTTS` RTTs is
+    /// used instead, once `BTLBW_MIN_SAMPLES` samples were taken.
+    pub fn bottleneck_bandwidth(&self) -> u64 {
+        if std::ptr::eq(self.cc_ops, &bbr::BBR) {
+            if !self.bbr_state.filled_pipe() {
+                return 0;
+            }
+
+            return self.bbr_state.btlbw();
+        }
+
+        if self.btlbw_samples < BTLBW_MIN_SAMPLES {
+            return 0;
+        }
+
+        self.btlbw
+    }
+
+    // Feeds the latest delivery rate sample to the bottleneck bandwidth filter.
+    //
+    // BBR keeps its own filter, so this one is only fed for other algorithms.
+    fn update_btlbw(&mut self, now: Instant) {
+        if std::ptr::eq(self.cc_ops, &bbr::BBR) {
+            return;
+        }
+
+        if !self.delivery_rate.sample_is_valid() {
+            return;
+        }
+
+        let rate = self.delivery_rate();
+
+        // Like BBR, only let app-limited samples raise the estimate, since
+        // they underestimate the bandwidth.
+        if self.delivery_rate.sample_is_app_limited() && rate < self.btlbw {
+            return;
+        }
+
+        self.btlbw = self.btlbw_filter._running_max(
+            self.rtt() * BTLBW_WINDOW_RTTS,
+            now,
+            rate,
+        );
+
+        self.btlbw_samples += 1;
+    }
+
+    pub fn min_rtt(&self) -> Duration {
+        self.min_rtt
+    }
+
     pub fn max_datagram_size(&self) -> usize {
         self.max_datagram_size
     }
@@ -933,6 +1012,8 @@ impl Recovery {
         // Fill in a rate sample.
         self.delivery_rate.generate_rate_sample(self.min_rtt);
 
+        self.update_btlbw(now);
+
         // Call congestion control hooks.
         (self.cc_ops.on_packets_acked)(self, &acked, epoch, now);
     }
@@ -2097,6 +2178,87 @@ mod tests {
             now + Duration::from_secs_f64(12000.0 / pacing_rate as f64)
         );
     }
+
+    /// Sends a packet and acks it 10ms later, which yields a 120KB/s rate
+    /// sample.
+    fn send_and_ack(r: &mut Recovery, pkt_num: u64, now: &mut Instant) {
+        let p = Sent {
+            pkt_num,
+            frames: vec![],
+            time_sent: *now,
+            time_acked: None,
+            time_lost: None,
+            size: 1200,
+            ack_eliciting: true,
+            in_flight: true,
+            delivered: 0,
+            delivered_time: *now,
+            first_sent_time: *now,
+            is_app_limited: false,
+            has_data: false,
+        };
+
+        r.on_packet_sent(
+            p,
+            packet::EPOCH_APPLICATION,
+            HandshakeStatus::default(),
+            *now,
+            "",
+        );
+
+        *now += Duration::from_millis(10);
+
+        let mut acked = ranges::RangeSet::default();
+        acked.insert(pkt_num..pkt_num + 1);
+
+        assert!(r
+            .on_ack_received(
+                &acked,
+                0,
+                packet::EPOCH_APPLICATION,
+                HandshakeStatus::default(),
+                *now,
+                ""
+            )
+            .is_ok());
+    }
+
+    #[test]
+    fn bottleneck_bandwidth() {
+        let mut cfg = crate::Config::new(crate::PROTOCOL_VERSION).unwrap();
+        cfg.set_cc_algorithm(CongestionControlAlgorithm::CUBIC);
+
+        let mut r = Recovery::new(&cfg);
+
+        let mut now = Instant::now();
+
+        // Send packets one at a time, so that every ACK yields a rate sample.
+        for pkt_num in 0..BTLBW_MIN_SAMPLES as u64 {
+            // Not enough samples to trust yet.
+            assert_eq!(r.bottleneck_bandwidth(), 0);
+
+            send_and_ack(&mut r, pkt_num, &mut now);
+        }
+
+        assert_eq!(r.bottleneck_bandwidth(), 120_000);
+    }
+
+    #[test]
+    fn bottleneck_bandwidth_bbr() {
+        let mut cfg = crate::Config::new(crate::PROTOCOL_VERSION).unwrap();
+        cfg.set_cc_algorithm(CongestionControlAlgorithm::BBR);
+
+        let mut r = Recovery::new(&cfg);
+
+        let mut now = Instant::now();
+
+        for pkt_num in 0..BTLBW_MIN_SAMPLES as u64 {
+            send_and_ack(&mut r, pkt_num, &mut now);
+        }
+
+        // BBR's own filter is used instead of the fallback one.
+        assert_eq!(r.btlbw_samples, 0);
+    }
 }
 
 mod cubic;
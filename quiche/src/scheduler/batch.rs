@@ -0,0 +1,463 @@
+use std::f64::INFINITY;
+
+use crate::scheduler::Block;
+
+/// Number of independent accumulators used when reducing a column, enough
+/// to fill 256-bit vectors of `f64`.
+const LANES: usize = 4;
+
+/// Blocks in structure-of-arrays layout.
+///
+/// Computing weights block by block means loading a whole `Block` for each,
+/// converting its fields and branching on its state, which keeps the compiler
+/// from vectorizing the loop. Here each field the weights depend on is a
+/// column of `f64`, and kernels are straight-line loops over the columns,
+/// with selects instead of branches, that the compiler turns into vector code.
+///
+/// Entry `i` of the batch is the `i`th block it mirrors. `BlockQueue` keeps
+/// its batch in sync as blocks are queued and updated, so that the fields are
+/// only converted when they change, not on every decision.
+///
+/// Columns also hold the quotients kernels need, like the fraction of each
+/// block left to send, so that kernels don't divide per block. Divisions
+/// can't be pipelined nearly as well as multiplications, and would otherwise
+/// dominate the cost of a decision.
+#[derive(Debug, Default, PartialEq)]
+pub struct BlockBatch {
+    /// Deadlines, in milliseconds.
+    deadlines: Vec<f64>,
+
+    /// Inverse of the deadlines.
+    inv_deadlines: Vec<f64>,
+
+    /// Creation times, in microseconds on the scheduler clock.
+    create_times: Vec<f64>,
+
+    /// Bytes left to send.
+    remaining: Vec<f64>,
+
+    /// Fraction of the blocks left to send.
+    unsent_ratios: Vec<f64>,
+
+    priorities: Vec<f64>,
+
+    /// Whether data can be sent for the blocks right away.
+    eligible: Vec<bool>,
+}
+
+impl BlockBatch {
+    /// Appends the given block.
+    pub fn push(&mut self, block: &Block) {
+        self.deadlines.push(0.0);
+        self.inv_deadlines.push(0.0);
+        self.create_times.push(0.0);
+        self.remaining.push(0.0);
+        self.unsent_ratios.push(0.0);
+        self.priorities.push(0.0);
+        self.eligible.push(false);
+
+        self.set(self.len() - 1, block);
+    }
+
+    /// Replaces the entry at the given position with the given block.
+    pub fn set(&mut self, pos: usize, block: &Block) {
+        let deadline = block.block_deadline as f64;
+        let remaining = block.remaining_size as f64;
+
+        self.deadlines[pos] = deadline;
+        self.inv_deadlines[pos] = 1.0 / deadline;
+        self.create_times[pos] = block.block_create_time as f64;
+        self.remaining[pos] = remaining;
+        self.unsent_ratios[pos] = remaining / block.block_size as f64;
+        self.priorities[pos] = block.block_priority as f64;
+        self.eligible[pos] = is_eligible(block);
+    }
+
+    /// Removes the entry at the given position, replacing it with the last
+    /// one, like `Vec::swap_remove()`.
+    pub fn swap_remove(&mut self, pos: usize) {
+        self.deadlines.swap_remove(pos);
+        self.inv_deadlines.swap_remove(pos);
+        self.create_times.swap_remove(pos);
+        self.remaining.swap_remove(pos);
+        self.unsent_ratios.swap_remove(pos);
+        self.priorities.swap_remove(pos);
+        self.eligible.swap_remove(pos);
+    }
+
+    /// Replaces the content of the batch with the given blocks.
+    pub fn fill(&mut self, blocks: &[Block]) {
+        self.deadlines.clear();
+        self.inv_deadlines.clear();
+        self.create_times.clear();
+        self.remaining.clear();
+        self.unsent_ratios.clear();
+        self.priorities.clear();
+        self.eligible.clear();
+
+        for block in blocks {
+            self.push(block);
+        }
+    }
+
+    /// Returns the number of blocks in the batch.
+    pub fn len(&self) -> usize {
+        self.deadlines.len()
+    }
+
+    /// Returns the position of the first block data can be sent for.
+    pub fn first_eligible(&self) -> Option<usize> {
+        self.eligible.iter().position(|&e| e)
+    }
+}
+
+/// Returns true if data can be sent for the block right away.
+fn is_eligible(block: &Block) -> bool {
+    block.remaining_size > 0 && block.unsatisfied_deps == 0
+}
+
+/// DTP weights of the blocks of a `BlockBatch`, as computed by `compute()`.
+///
+/// Schedulers keep this around, so that the columns don't need allocating
+/// once they grew to the number of queued blocks.
+#[derive(Default)]
+pub struct DtpWeights {
+    /// Time elapsed since the blocks were created, in milliseconds.
+    passed_times: Vec<f64>,
+
+    /// Time left before the deadlines once the blocks are fully delivered, in
+    /// milliseconds.
+    slacks: Vec<f64>,
+
+    /// Weights, infinite for blocks that aren't eligible.
+    weights: Vec<f64>,
+
+    /// Same as `weights`, but also infinite for blocks that can't complete
+    /// before their deadline.
+    feasible_weights: Vec<f64>,
+}
+
+impl DtpWeights {
+    /// Computes the weights of all the blocks of the batch.
+    ///
+    /// Blocks that can complete before their deadline are weighted by the
+    /// fraction of their deadline left once delivered, the others by the
+    /// fraction already elapsed. Either is averaged with the priority ratio,
+    /// and scaled by the fraction of the block left to send.
+    pub fn compute(
+        &mut self, batch: &BlockBatch, pacing_rate: f64, rtt: f64,
+        max_prio: u64, current_time: u64,
+    ) {
+        self.compute_with(batch, pacing_rate, rtt, max_prio, current_time, None)
+    }
+
+    /// Same as `compute()`, except that blocks that can't complete strictly
+    /// before their deadline are weighted by how late they would be, as a
+    /// fraction of their deadline capped to 1, plus `penalty`.
+    pub fn compute_penalized(
+        &mut self, batch: &BlockBatch, pacing_rate: f64, rtt: f64,
+        max_prio: u64, current_time: u64, penalty: f64,
+    ) {
+        self.compute_with(
+            batch,
+            pacing_rate,
+            rtt,
+            max_prio,
+            current_time,
+            Some(penalty),
+        )
+    }
+
+    fn compute_with(
+        &mut self, batch: &BlockBatch, pacing_rate: f64, rtt: f64,
+        max_prio: u64, current_time: u64, penalty: Option<f64>,
+    ) {
+        let n = batch.len();
+        let one_way_delay = rtt / 2.0;
+        let prio_scale = 0.5 / max_prio as f64;
+        let ms_per_byte = 1000.0 / pacing_rate;
+        let now = current_time as f64;
+        let (penalized, penalty) = (penalty.is_some(), penalty.unwrap_or(0.0));
+
+        self.passed_times.resize(n, 0.0);
+        self.slacks.resize(n, 0.0);
+        self.weights.resize(n, 0.0);
+        self.feasible_weights.resize(n, 0.0);
+
+        // Slicing everything to the same length lets the compiler drop the
+        // bounds checks, which would otherwise prevent vectorization.
+        let deadlines = &batch.deadlines[..n];
+        let inv_deadlines = &batch.inv_deadlines[..n];
+        let create_times = &batch.create_times[..n];
+        let remaining = &batch.remaining[..n];
+        let unsent_ratios = &batch.unsent_ratios[..n];
+        let priorities = &batch.priorities[..n];
+        let eligible = &batch.eligible[..n];
+        let passed_times = &mut self.passed_times[..n];
+        let slacks = &mut self.slacks[..n];
+        let weights = &mut self.weights[..n];
+        let feasible_weights = &mut self.feasible_weights[..n];
+
+        for i in 0..n {
+            let passed = now - create_times[i];
+            let passed = if passed > 0.0 { passed * 0.001 } else { 0.0 };
+
+            let slack = deadlines[i] -
+                passed -
+                one_way_delay -
+                remaining[i] * ms_per_byte;
+
+            let feasible = slack >= 0.0;
+
+            // The same for all blocks, so this doesn't prevent vectorization.
+            let time = if penalized {
+                let late = -slack * inv_deadlines[i];
+                let late = if late < 1.0 { late } else { 1.0 };
+
+                if slack > 0.0 {
+                    slack * inv_deadlines[i]
+                } else {
+                    late + penalty
+                }
+            } else if feasible {
+                slack * inv_deadlines[i]
+            } else {
+                passed * inv_deadlines[i]
+            };
+
+            let weight =
+                (0.5 * time + priorities[i] * prio_scale) * unsent_ratios[i];
+            let weight = if eligible[i] { weight } else { INFINITY };
+
+            passed_times[i] = passed;
+            slacks[i] = slack;
+            weights[i] = weight;
+            feasible_weights[i] = if feasible { weight } else { INFINITY };
+        }
+    }
+
+    /// Returns the position of the block with the lowest weight, ties going
+    /// to the block with the least data left, then to the first one.
+    ///
+    /// If `feasible_only` is true, only blocks that can complete before their
+    /// deadline are considered.
+    pub fn argmin(
+        &self, batch: &BlockBatch, feasible_only: bool,
+    ) -> Option<usize> {
+        let weights = if feasible_only {
+            &self.feasible_weights[..]
+        } else {
+            &self.weights[..]
+        };
+
+        let min = min(weights);
+
+        if min == INFINITY {
+            return None;
+        }
+
+        let mut best: Option<usize> = None;
+
+        for (i, &w) in weights.iter().enumerate() {
+            if w == min &&
+                best.map_or(true, |b| batch.remaining[i] < batch.remaining[b])
+            {
+                best = Some(i);
+            }
+        }
+
+        best
+    }
+
+    pub fn passed_time(&self, i: usize) -> f64 {
+        self.passed_times[i]
+    }
+
+    pub fn slack(&self, i: usize) -> f64 {
+        self.slacks[i]
+    }
+
+    pub fn weight(&self, i: usize) -> f64 {
+        self.weights[i]
+    }
+
+    /// Records the evaluation of each of the given blocks, which the weights
+    /// were last computed for, given the RTT they were computed with and
+    /// whether the selection was only made among feasible blocks.
+    ///
+    /// This is kept out of the weight kernel, so that it remains
+    /// vectorizable, and does nothing without the `trace` feature.
+    pub fn trace(&self, blocks: &[Block], rtt: f64, feasible_only: bool) {
+        if !cfg!(feature = "trace") {
+            return;
+        }
+
+        for (i, block) in blocks.iter().enumerate() {
+            if block.remaining_size == 0 {
+                continue;
+            }
+
+            if block.unsatisfied_deps > 0 {
+                trace_event!(Debug, BlockSkipped, block.block_id, [
+                    block.depend_id
+                ]);
+                continue;
+            }
+
+            trace_event!(Debug, BlockEvaluated, block.block_id, [
+                self.passed_time(i),
+                rtt / 2.0,
+                block.remaining_size,
+                self.slack(i)
+            ]);
+
+            // Only the blocks the selection was made among were weighted.
+            if feasible_only && self.slack(i) < 0.0 {
+                continue;
+            }
+
+            trace_event!(Debug, BlockWeighted, block.block_id, [
+                self.weight(i),
+                block.block_priority,
+                block.block_deadline,
+                block.depend_id
+            ]);
+        }
+    }
+}
+
+/// Returns the minimum of the values, ignoring NaNs.
+///
+/// A single running minimum is a dependency chain the compiler can't
+/// reorder for floats, so the values are reduced over `LANES` independent
+/// accumulators first.
+fn min(values: &[f64]) -> f64 {
+    let mut mins = [INFINITY; LANES];
+
+    let chunks = values.chunks_exact(LANES);
+    let tail = chunks.remainder();
+
+    for chunk in chunks {
+        for l in 0..LANES {
+            mins[l] = if chunk[l] < mins[l] { chunk[l] } else { mins[l] };
+        }
+    }
+
+    mins.iter()
+        .chain(tail)
+        .fold(INFINITY, |m, &v| if v < m { v } else { m })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use crate::scheduler::testing::block;
+
+    /// Weight of a block, as computed block by block.
+    fn dtp_weight(
+        b: &Block, pacing_rate: f64, rtt: f64, max_prio: u64,
+        current_time: u64,
+    ) -> (bool, f64) {
+        let passed_time = b.passed_time(current_time);
+        let slack = b.block_deadline as f64 -
+            passed_time -
+            rtt / 2.0 -
+            b.remaining_size as f64 / pacing_rate * 1000.0;
+
+        let time = if slack >= 0.0 { slack } else { passed_time };
+
+        let weight = (0.5 * (time / b.block_deadline as f64) +
+            0.5 * b.block_priority as f64 / max_prio as f64) *
+            (b.remaining_size as f64 / b.block_size as f64);
+
+        (slack >= 0.0, weight)
+    }
+
+    #[test]
+    fn dtp_weights_match_scalar() {
+        // Many small tile blocks, some of them already late, and some created
+        // after the current time.
+        let blocks: Vec<Block> = (0..603)
+            .map(|i| {
+                let remaining_size = 1 + (i * 7919) % 20_000;
+
+                Block {
+                    block_create_time: (i * 997) % 120_000,
+                    block_size: remaining_size + i % 7 * 1000,
+                    ..block(i * 4, remaining_size, 50 + (i * 31) % 150, i % 3)
+                }
+            })
+            .collect();
+
+        let mut batch = BlockBatch::default();
+        batch.fill(&blocks);
+
+        let mut w = DtpWeights::default();
+        w.compute(&batch, 5_000_000.0, 30.0, 2, 100_000);
+
+        let mut best: Option<((bool, f64, u64), usize)> = None;
+
+        for (i, b) in blocks.iter().enumerate() {
+            let (feasible, weight) =
+                dtp_weight(b, 5_000_000.0, 30.0, 2, 100_000);
+
+            assert!((w.passed_time(i) - b.passed_time(100_000)).abs() < 1e-9);
+            assert!((w.weight(i) - weight).abs() <= weight.abs() * 1e-12);
+
+            let key = (!feasible, weight, b.remaining_size);
+            if best.map_or(true, |(k, _)| key < k) {
+                best = Some((key, i));
+            }
+        }
+
+        let (key, i) = best.unwrap();
+        assert!(!key.0);
+        assert_eq!(w.argmin(&batch, true), Some(i));
+    }
+
+    #[test]
+    fn argmin() {
+        let mut blocks = vec![
+            block(0, 100, 100, 1),
+            block(4, 100, 100, 1),
+            block(8, 50, 100, 1),
+            block(12, 100, 100, 1),
+            block(16, 100, 100, 1),
+        ];
+
+        let mut batch = BlockBatch::default();
+        let mut w = DtpWeights::default();
+
+        // Ties go to the block with the least data left.
+        batch.fill(&blocks);
+        w.compute(&batch, INFINITY, 0.0, 2, 0);
+        assert_eq!(w.argmin(&batch, true), Some(2));
+
+        // Blocks that aren't eligible are ignored.
+        blocks[2].unsatisfied_deps = 1;
+        blocks[0].remaining_size = 0;
+        batch.set(2, &blocks[2]);
+        batch.set(0, &blocks[0]);
+        w.compute(&batch, INFINITY, 0.0, 2, 0);
+        assert_eq!(w.argmin(&batch, true), Some(1));
+        assert_eq!(batch.first_eligible(), Some(1));
+
+        // None of the blocks can make it.
+        w.compute(&batch, INFINITY, 0.0, 2, 200_000);
+        assert_eq!(w.argmin(&batch, true), None);
+        assert_eq!(w.argmin(&batch, false), Some(1));
+
+        // The last block takes the place of the removed one.
+        batch.swap_remove(1);
+        w.compute(&batch, INFINITY, 0.0, 2, 0);
+        assert_eq!(batch.len(), 4);
+        assert_eq!(w.argmin(&batch, true), Some(1));
+
+        blocks.truncate(1);
+        batch.fill(&blocks);
+        w.compute(&batch, INFINITY, 0.0, 2, 0);
+        assert_eq!(w.argmin(&batch, false), None);
+        assert_eq!(batch.first_eligible(), None);
+    }
+}
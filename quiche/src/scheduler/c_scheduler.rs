@@ -0,0 +1,225 @@
+use std::ffi::c_void;
+
+use crate::scheduler::Block;
+use crate::scheduler::PathEstimates;
+use crate::scheduler::Scheduler;
+
+/// Network estimates handed to scheduler plugins along with each decision.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct SchedulerInfo {
+    /// Current pacing rate in bytes per second.
+    pub pacing_rate: f64,
+
+    /// Smoothed RTT in milliseconds.
+    pub rtt: f64,
+
+    /// Estimated bottleneck bandwidth in bytes per second, or 0 if unknown.
+    pub btlbw: f64,
+
+    /// Minimum RTT in milliseconds, or 0 if unknown.
+    pub min_rtt: f64,
+
+    /// Number of the next packet to be sent.
+    pub next_packet_id: u64,
+
+    /// Current time in microseconds on the scheduler clock.
+    pub current_time: u64,
+}
+
+/// Functions implementing a scheduler outside of quiche, e.g. in C.
+///
+/// `select_block` is given the queued blocks as a contiguous array, and
+/// returns the ID of the block to send next. `should_drop_block`, if set, is
+/// asked about every queued block before that, otherwise blocks are never
+/// dropped. Both are given `ctx` as-is, and the pointers they receive are only
+/// valid for the duration of the call.
+///
+/// The functions are called from the thread using the connection, so `ctx`
+/// needs to be safe to use from there.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct SchedulerOps {
+    /// Returns the ID of the block to send next.
+    pub select_block: extern "C" fn(
+        ctx: *mut c_void,
+        blocks: *const Block,
+        len: usize,
+        info: *const SchedulerInfo,
+    ) -> u64,
+
+    /// Returns whether the block should be dropped.
+    pub should_drop_block: Option<
+        extern "C" fn(
+            ctx: *mut c_void,
+            block: *const Block,
+            info: *const SchedulerInfo,
+        ) -> bool,
+    >,
+
+    /// Context passed to the functions above.
+    pub ctx: *mut c_void,
+}
+
+unsafe impl Send for SchedulerOps {}
+unsafe impl Sync for SchedulerOps {}
+
+impl std::fmt::Debug for SchedulerOps {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "SchedulerOps {{ ctx: {:?} }}", self.ctx)
+    }
+}
+
+/// Scheduler forwarding its decisions to a `SchedulerOps` plugin.
+///
+/// Without plugin, the first queued block is always selected.
+#[derive(Default)]
+pub struct CScheduler {
+    ops: Option<SchedulerOps>,
+    estimates: PathEstimates,
+}
+
+impl CScheduler {
+    pub fn with_ops(ops: SchedulerOps) -> Self {
+        info!("Create C Scheduler");
+        CScheduler {
+            ops: Some(ops),
+            estimates: PathEstimates::default(),
+        }
+    }
+
+    fn info(
+        &self, pacing_rate: f64, rtt: f64, next_packet_id: u64,
+        current_time: u64,
+    ) -> SchedulerInfo {
+        SchedulerInfo {
+            pacing_rate,
+            rtt,
+            btlbw: self.estimates.btlbw,
+            min_rtt: self.estimates.min_rtt,
+            next_packet_id,
+            current_time,
+        }
+    }
+}
+
+impl Scheduler for CScheduler {
+    fn new() -> Self {
+        Default::default()
+    }
+
+    fn select_block(
+        &mut self,
+        blocks_vec: &mut Vec<Block>,
+        pacing_rate: f64, rtt: f64,
+        next_packet_id: u64, current_time: u64
+    ) -> u64 {
+        let ops = match self.ops {
+            Some(v) => v,
+
+            None => return blocks_vec[0].block_id,
+        };
+
+        let info = self.info(pacing_rate, rtt, next_packet_id, current_time);
+
+        let block_id = (ops.select_block)(
+            ops.ctx,
+            blocks_vec.as_ptr(),
+            blocks_vec.len(),
+            &info,
+        );
+
+        trace_event!(Debug, BlockSelected, block_id, [false]);
+        block_id
+    }
+
+    fn should_drop_block(
+        &mut self,
+        block: &Block,
+        pacing_rate: f64, rtt: f64,
+        next_packet_id: u64, current_time: u64
+    ) -> bool {
+        let (should_drop_block, ctx) = match self.ops {
+            Some(SchedulerOps {
+                should_drop_block: Some(f),
+                ctx,
+                ..
+            }) => (f, ctx),
+
+            _ => return false,
+        };
+
+        let info = self.info(pacing_rate, rtt, next_packet_id, current_time);
+
+        should_drop_block(ctx, block, &info)
+    }
+
+    fn drops_unexpired_blocks(&self) -> bool {
+        self.ops.map_or(false, |ops| ops.should_drop_block.is_some())
+    }
+
+    fn update_path_estimates(&mut self, estimates: &PathEstimates) {
+        self.estimates = *estimates;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use crate::scheduler::testing::block;
+
+    /// Picks the block with the most data left.
+    extern "C" fn select_largest(
+        _ctx: *mut c_void, blocks: *const Block, len: usize,
+        info: *const SchedulerInfo,
+    ) -> u64 {
+        let blocks = unsafe { std::slice::from_raw_parts(blocks, len) };
+        let info = unsafe { &*info };
+
+        assert_eq!(info.btlbw, 1_000_000.0);
+        assert_eq!(info.current_time, 42);
+
+        blocks.iter().max_by_key(|b| b.remaining_size).unwrap().block_id
+    }
+
+    /// Drops blocks with a priority above the value pointed to by `ctx`.
+    extern "C" fn drop_low_priority(
+        ctx: *mut c_void, block: *const Block, _info: *const SchedulerInfo,
+    ) -> bool {
+        let max_priority = unsafe { *(ctx as *const u64) };
+
+        unsafe { (*block).block_priority > max_priority }
+    }
+
+    #[test]
+    fn plugin() {
+        let mut max_priority = 1u64;
+
+        let mut s = CScheduler::with_ops(SchedulerOps {
+            select_block: select_largest,
+            should_drop_block: Some(drop_low_priority),
+            ctx: &mut max_priority as *mut u64 as *mut c_void,
+        });
+
+        s.update_path_estimates(&PathEstimates {
+            btlbw: 1_000_000.0,
+            min_rtt: 20.0,
+        });
+
+        let mut blocks = vec![
+            block(0, 100, 200, 1),
+            block(4, 300, 200, 2),
+            block(8, 200, 200, 0),
+        ];
+
+        assert_eq!(s.select_block(&mut blocks, 1e6, 30.0, 0, 42), 4);
+        assert!(!s.should_drop_block(&blocks[0], 1e6, 30.0, 0, 42));
+        assert!(s.should_drop_block(&blocks[1], 1e6, 30.0, 0, 42));
+
+        // Without plugin, the first block is selected and none are dropped.
+        let mut s = CScheduler::new();
+        assert_eq!(s.select_block(&mut blocks, 1e6, 30.0, 0, 42), 0);
+        assert!(!s.should_drop_block(&blocks[1], 1e6, 30.0, 0, 42));
+    }
+}
@@ -0,0 +1,332 @@
+use crate::scheduler::Block;
+use crate::scheduler::BlockQueue;
+use crate::scheduler::DtpWeights;
+use crate::scheduler::PathEstimates;
+use crate::scheduler::Scheduler;
+
+/// DTP scheduler variant estimating completion times from the bottleneck
+/// bandwidth and min RTT of the path.
+///
+/// `DtpScheduler` estimates the transmission time of a block from the pacing
+/// rate, which follows BBR's pacing gain cycles and makes deadline
+/// feasibility flip from one packet to the next. Here the completion time of
+/// a block is the time it takes to send its remaining data at the bottleneck
+/// bandwidth, plus half the min RTT, which excludes the queueing delay caused
+/// by the sender itself.
+///
+/// Blocks that can't complete in time even if sent right away are dropped,
+/// instead of using bandwidth that other blocks could still make use of. The
+/// other blocks are weighted like in `DtpScheduler`.
+///
+/// Until the path estimates are available, the pacing rate and smoothed RTT
+/// are used instead, and blocks are only dropped once they missed their
+/// deadline.
+///
+/// Selecting from the queue computes the weights over its `BlockBatch` at
+/// once, like `DtpScheduler`.
+pub struct DtpBwScheduler {
+    estimates: PathEstimates,
+    last_block_id: Option<u64>,
+    max_prio: u64,
+    weights: DtpWeights,
+}
+
+impl Default for DtpBwScheduler {
+    fn default() -> Self {
+        DtpBwScheduler {
+            estimates: PathEstimates::default(),
+            last_block_id: None,
+            max_prio: 2,
+            weights: DtpWeights::default(),
+        }
+    }
+}
+
+impl DtpBwScheduler {
+    /// Returns true if both the bottleneck bandwidth and min RTT are known.
+    fn has_estimates(&self) -> bool {
+        self.estimates.btlbw > 0.0 && self.estimates.min_rtt > 0.0
+    }
+
+    /// Returns the bandwidth (in bytes per second) and one-way delay (in
+    /// milliseconds) to estimate completion times with.
+    fn path(&self, pacing_rate: f64, rtt: f64) -> (f64, f64) {
+        if self.has_estimates() {
+            return (self.estimates.btlbw, self.estimates.min_rtt / 2.0);
+        }
+
+        (pacing_rate, rtt / 2.0)
+    }
+}
+
+/// Returns the time left before the deadline of the block once it is fully
+/// delivered, in milliseconds. This is negative if the block can't make it.
+fn slack(
+    block: &Block, bandwidth: f64, one_way_delay: f64, current_time: u64,
+) -> f64 {
+    let transmission_time = block.remaining_size as f64 / bandwidth * 1000.0;
+
+    block.block_deadline as f64 -
+        block.passed_time(current_time) -
+        one_way_delay -
+        transmission_time
+}
+
+impl Scheduler for DtpBwScheduler {
+    fn new() -> Self {
+        info!("Create DTP bandwidth-aware Scheduler");
+        Default::default()
+    }
+
+    fn select_block(
+        &mut self,
+        blocks_vec: &mut Vec<Block>,
+        pacing_rate: f64, rtt: f64,
+        _next_packet_id: u64, current_time: u64
+    ) -> u64 {
+        let (bandwidth, one_way_delay) = self.path(pacing_rate, rtt);
+
+        // Blocks that can still complete in time come first, then the lowest
+        // weight, then the least data left to send.
+        let mut best: Option<((bool, f64, u64), u64)> = None;
+
+        for block in blocks_vec.iter() {
+            if block.remaining_size == 0 {
+                continue;
+            }
+
+            if block.unsatisfied_deps > 0 {
+                trace_event!(Debug, BlockSkipped, block.block_id, [
+                    block.depend_id
+                ]);
+                continue;
+            }
+
+            let passed_time = block.passed_time(current_time);
+            let slack = slack(block, bandwidth, one_way_delay, current_time);
+
+            trace_event!(Debug, BlockEvaluated, block.block_id, [
+                passed_time,
+                one_way_delay,
+                block.remaining_size,
+                slack
+            ]);
+
+            let ddl = block.block_deadline.max(1) as f64;
+            let unsent_ratio =
+                block.remaining_size as f64 / block.block_size.max(1) as f64;
+            let prio_weight = block.block_priority as f64 / self.max_prio as f64;
+
+            // Late blocks are weighted by how late they already are.
+            let time_weight = if slack >= 0.0 {
+                slack / ddl
+            } else {
+                passed_time / ddl
+            };
+
+            let weight = (0.5 * time_weight + 0.5 * prio_weight) * unsent_ratio;
+
+            trace_event!(Debug, BlockWeighted, block.block_id, [
+                weight,
+                block.block_priority,
+                block.block_deadline,
+                block.depend_id
+            ]);
+
+            let key = (slack < 0.0, weight, block.remaining_size);
+
+            if best.map_or(true, |(k, _)| key < k) {
+                best = Some((key, block.block_id));
+            }
+        }
+
+        match best {
+            Some((_, block_id)) => {
+                self.last_block_id = Some(block_id);
+                trace_event!(Debug, BlockSelected, block_id, [false]);
+                block_id
+            },
+
+            None => {
+                let block_id =
+                    self.last_block_id.unwrap_or(blocks_vec[0].block_id);
+                trace_event!(Debug, BlockSelected, block_id, [true]);
+                block_id
+            },
+        }
+    }
+
+    fn select_from_queue(
+        &mut self, queue: &BlockQueue, pacing_rate: f64, rtt: f64,
+        current_time: u64,
+    ) -> Option<u64> {
+        let (bandwidth, one_way_delay) = self.path(pacing_rate, rtt);
+        let batch = queue.batch();
+
+        self.weights.compute(
+            batch,
+            bandwidth,
+            2.0 * one_way_delay,
+            self.max_prio,
+            current_time,
+        );
+
+        // Blocks that can still complete in time come first, as in
+        // select_block().
+        let feasible = self.weights.argmin(batch, true);
+        let selected = feasible.or_else(|| self.weights.argmin(batch, false));
+
+        self.weights
+            .trace(queue.blocks(), 2.0 * one_way_delay, feasible.is_some());
+
+        match selected.and_then(|i| queue.at(i)) {
+            Some(block) => {
+                self.last_block_id = Some(block.block_id);
+                trace_event!(Debug, BlockSelected, block.block_id, [false]);
+                Some(block.block_id)
+            },
+
+            None => {
+                let block_id = self
+                    .last_block_id
+                    .or_else(|| queue.at(0).map(|b| b.block_id))?;
+                trace_event!(Debug, BlockSelected, block_id, [true]);
+                Some(block_id)
+            },
+        }
+    }
+
+    fn should_drop_block(
+        &mut self,
+        block: &Block,
+        _pacing_rate: f64, _rtt: f64,
+        _next_packet_id: u64, current_time: u64
+    ) -> bool {
+        let expired =
+            block.passed_time(current_time) > block.block_deadline as f64;
+
+        // Only trust completion times computed from the path estimates, and
+        // keep blocks whose data was all sent already.
+        let doomed = self.has_estimates() &&
+            block.remaining_size > 0 &&
+            slack(
+                block,
+                self.estimates.btlbw,
+                self.estimates.min_rtt / 2.0,
+                current_time,
+            ) < 0.0;
+
+        expired || doomed
+    }
+
+    fn drops_expired_blocks(&self) -> bool {
+        true
+    }
+
+    fn drops_unexpired_blocks(&self) -> bool {
+        true
+    }
+
+    fn update_path_estimates(&mut self, estimates: &PathEstimates) {
+        self.estimates = *estimates;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use crate::scheduler::testing::block;
+
+    #[test]
+    fn pacing_gain_doesnt_flip_feasibility() {
+        let mut s = DtpBwScheduler::new();
+        s.update_path_estimates(&PathEstimates {
+            btlbw: 1_000_000.0,
+            min_rtt: 20.0,
+        });
+
+        // 80ms to send at the bottleneck bandwidth, plus 10ms one-way delay.
+        let b = block(0, 80_000, 100, 1);
+
+        // The pacing rate doesn't matter once the estimates are known.
+        for &pacing_rate in &[750_000.0, 1_250_000.0] {
+            assert!(!s.should_drop_block(&b, pacing_rate, 30.0, 0, 5_000));
+            assert!(s.should_drop_block(&b, pacing_rate, 30.0, 0, 15_000));
+        }
+
+        // Blocks with nothing left to send are only dropped once expired.
+        let sent = block(4, 0, 100, 1);
+        assert!(!s.should_drop_block(&sent, 1_000_000.0, 30.0, 0, 95_000));
+        assert!(s.should_drop_block(&sent, 1_000_000.0, 30.0, 0, 100_001));
+    }
+
+    #[test]
+    fn no_estimates() {
+        let mut s = DtpBwScheduler::new();
+
+        // Doomed according to the pacing rate, but not expired yet.
+        let b = block(0, 80_000, 100, 1);
+        assert!(!s.should_drop_block(&b, 100_000.0, 20.0, 0, 50_000));
+        assert!(s.should_drop_block(&b, 100_000.0, 20.0, 0, 100_001));
+    }
+
+    #[test]
+    fn select_feasible_first() {
+        let mut s = DtpBwScheduler::new();
+        s.update_path_estimates(&PathEstimates {
+            btlbw: 1_000_000.0,
+            min_rtt: 20.0,
+        });
+
+        // Block 0 can't make it anymore, blocks 4 and 8 still can, and block
+        // 4 is closer to its deadline.
+        let mut blocks = vec![
+            block(0, 80_000, 50, 1),
+            block(4, 10_000, 100, 1),
+            block(8, 10_000, 200, 1),
+        ];
+
+        assert_eq!(s.select_block(&mut blocks, 1_000_000.0, 30.0, 0, 0), 4);
+
+        blocks[1].unsatisfied_deps = 1;
+        assert_eq!(s.select_block(&mut blocks, 1_000_000.0, 30.0, 0, 0), 8);
+
+        blocks[2].remaining_size = 0;
+        assert_eq!(s.select_block(&mut blocks, 1_000_000.0, 30.0, 0, 0), 0);
+    }
+
+    #[test]
+    fn select_from_queue() {
+        let mut q = BlockQueue::default();
+        q.insert(block(0, 80_000, 50, 1));
+        q.insert(block(4, 10_000, 100, 1));
+        q.insert(block(8, 10_000, 200, 1));
+        q.insert(block(12, 5_000, 200, 0));
+
+        let mut s = DtpBwScheduler::new();
+        let mut scan = DtpBwScheduler::new();
+
+        for &(btlbw, current_time) in
+            &[(0.0, 0), (1_000_000.0, 0), (1_000_000.0, 40_000), (50_000.0, 0)]
+        {
+            let estimates = PathEstimates {
+                btlbw,
+                min_rtt: 20.0,
+            };
+            s.update_path_estimates(&estimates);
+            scan.update_path_estimates(&estimates);
+
+            // Same choice as the scan over the blocks.
+            let id = s.select_from_queue(&q, 1_000_000.0, 30.0, current_time);
+            let expected = scan.select_block(
+                q.blocks_mut(),
+                1_000_000.0,
+                30.0,
+                0,
+                current_time,
+            );
+            assert_eq!(id, Some(expected));
+        }
+    }
+}
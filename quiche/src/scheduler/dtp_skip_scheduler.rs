@@ -1,6 +1,12 @@
 use crate::scheduler::Block;
+use crate::scheduler::BlockQueue;
+use crate::scheduler::DtpWeights;
 use crate::scheduler::Scheduler;
 
+/// DTP variant weighting late blocks behind all the others.
+///
+/// Selecting from the queue computes the weights over its `BlockBatch` at
+/// once, see `DtpWeights::compute_penalized()`.
 pub struct DtpSkipScheduler {
     ddl: u64,
     size: u64,
@@ -9,7 +15,7 @@ pub struct DtpSkipScheduler {
     max_prio: u64,
     alpha: f64,
     beta: f64,
-    canceled: Vec<u64>,
+    weights: DtpWeights,
 }
 
 impl Default for DtpSkipScheduler {
@@ -22,7 +28,7 @@ impl Default for DtpSkipScheduler {
             max_prio: 1,
             alpha: 0.5,
             beta: 100000.0,
-            canceled: Vec::new(),
+            weights: DtpWeights::default(),
         }
     }
 }
@@ -63,30 +69,23 @@ impl Scheduler for DtpSkipScheduler {
         eprintln!("dtp select_block last block: len {} ddl {} size {} prior {}", len, ddl, size, prio);
         */
 
-        let mut block_id_vec = vec![];
-        for block in blocks_vec.iter() {
-            if block.remaining_size > 0 {
-                block_id_vec.push(block.block_id);
-            }
-        }
-
         for i in 0..blocks_vec.len() {
             let block = &blocks_vec[i];
             if block.remaining_size > 0 {
                 //dependency
-                if (block.block_id != block.depend_id) && block_id_vec.contains(&block.depend_id) {
-                    //eprintln!("{} ms, dtp skip block {}:  depend_id {}", current_time, block.block_id, block.depend_id);
+                if block.unsatisfied_deps > 0 {
+                    //eprintln!("{} us, dtp skip block {}:  depend_id {}", current_time, block.block_id, block.depend_id);
                     continue;
                 }
 
 
                 let tempddl = block.block_deadline;
-                let passed_time = current_time - block.block_create_time;
+                let passed_time = block.passed_time(current_time);
                 let one_way_delay = rtt / 2.0;
                 let tempsize = block.remaining_size;
 
                 let remaining_time: f64 = tempddl as f64 - passed_time as f64 - one_way_delay - ((tempsize as f64 / pacing_rate) * 1000.0); // Bytes / (B/s) * 1000. (ms)
-                // eprintln!("{} ms dtp scheduler: block_id {}, tempddl: {}, passed_time: {}, one_way_delay: {}, tempsize: {}, pacing_rate: {}, remaining_time: {}",
+                // eprintln!("{} us dtp scheduler: block_id {}, tempddl: {}, passed_time: {}, one_way_delay: {}, tempsize: {}, pacing_rate: {}, remaining_time: {}",
                 //           current_time, block.block_id, tempddl, passed_time, one_way_delay, tempsize, pacing_rate, remaining_time);
                 let remaining_time_weight =
                 if remaining_time > 0.0 {
@@ -101,7 +100,7 @@ impl Scheduler for DtpSkipScheduler {
                 //let weight: f64 = (1.0 * remaining_time / tempddl as f64) / (1.0 - tempprio as f64 / self.max_prio as f64);
                 let weight: f64 = (((1.0 - self.alpha) * remaining_time_weight) +
                     self.alpha * tempprio as f64 / self.max_prio as f64) * unsent_ratio;
-                //eprintln!("{} ms, dtp consider block {}: weight {}, remain_time {}, prior {}/{}, ddl {} depend_id {}", current_time, block.block_id,  weight, remaining_time, tempprio, self.max_prio, tempddl, block.depend_id);
+                //eprintln!("{} us, dtp consider block {}: weight {}, remain_time {}, prior {}/{}, ddl {} depend_id {}", current_time, block.block_id,  weight, remaining_time, tempprio, self.max_prio, tempddl, block.depend_id);
                 if min_weight_block_id == -1 ||
                     min_weight > weight ||
                     (min_weight == weight && block.remaining_size < blocks_vec[min_weight_block_id as usize].remaining_size)
@@ -132,7 +131,39 @@ impl Scheduler for DtpSkipScheduler {
 
             //
             //eprintln!("==-1 {}",  self.last_block_id.unwrap());
-            return self.last_block_id.unwrap();
+            return self.last_block_id.unwrap_or(blocks_vec[0].block_id);
+        }
+    }
+
+    fn select_from_queue(
+        &mut self, queue: &BlockQueue, pacing_rate: f64, rtt: f64,
+        current_time: u64,
+    ) -> Option<u64> {
+        // The weight kernel averages the time and priority weights equally.
+        if self.alpha != 0.5 {
+            return None;
+        }
+
+        let batch = queue.batch();
+
+        self.weights.compute_penalized(
+            batch,
+            pacing_rate,
+            rtt,
+            self.max_prio,
+            current_time,
+            self.beta,
+        );
+
+        match self.weights.argmin(batch, false).and_then(|i| queue.at(i)) {
+            Some(block) => {
+                self.last_block_id = Some(block.block_id);
+                Some(block.block_id)
+            },
+
+            None => self
+                .last_block_id
+                .or_else(|| queue.at(0).map(|b| b.block_id)),
         }
     }
 
@@ -142,22 +173,56 @@ impl Scheduler for DtpSkipScheduler {
         _pacing_rate: f64, _rtt:f64,
         _next_packet_id: u64, current_time: u64
     ) -> bool {
-        let passed_time = current_time - block.block_create_time;
+        let passed_time = block.passed_time(current_time);
 
-        if self.canceled.contains(&block.depend_id) {
-            //the previous block that current block is depended on is canceled
-            self.canceled.push(block.block_id);
-            //eprintln!("drop_block, id:{} prior:{} remaining_size:{} size:{} depend_id:{}", block.block_id, block.block_priority, block.remaining_size, block.block_size, block.depend_id);
-            return true;
-        }
-        else if passed_time > block.block_deadline {
-            //eprintln!("{} ms dtp should_drop_block: block id {} passed time ms: {}, ddl: {}, prior{}, remaining_size {},{}", current_time, block.block_id, passed_time, block.block_deadline, block.block_priority, block.remaining_size, block.block_size);
-            self.canceled.push(block.block_id);
-            //eprintln!("drop_block, id:{} prior:{} remaining_size:{} size:{} depend_id:{}", block.block_id, block.block_priority, block.remaining_size, block.block_size, block.depend_id);
+        // Blocks depending on a dropped block are canceled along with it by
+        // the queue (see `BlockQueue::cancel()`).
+        if passed_time > block.block_deadline as f64 {
             return true;
         }
         else {
             return false;
         }
     }
+
+    fn drops_expired_blocks(&self) -> bool {
+        true
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use crate::scheduler::testing::block;
+
+    #[test]
+    fn select_from_queue() {
+        let mut q = BlockQueue::default();
+        q.insert(block(0, 80_000, 50, 1));
+        q.insert(block(4, 10_000, 100, 1));
+        q.insert(block(8, 10_000, 200, 0));
+        q.insert(Block {
+            depend_id: 0,
+            ..block(12, 5_000, 200, 0)
+        });
+
+        let mut s = DtpSkipScheduler::new();
+        let mut scan = DtpSkipScheduler::new();
+
+        // Late blocks are only selected when all the others are late too.
+        for &(pacing_rate, current_time) in
+            &[(1_000_000.0, 0), (1_000_000.0, 60_000), (10_000.0, 0)]
+        {
+            let id = s.select_from_queue(&q, pacing_rate, 30.0, current_time);
+            let expected = scan.select_block(
+                q.blocks_mut(),
+                pacing_rate,
+                30.0,
+                0,
+                current_time,
+            );
+            assert_eq!(id, Some(expected));
+        }
+    }
 }
@@ -0,0 +1,142 @@
+use crate::scheduler::Block;
+use crate::scheduler::BlockQueue;
+use crate::scheduler::PathEstimates;
+use crate::scheduler::Scheduler;
+
+/// Earliest deadline first scheduler.
+///
+/// Blocks are sent in order of their absolute deadline, which the queue keeps
+/// them sorted by, so choosing the next block only skips the blocks that can't
+/// be sent yet, instead of weighting every queued block.
+///
+/// New blocks go through admission control: a block is rejected when the
+/// data already queued at the same or a higher priority, plus its own, can't
+/// be delivered at the bottleneck bandwidth before its deadline. Data of lower
+/// priority doesn't count, so it can't hold back more important blocks, even
+/// though it is sent first if its deadline is earlier. As long as the path
+/// estimates aren't known, all blocks are admitted.
+#[derive(Default)]
+pub struct EdfScheduler {
+    estimates: PathEstimates,
+}
+
+/// Returns true if data can be sent for the block right away.
+fn is_eligible(block: &Block) -> bool {
+    block.remaining_size > 0 && block.unsatisfied_deps == 0
+}
+
+impl Scheduler for EdfScheduler {
+    fn new() -> Self {
+        info!("Create EDF Scheduler");
+        Default::default()
+    }
+
+    fn select_block(
+        &mut self,
+        blocks_vec: &mut Vec<Block>,
+        _pacing_rate: f64, _rtt: f64,
+        _next_packet_id: u64, _current_time: u64
+    ) -> u64 {
+        let block = blocks_vec
+            .iter()
+            .filter(|b| is_eligible(b))
+            .min_by_key(|b| {
+                let deadline = b.block_deadline.saturating_mul(1000);
+                (b.block_create_time.saturating_add(deadline), b.block_id)
+            })
+            .unwrap_or(&blocks_vec[0]);
+
+        trace_event!(Debug, BlockSelected, block.block_id, [false]);
+        block.block_id
+    }
+
+    fn should_drop_block(
+        &mut self,
+        block: &Block,
+        _pacing_rate: f64, _rtt: f64,
+        _next_packet_id: u64, current_time: u64
+    ) -> bool {
+        block.passed_time(current_time) > block.block_deadline as f64
+    }
+
+    fn drops_expired_blocks(&self) -> bool {
+        true
+    }
+
+    fn update_path_estimates(&mut self, estimates: &PathEstimates) {
+        self.estimates = *estimates;
+    }
+
+    fn select_from_queue(
+        &mut self, queue: &BlockQueue, _pacing_rate: f64, _rtt: f64,
+        _current_time: u64,
+    ) -> Option<u64> {
+        let block = queue
+            .iter_by_expiry()
+            .find(|b| is_eligible(b))
+            .or_else(|| queue.at(0))?;
+
+        trace_event!(Debug, BlockSelected, block.block_id, [false]);
+        Some(block.block_id)
+    }
+
+    fn admit_block(&mut self, block: &Block, queued_bytes: u64) -> bool {
+        if self.estimates.btlbw <= 0.0 {
+            return true;
+        }
+
+        // Time to drain the queue including the new block, in milliseconds.
+        let drain_time = (queued_bytes + block.remaining_size) as f64 /
+            self.estimates.btlbw *
+            1000.0 +
+            self.estimates.min_rtt / 2.0;
+
+        drain_time <= block.block_deadline as f64
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use crate::scheduler::testing::block;
+
+    #[test]
+    fn earliest_deadline_first() {
+        let mut s = EdfScheduler::new();
+        let mut q = BlockQueue::default();
+
+        q.insert(block(0, 100, 300, 1));
+        q.insert(block(4, 100, 100, 1));
+        q.insert(block(8, 100, 200, 1));
+
+        assert_eq!(s.select_from_queue(&q, 0.0, 0.0, 0), Some(4));
+        assert_eq!(s.select_block(q.blocks_mut(), 0.0, 0.0, 0, 0), 4);
+
+        // Blocks that can't be sent yet are skipped.
+        q.insert(Block {
+            depend_id: 8,
+            ..block(12, 100, 50, 1)
+        });
+        q.set_remaining(4, 0);
+        assert_eq!(s.select_from_queue(&q, 0.0, 0.0, 0), Some(8));
+        assert_eq!(s.select_block(q.blocks_mut(), 0.0, 0.0, 0, 0), 8);
+    }
+
+    #[test]
+    fn admission_control() {
+        let mut s = EdfScheduler::new();
+
+        // Everything is admitted until the bandwidth is known.
+        assert!(s.admit_block(&block(0, 1_000_000, 100, 1), 1_000_000));
+
+        s.update_path_estimates(&PathEstimates {
+            btlbw: 1_000_000.0,
+            min_rtt: 20.0,
+        });
+
+        // 50ms to drain the queue, plus 10ms one-way delay.
+        assert!(s.admit_block(&block(4, 10_000, 100, 1), 40_000));
+        assert!(!s.admit_block(&block(8, 10_000, 50, 1), 40_000));
+    }
+}
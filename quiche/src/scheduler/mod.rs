@@ -10,12 +10,18 @@ pub enum SchedulerType {
     Basic   = 0,
     /// Scheduler introduced by DTP
     DTP     = 1,
-    /// Implement C scheduler using interface function
-    /// `SolutionSelectBlock` and `SolutionShouldDropBlock`
+    /// DTP variant weighting late blocks behind all the others
     DTPSkip       = 2,
     PF  = 4,
     /// Dynamic scheduler change with Rust feature
     Dynamic = 3,
+    /// DTP variant checking deadlines against the bottleneck bandwidth and
+    /// min RTT estimates, and dropping blocks that can't make it
+    DTPBw   = 5,
+    /// Earliest deadline first, with admission control of new blocks
+    EDF     = 6,
+    /// Scheduler implemented by the application, see `SchedulerOps`
+    Plugin  = 7,
 }
 
 impl FromStr for SchedulerType {
@@ -27,12 +33,27 @@ impl FromStr for SchedulerType {
             "DTP" | "Dtp" | "dtp" => Ok(SchedulerType::DTP),
             "DTPSkip" => Ok(SchedulerType::DTPSkip),
             "PF" => Ok(SchedulerType::PF),
+            "DTPBw" | "dtp-bw" => Ok(SchedulerType::DTPBw),
+            "EDF" | "edf" => Ok(SchedulerType::EDF),
             "Dynamic" | "dynamic" | "Dyn" | "dyn" => Ok(SchedulerType::Dynamic),
             _ => Err(crate::Error::SchedulerType)
         }
     }
 }
 
+/// Path estimates given to the scheduler before it is asked for decisions.
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct PathEstimates {
+    /// Estimated bottleneck bandwidth in bytes per second, or 0 if unknown or
+    /// not reliable yet.
+    ///
+    /// Unlike the pacing rate, this doesn't follow BBR's pacing gain cycles.
+    pub btlbw: f64,
+
+    /// Minimum RTT observed on the path in milliseconds, or 0 if unknown.
+    pub min_rtt: f64,
+}
+
 pub trait Scheduler {
     fn new() -> Self
         where
@@ -40,6 +61,9 @@ pub trait Scheduler {
     /// Schedulor implementation
     ///
     /// Decide which block to send next in blocks_vec
+    ///
+    /// `_current_time` is in microseconds on the scheduler clock (see
+    /// `crate::clock_micros()`), like the blocks' creation time.
     fn select_block(
         &mut self,
         blocks_vec: &mut Vec<Block>,
@@ -59,6 +83,57 @@ pub trait Scheduler {
         false
     }
 
+    /// Whether blocks that missed their deadline are always dropped
+    ///
+    /// If so, expired blocks are dropped in bulk before `should_drop_block`
+    /// is consulted, and the scheduler is told with `on_block_dropped`.
+    fn drops_expired_blocks(&self) -> bool {
+        false
+    }
+
+    /// Whether `should_drop_block` may drop blocks that didn't miss their
+    /// deadline yet
+    ///
+    /// If blocks that missed their deadline are dropped in bulk, and this
+    /// returns false, `should_drop_block` isn't consulted at all, which saves
+    /// going through all the queued blocks for every packet.
+    fn drops_unexpired_blocks(&self) -> bool {
+        false
+    }
+
+    /// Called for each block dropped because it missed its deadline
+    fn on_block_dropped(&mut self, _block: &Block) {}
+
+    /// Called when a block is queued, or when the amount of data it has left
+    /// to send changes
+    fn on_block_updated(&mut self, _block: &Block) {}
+
+    /// Called when a block leaves the queue, whether it was sent or dropped
+    fn on_block_removed(&mut self, _block: &Block) {}
+
+    /// Updates the path estimates used for the next decisions
+    fn update_path_estimates(&mut self, _estimates: &PathEstimates) {}
+
+    /// Decide which block to send next using the queue's indexes
+    ///
+    /// This is tried before `select_block`, which is only called if this
+    /// returns `None`.
+    fn select_from_queue(
+        &mut self, _queue: &BlockQueue, _pacing_rate: f64, _rtt: f64,
+        _current_time: u64,
+    ) -> Option<u64> {
+        None
+    }
+
+    /// Admission control of new blocks
+    ///
+    /// Decide whether a block can be accepted before any of its data is
+    /// written, given the amount of data already queued for other blocks of
+    /// the same or a higher priority.
+    fn admit_block(&mut self, _block: &Block, _queued_bytes: u64) -> bool {
+        true
+    }
+
     fn peek_through_flushable(
         &mut self,
         _blocks_vec: &mut Vec<Block>,
@@ -71,7 +146,7 @@ pub trait Scheduler {
 
 /// Instantiate a scheduler implementation basing on the given SchedulerType
 pub fn new_scheduler(sche: SchedulerType) -> Box<dyn Scheduler> {
-    eprintln!("Creating scheduler: {:?}", sche);
+    info!("Creating scheduler: {:?}", sche);
     match sche {
         SchedulerType::Basic =>
             Box::new(BasicScheduler::new()),
@@ -79,6 +154,9 @@ pub fn new_scheduler(sche: SchedulerType) -> Box<dyn Scheduler> {
         SchedulerType::DTPSkip=>
             Box::new(dtp_skip_scheduler::DtpSkipScheduler::new()),
         SchedulerType::PF => Box::new(pf_scheduler::PFScheduler::new()),
+        SchedulerType::DTPBw =>
+            Box::new(dtp_bw_scheduler::DtpBwScheduler::new()),
+        SchedulerType::EDF => Box::new(edf_scheduler::EdfScheduler::new()),
         SchedulerType::Dynamic=>
             Box::new(DynScheduler::new()),
         _ => {
@@ -88,6 +166,7 @@ pub fn new_scheduler(sche: SchedulerType) -> Box<dyn Scheduler> {
     }
 }
 
+/// Sends blocks one after the other, in queue order.
 #[derive(Default)]
 pub struct BasicScheduler {
     last_block_id: Option<u64>
@@ -126,6 +205,25 @@ impl Scheduler for BasicScheduler {
             return self.last_block_id.clone().unwrap();
         }
     }
+
+    fn select_from_queue(
+        &mut self, queue: &BlockQueue, _pacing_rate: f64, _rtt: f64,
+        _current_time: u64,
+    ) -> Option<u64> {
+        // Same choice as `select_block`, with the last block looked up
+        // through the queue's index.
+        let last = self.last_block_id.and_then(|id| queue.get(id));
+
+        match last {
+            Some(block) if block.remaining_size > 0 => Some(block.block_id),
+
+            _ => {
+                let block_id = queue.at(0)?.block_id;
+                self.last_block_id = Some(block_id);
+                Some(block_id)
+            },
+        }
+    }
 }
 
 pub struct DynScheduler {
@@ -134,11 +232,6 @@ pub struct DynScheduler {
 
 impl Default for DynScheduler {
     fn default() -> Self {
-        // if cfg!(feature = "interface") {
-        //     DynScheduler {
-        //         scheduler: Box::new(c_scheduler::CScheduler::new())
-        //     }
-        // }
         if cfg!(feature = "basic-scheduler") {
             DynScheduler {
                 scheduler: Box::new(BasicScheduler::new())
@@ -175,6 +268,42 @@ impl Scheduler for DynScheduler {
         self.scheduler.should_drop_block(block, pacing_rate, rtt, next_packet_id, current_time)
     }
 
+    fn drops_expired_blocks(&self) -> bool {
+        self.scheduler.drops_expired_blocks()
+    }
+
+    fn drops_unexpired_blocks(&self) -> bool {
+        self.scheduler.drops_unexpired_blocks()
+    }
+
+    fn on_block_dropped(&mut self, block: &Block) {
+        self.scheduler.on_block_dropped(block)
+    }
+
+    fn on_block_updated(&mut self, block: &Block) {
+        self.scheduler.on_block_updated(block)
+    }
+
+    fn on_block_removed(&mut self, block: &Block) {
+        self.scheduler.on_block_removed(block)
+    }
+
+    fn update_path_estimates(&mut self, estimates: &PathEstimates) {
+        self.scheduler.update_path_estimates(estimates)
+    }
+
+    fn select_from_queue(
+        &mut self, queue: &BlockQueue, pacing_rate: f64, rtt: f64,
+        current_time: u64,
+    ) -> Option<u64> {
+        self.scheduler
+            .select_from_queue(queue, pacing_rate, rtt, current_time)
+    }
+
+    fn admit_block(&mut self, block: &Block, queued_bytes: u64) -> bool {
+        self.scheduler.admit_block(block, queued_bytes)
+    }
+
     fn peek_through_flushable(
         &mut self,
         blocks_vec: &mut Vec<Block>,
@@ -186,16 +315,60 @@ impl Scheduler for DynScheduler {
 }
 
 impl DynScheduler {
-    pub fn init(stype: SchedulerType) -> Self {
+    pub fn init(stype: SchedulerType, ops: Option<SchedulerOps>) -> Self {
         let mut dyn_scheduler: DynScheduler = Default::default();
-        if stype != SchedulerType::Dynamic {
-            dyn_scheduler.scheduler = new_scheduler(stype);
+        match (stype, ops) {
+            (SchedulerType::Dynamic, _) => (),
+
+            (SchedulerType::Plugin, Some(ops)) =>
+                dyn_scheduler.scheduler =
+                    Box::new(c_scheduler::CScheduler::with_ops(ops)),
+
+            (SchedulerType::Plugin, None) =>
+                warn!("No scheduler plugin set! Change to default scheduler"),
+
+            _ => dyn_scheduler.scheduler = new_scheduler(stype),
         }
-        eprintln!("Finish creating dyn scheduler");
+        info!("Finish creating dyn scheduler");
         return dyn_scheduler;
     }
 }
 
+pub use self::batch::BlockBatch;
+pub use self::batch::DtpWeights;
+pub use self::c_scheduler::SchedulerInfo;
+pub use self::c_scheduler::SchedulerOps;
+pub use self::queue::BlockQueue;
+
+mod batch;
+mod c_scheduler;
+mod dtp_bw_scheduler;
 mod dtp_scheduler;
 mod dtp_skip_scheduler;
+mod edf_scheduler;
 mod pf_scheduler;
+mod queue;
+
+/// Helpers shared by the schedulers' tests.
+#[cfg(test)]
+pub mod testing {
+    use super::Block;
+
+    /// Returns a block of `remaining_size` bytes, none of which were sent yet,
+    /// created at time 0 and depending on no other block.
+    pub fn block(
+        block_id: u64, remaining_size: u64, block_deadline: u64,
+        block_priority: u64,
+    ) -> Block {
+        Block {
+            block_id,
+            block_deadline,
+            block_priority,
+            block_create_time: 0,
+            block_size: remaining_size,
+            remaining_size,
+            depend_id: block_id,
+            unsatisfied_deps: 0,
+        }
+    }
+}
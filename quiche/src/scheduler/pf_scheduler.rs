@@ -1,6 +1,20 @@
+use std::collections::BTreeSet;
+
 use crate::scheduler::Block;
+use crate::scheduler::BlockQueue;
 use crate::scheduler::Scheduler;
+use crate::stream::StreamIdHashMap;
 
+/// Blocks are selected by lowest priority value first, then by least data
+/// left to send.
+///
+/// Despite the name, this is a strict priority order and not proportional
+/// fairness yet: no throughput is tracked per flow to weigh priorities with.
+///
+/// Besides the weighted scan of `select_block`, the scheduler keeps the
+/// blocks that can be sent ordered by that metric, updated as blocks are
+/// queued, sent or removed, or as their dependencies progress, so that
+/// `select_from_queue` only needs to look at the first one.
 pub struct PFScheduler {
     ddl: u64,
     size: u64,
@@ -9,7 +23,12 @@ pub struct PFScheduler {
     max_prio: u64,
     alpha: f64,
     beta: f64,
-    canceled: Vec<u64>,
+    /// Queued blocks that can be sent, as `(priority, remaining_size,
+    /// block_id)`, in selection order.
+    order: BTreeSet<(u64, u64, u64)>,
+    /// Current key of each queued block, and whether it is in `order`,
+    /// indexed by block ID.
+    keys: StreamIdHashMap<(u64, u64, bool)>,
 }
 
 impl Default for PFScheduler {
@@ -22,7 +41,8 @@ impl Default for PFScheduler {
             max_prio: 2,
             alpha: 0.5,
             beta: 100000.0,
-            canceled: Vec::new(),
+            order: BTreeSet::new(),
+            keys: StreamIdHashMap::default(),
         }
     }
 }
@@ -63,31 +83,28 @@ impl Scheduler for PFScheduler {
         eprintln!("dtp select_block last block: len {} ddl {} size {} prior {}", len, ddl, size, prio);
         */
 
-        let mut block_id_vec = vec![];
-        for block in blocks_vec.iter() {
-            if block.remaining_size > 0 {
-                block_id_vec.push(block.block_id);
-            }
-        }
-
         for i in 0..blocks_vec.len() {
             let block = &blocks_vec[i];
             if block.remaining_size > 0 {
                 //dependency
-                if (block.block_id != block.depend_id) && block_id_vec.contains(&block.depend_id) {
-                    eprintln!("{} ms, dtp skip block {}:  depend_id {}", current_time, block.block_id, block.depend_id);
+                if block.unsatisfied_deps > 0 {
+                    trace_event!(Debug, BlockSkipped, block.block_id, [block.depend_id]);
                     continue;
                 }
 
 
                 let tempddl = block.block_deadline;
-                let passed_time = current_time - block.block_create_time;
+                let passed_time = block.passed_time(current_time);
                 let one_way_delay = rtt / 2.0;
                 let tempsize = block.remaining_size;
 
                 let remaining_time: f64 = tempddl as f64 - passed_time as f64 - one_way_delay - ((tempsize as f64 / pacing_rate) * 1000.0); // Bytes / (B/s) * 1000. (ms)
-                eprintln!("{} ms dtp scheduler: block_id {}, tempddl: {}, passed_time: {}, one_way_delay: {}, tempsize: {}, pacing_rate: {}, remaining_time: {}",
-                          current_time, block.block_id, tempddl, passed_time, one_way_delay, tempsize, pacing_rate, remaining_time);
+                trace_event!(Debug, BlockEvaluated, block.block_id, [
+                    passed_time,
+                    one_way_delay,
+                    tempsize,
+                    remaining_time
+                ]);
                 let remaining_time_weight =
                     if remaining_time > 0.0 {
                         remaining_time / tempddl as f64
@@ -102,7 +119,12 @@ impl Scheduler for PFScheduler {
                 // let weight: f64 = (((1.0 - self.alpha) * remaining_time_weight) +
                 //     self.alpha * tempprio as f64 / self.max_prio as f64) * unsent_ratio;
                 let weight: f64 = block.block_priority as f64;
-                eprintln!("{} ms, dtp consider block {}: weight {}, remain_time {}, prior {}/{}, ddl {} depend_id {}", current_time, block.block_id,  weight, remaining_time, tempprio, self.max_prio, tempddl, block.depend_id);
+                trace_event!(Debug, BlockWeighted, block.block_id, [
+                    weight,
+                    tempprio,
+                    tempddl,
+                    block.depend_id
+                ]);
                 if min_weight_block_id == -1 ||
                     min_weight > weight ||
                     (min_weight == weight && block.remaining_size < blocks_vec[min_weight_block_id as usize].remaining_size)
@@ -123,17 +145,19 @@ impl Scheduler for PFScheduler {
         self.prio = prio;
 
         if min_weight_block_id != -1 {
-            self.last_block_id = Some(blocks_vec[min_weight_block_id as usize].block_id) ;
-            eprintln!("!= -1 {}", blocks_vec[min_weight_block_id as usize].block_id);
-            return blocks_vec[min_weight_block_id as usize].block_id;
+            let block_id = blocks_vec[min_weight_block_id as usize].block_id;
+            self.last_block_id = Some(block_id);
+            trace_event!(Debug, BlockSelected, block_id, [false]);
+            return block_id;
         } else {
             //self.last_block_id = Some(blocks_vec[0].block_id);
             //eprintln!("== -1 {}", blocks_vec[0].block_id);
             //return blocks_vec[0].block_id;
 
             //
-            eprintln!("==-1 {}",  self.last_block_id.unwrap());
-            return self.last_block_id.unwrap();
+            let block_id = self.last_block_id.unwrap_or(blocks_vec[0].block_id);
+            trace_event!(Debug, BlockSelected, block_id, [true]);
+            return block_id;
         }
     }
 
@@ -143,22 +167,147 @@ impl Scheduler for PFScheduler {
         _pacing_rate: f64, _rtt:f64,
         _next_packet_id: u64, current_time: u64
     ) -> bool {
-        let passed_time = current_time - block.block_create_time;
+        let passed_time = block.passed_time(current_time);
 
-        if self.canceled.contains(&block.depend_id) {
-            //the previous block that current block is depended on is canceled
-            self.canceled.push(block.block_id);
-            eprintln!("drop_block, id:{} prior:{} remaining_size:{} size:{} depend_id:{}", block.block_id, block.block_priority, block.remaining_size, block.block_size, block.depend_id);
+        // Blocks depending on a dropped block are canceled by the queue.
+        if passed_time > block.block_deadline as f64 {
             return true;
         }
-        else if passed_time > block.block_deadline {
-            //eprintln!("{} ms dtp should_drop_block: block id {} passed time ms: {}, ddl: {}, prior{}, remaining_size {},{}", current_time, block.block_id, passed_time, block.block_deadline, block.block_priority, block.remaining_size, block.block_size);
-            self.canceled.push(block.block_id);
-            eprintln!("drop_block, id:{} prior:{} remaining_size:{} size:{} depend_id:{}", block.block_id, block.block_priority, block.remaining_size, block.block_size, block.depend_id);
-            return true;
+
+        false
+    }
+
+    fn drops_expired_blocks(&self) -> bool {
+        true
+    }
+
+    fn on_block_updated(&mut self, block: &Block) {
+        // Blocks waiting for a dependency, or with nothing left to send, are
+        // skipped, as in select_block().
+        let eligible = block.remaining_size > 0 && block.unsatisfied_deps == 0;
+        let key = (block.block_priority, block.remaining_size, eligible);
+
+        if let Some(old) = self.keys.insert(block.block_id, key) {
+            if old == key {
+                return;
+            }
+
+            if old.2 {
+                self.order.remove(&(old.0, old.1, block.block_id));
+            }
+        }
+
+        if eligible {
+            self.order.insert((key.0, key.1, block.block_id));
+        }
+    }
+
+    fn on_block_removed(&mut self, block: &Block) {
+        if let Some((prio, remaining, true)) = self.keys.remove(&block.block_id)
+        {
+            self.order.remove(&(prio, remaining, block.block_id));
+        }
+    }
+
+    fn select_from_queue(
+        &mut self, queue: &BlockQueue, _pacing_rate: f64, _rtt: f64,
+        _current_time: u64,
+    ) -> Option<u64> {
+        let block_id = self.order.iter().next().map(|&(_, _, id)| id);
+
+        match block_id {
+            Some(id) => {
+                self.last_block_id = Some(id);
+                trace_event!(Debug, BlockSelected, id, [false]);
+                Some(id)
+            },
+
+            None => {
+                let id = self
+                    .last_block_id
+                    .or_else(|| queue.at(0).map(|b| b.block_id))?;
+                trace_event!(Debug, BlockSelected, id, [true]);
+                Some(id)
+            },
         }
-        else {
-            return false;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use crate::scheduler::testing::block;
+
+    /// Tells the scheduler about the blocks whose dependency changed, as
+    /// `StreamMap` does.
+    fn notify(s: &mut PFScheduler, q: &mut BlockQueue) {
+        while let Some(id) = q.pop_dependency_update() {
+            if let Some(b) = q.get(id) {
+                s.on_block_updated(b);
+            }
         }
     }
-}
\ No newline at end of file
+
+    fn queue(s: &mut PFScheduler, q: &mut BlockQueue, block: Block) {
+        q.insert(block);
+        s.on_block_updated(q.get(block.block_id).unwrap());
+        notify(s, q);
+    }
+
+    fn remove(s: &mut PFScheduler, q: &mut BlockQueue, block_id: u64) {
+        let b = q.remove(block_id).unwrap();
+        s.on_block_removed(&b);
+        notify(s, q);
+    }
+
+    fn select(s: &mut PFScheduler, q: &mut BlockQueue) -> u64 {
+        let id = s.select_from_queue(q, 0.0, 0.0, 0).unwrap();
+
+        // Same choice as the weighted scan.
+        let mut scan = PFScheduler::new();
+        assert_eq!(scan.select_block(q.blocks_mut(), 1e6, 10.0, 0, 0), id);
+
+        id
+    }
+
+    #[test]
+    fn select_from_queue() {
+        let mut s = PFScheduler::new();
+        let mut q = BlockQueue::default();
+
+        queue(&mut s, &mut q, block(0, 300, 200, 2));
+        queue(&mut s, &mut q, block(4, 200, 200, 1));
+        queue(&mut s, &mut q, block(8, 100, 200, 1));
+        assert_eq!(select(&mut s, &mut q), 8);
+
+        // Emitting data from block 4 makes it the shortest one.
+        q.set_remaining(4, 50);
+        s.on_block_updated(q.get(4).unwrap());
+        assert_eq!(select(&mut s, &mut q), 4);
+
+        // Blocks waiting for a dependency are left out of the order...
+        queue(&mut s, &mut q, Block {
+            depend_id: 0,
+            ..block(12, 10, 200, 0)
+        });
+        assert_eq!(select(&mut s, &mut q), 4);
+        assert_eq!(s.order.len(), 3);
+
+        remove(&mut s, &mut q, 4);
+        assert_eq!(select(&mut s, &mut q), 8);
+
+        // ...until it is satisfied.
+        remove(&mut s, &mut q, 8);
+        q.set_remaining(0, 0);
+        s.on_block_updated(q.get(0).unwrap());
+        notify(&mut s, &mut q);
+        assert_eq!(select(&mut s, &mut q), 12);
+        assert_eq!(s.order.len(), 1);
+
+        remove(&mut s, &mut q, 0);
+        remove(&mut s, &mut q, 12);
+        assert!(s.order.is_empty());
+        assert!(s.keys.is_empty());
+    }
+}
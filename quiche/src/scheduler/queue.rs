@@ -0,0 +1,666 @@
+use std::collections::BTreeMap;
+use std::collections::BTreeSet;
+use std::collections::VecDeque;
+
+use crate::scheduler::BlockBatch;
+use crate::stream::Block;
+use crate::stream::StreamIdHashMap;
+use crate::stream::StreamIdHashSet;
+
+/// The number of canceled blocks remembered to cancel the blocks depending on
+/// them that are queued later on.
+const MAX_CANCELED_BLOCKS: usize = 1024;
+
+/// Persistent index of the blocks that are waiting to be scheduled.
+///
+/// Blocks are kept in a single contiguous vector that is handed to the
+/// `Scheduler` as-is, so choosing the next block doesn't need to rebuild (or
+/// clone) any per-packet state. The position of each block is indexed by its
+/// stream ID, which makes updating or removing a block O(1).
+///
+/// Removal swaps the last block into the freed slot, so the order of the
+/// blocks is not preserved.
+///
+/// The queue also tracks the dependencies between blocks: a block depending on
+/// another queued block that still has data left to send has a non-zero
+/// `unsatisfied_deps` counter, which is updated as the dependency progresses,
+/// so that schedulers can check eligibility in constant time. The blocks whose
+/// counter changed are reported by `pop_dependency_update()`, for schedulers
+/// keeping their own index to be told about them.
+///
+/// Blocks are ordered by the time their deadline expires, so that all the
+/// blocks that missed their deadline can be found without going through the
+/// whole queue.
+///
+/// Canceling a block also cancels the blocks depending on it, transitively,
+/// as they can't be used without it anyway.
+///
+/// Finally, the queue mirrors its blocks in a `BlockBatch`, in the same order,
+/// for schedulers to compute their weights over.
+///
+/// How long choosing a block takes depends on the scheduler. None of them
+/// allocate per packet, but only some of them select in less than O(n):
+/// - Basic looks up the block it last sent, in O(1).
+/// - PF keeps its own ordered index of the blocks that can be sent, updated
+///   through `on_block_updated()`, and selects in O(log n).
+/// - EDF walks the expiry order up to the first block that can be sent.
+/// - DTP, DTPSkip and DTPBw compute the weights of all blocks over the batch
+///   on every packet, in O(n) but without going through the blocks
+///   themselves. The weights depend on the current time and the pacing rate
+///   in a way no ordering can be kept for.
+/// - Plugins go through all blocks, in `select_block()`.
+#[derive(Default)]
+pub struct BlockQueue {
+    /// Blocks waiting to be scheduled.
+    blocks: Vec<Block>,
+
+    /// Position of each block in `blocks`, indexed by stream ID.
+    index: StreamIdHashMap<usize>,
+
+    /// Queued blocks depending on each block, indexed by the stream ID of the
+    /// block they depend on (which might not be queued itself).
+    dependents: StreamIdHashMap<Vec<u64>>,
+
+    /// Structure-of-arrays copy of `blocks`.
+    batch: BlockBatch,
+
+    /// Queued blocks ordered by expiry time, as `(expiry, block_id)` pairs.
+    expiry: BTreeSet<(u64, u64)>,
+
+    /// The total amount of data left to send for the queued blocks.
+    queued_bytes: u64,
+
+    /// The amount of data left to send for the queued blocks of each
+    /// priority, leaving out priorities with none.
+    priority_bytes: BTreeMap<u64, u64>,
+
+    /// The most recently canceled blocks, in order of cancellation.
+    canceled: VecDeque<u64>,
+    canceled_set: StreamIdHashSet,
+
+    /// Blocks whose `unsatisfied_deps` changed since they were last returned
+    /// by `pop_dependency_update()`.
+    dependency_updates: Vec<u64>,
+}
+
+/// Returns the time at which the given block misses its deadline, in
+/// microseconds on the scheduler clock.
+fn expiry(block: &Block) -> u64 {
+    block
+        .block_create_time
+        .saturating_add(block.block_deadline.saturating_mul(1000))
+}
+
+impl BlockQueue {
+    /// Inserts the given block, or replaces it if it was already queued.
+    pub fn insert(&mut self, mut block: Block) {
+        let block_id = block.block_id;
+        let remaining_size = block.remaining_size;
+
+        if let Some(&pos) = self.index.get(&block_id) {
+            // Dependencies can't change once the block is queued, so only the
+            // amount of data left to send needs to be propagated.
+            block.unsatisfied_deps = self.blocks[pos].unsatisfied_deps;
+
+            let old = expiry(&self.blocks[pos]);
+            if old != expiry(&block) {
+                self.expiry.remove(&(old, block_id));
+                self.expiry.insert((expiry(&block), block_id));
+            }
+
+            // Keep the previous amount for set_remaining() to compare with.
+            let old = self.blocks[pos];
+            block.remaining_size = old.remaining_size;
+
+            if old.block_priority != block.block_priority {
+                self.account(old.block_priority, 0, old.remaining_size);
+                self.account(block.block_priority, old.remaining_size, 0);
+            }
+            self.blocks[pos] = block;
+
+            self.set_remaining(block_id, remaining_size);
+            return;
+        }
+
+        block.unsatisfied_deps = 0;
+
+        if block.depend_id != block_id {
+            self.dependents
+                .entry(block.depend_id)
+                .or_insert_with(Vec::new)
+                .push(block_id);
+
+            if self.is_pending(block.depend_id) {
+                block.unsatisfied_deps = 1;
+            }
+        }
+
+        self.index.insert(block_id, self.blocks.len());
+        self.expiry.insert((expiry(&block), block_id));
+        self.account(block.block_priority, remaining_size, 0);
+        self.batch.push(&block);
+        self.blocks.push(block);
+
+        // Blocks that were queued before the block they depend on.
+        self.update_dependents(block_id, block.remaining_size > 0);
+    }
+
+    /// Removes the block with the given ID, returning it if it was queued.
+    pub fn remove(&mut self, block_id: u64) -> Option<Block> {
+        let pos = self.index.remove(&block_id)?;
+
+        let block = self.blocks.swap_remove(pos);
+        self.batch.swap_remove(pos);
+
+        self.expiry.remove(&(expiry(&block), block_id));
+        self.account(block.block_priority, 0, block.remaining_size);
+
+        // The last block was moved into the freed slot, so update its index.
+        if let Some(moved) = self.blocks.get(pos) {
+            self.index.insert(moved.block_id, pos);
+        }
+
+        if block.depend_id != block_id {
+            if let Some(siblings) = self.dependents.get_mut(&block.depend_id) {
+                siblings.retain(|&id| id != block_id);
+
+                if siblings.is_empty() {
+                    self.dependents.remove(&block.depend_id);
+                }
+            }
+        }
+
+        // Once removed, the block doesn't hold back its dependents anymore.
+        self.update_dependents(block_id, false);
+
+        Some(block)
+    }
+
+    /// Cancels all the blocks that missed their deadline at the given time, and
+    /// appends them to `out` in order of expiry, each followed by the blocks
+    /// depending on it.
+    ///
+    /// A block misses its deadline once more than `block_deadline`
+    /// milliseconds have passed since its creation.
+    pub fn expire(&mut self, current_time: u64, out: &mut Vec<Block>) {
+        while let Some(&(t, block_id)) = self.expiry.iter().next() {
+            if t >= current_time {
+                break;
+            }
+
+            self.cancel(block_id, out);
+        }
+    }
+
+    /// Removes the block with the given ID along with all the queued blocks
+    /// depending on it, directly or not, and appends them to `out`.
+    ///
+    /// The block doesn't need to be queued itself. All the removed blocks are
+    /// remembered as canceled (see `is_canceled()`).
+    pub fn cancel(&mut self, block_id: u64, out: &mut Vec<Block>) {
+        self.set_canceled(block_id);
+
+        // Blocks appended to `out` from here on have their dependents visited
+        // in turn, starting with the given block.
+        let mut next = out.len();
+
+        if let Some(block) = self.remove(block_id) {
+            out.push(block);
+            next += 1;
+        }
+
+        let mut id = block_id;
+
+        loop {
+            // Removing a block doesn't remove the list of its dependents.
+            for dep_id in self.dependents.remove(&id).unwrap_or_default() {
+                self.set_canceled(dep_id);
+
+                if let Some(block) = self.remove(dep_id) {
+                    out.push(block);
+                }
+            }
+
+            match out.get(next) {
+                Some(b) => id = b.block_id,
+
+                None => break,
+            }
+
+            next += 1;
+        }
+    }
+
+    /// Returns true if the block with the given ID was recently canceled,
+    /// which means that blocks depending on it should be canceled as well.
+    pub fn is_canceled(&self, block_id: u64) -> bool {
+        self.canceled_set.contains(&block_id)
+    }
+
+    fn set_canceled(&mut self, block_id: u64) {
+        if !self.canceled_set.insert(block_id) {
+            return;
+        }
+
+        self.canceled.push_back(block_id);
+
+        if self.canceled.len() > MAX_CANCELED_BLOCKS {
+            if let Some(id) = self.canceled.pop_front() {
+                self.canceled_set.remove(&id);
+            }
+        }
+    }
+
+    /// Updates the amount of data left to send for the given block.
+    pub fn set_remaining(&mut self, block_id: u64, remaining_size: u64) {
+        let pos = match self.index.get(&block_id) {
+            Some(&v) => v,
+
+            None => return,
+        };
+
+        let old = self.blocks[pos];
+        let was_pending = old.remaining_size > 0;
+
+        self.account(old.block_priority, remaining_size, old.remaining_size);
+        self.blocks[pos].remaining_size = remaining_size;
+
+        // This also covers the rest of the block when it is replaced.
+        self.batch.set(pos, &self.blocks[pos]);
+
+        if was_pending != (remaining_size > 0) {
+            self.update_dependents(block_id, remaining_size > 0);
+        }
+    }
+
+    /// Adds `added` bytes to, and removes `removed` bytes from, the data left
+    /// to send at the given priority.
+    fn account(&mut self, priority: u64, added: u64, removed: u64) {
+        self.queued_bytes = self.queued_bytes + added - removed;
+
+        let bytes = self.priority_bytes.entry(priority).or_insert(0);
+        *bytes = *bytes + added - removed;
+
+        if *bytes == 0 {
+            self.priority_bytes.remove(&priority);
+        }
+    }
+
+    /// Returns true if the given block is queued and still has data left to
+    /// send, which means that blocks depending on it can't be sent yet.
+    fn is_pending(&self, block_id: u64) -> bool {
+        self.get(block_id).map_or(false, |b| b.remaining_size > 0)
+    }
+
+    /// Marks the dependency of the blocks depending on the given one as
+    /// unsatisfied or satisfied.
+    fn update_dependents(&mut self, block_id: u64, pending: bool) {
+        let dependents = match self.dependents.get(&block_id) {
+            Some(v) => v,
+
+            None => return,
+        };
+
+        for id in dependents {
+            if let Some(&pos) = self.index.get(id) {
+                if self.blocks[pos].unsatisfied_deps == pending as u64 {
+                    continue;
+                }
+
+                self.blocks[pos].unsatisfied_deps = pending as u64;
+                self.batch.set(pos, &self.blocks[pos]);
+                self.dependency_updates.push(*id);
+            }
+        }
+    }
+
+    /// Returns the ID of a block whose `unsatisfied_deps` changed since it was
+    /// last returned. The block might not be queued anymore.
+    pub fn pop_dependency_update(&mut self) -> Option<u64> {
+        self.dependency_updates.pop()
+    }
+
+    /// Returns the block with the given ID if it is queued.
+    pub fn get(&self, block_id: u64) -> Option<&Block> {
+        self.index.get(&block_id).map(|&pos| &self.blocks[pos])
+    }
+
+    /// Returns true if the block with the given ID is queued.
+    pub fn contains(&self, block_id: u64) -> bool {
+        self.index.contains_key(&block_id)
+    }
+
+    /// Returns the queued blocks in order of expiry time, that is, of absolute
+    /// deadline.
+    pub fn iter_by_expiry(&self) -> impl Iterator<Item = &Block> {
+        self.expiry
+            .iter()
+            .map(move |(_, id)| &self.blocks[self.index[id]])
+    }
+
+    /// Returns the total amount of data left to send for the queued blocks.
+    pub fn queued_bytes(&self) -> u64 {
+        self.queued_bytes
+    }
+
+    /// Returns the amount of data left to send for the queued blocks with the
+    /// given priority or a higher one, that is, a lower or equal value.
+    pub fn queued_bytes_up_to(&self, priority: u64) -> u64 {
+        self.priority_bytes.range(..=priority).map(|(_, &b)| b).sum()
+    }
+
+    /// Returns the block stored at the given position.
+    pub fn at(&self, pos: usize) -> Option<&Block> {
+        self.blocks.get(pos)
+    }
+
+    /// Returns the queued blocks, in the layout expected by `Scheduler`.
+    ///
+    /// Callers must not add, remove, reorder or modify blocks through the
+    /// returned vector, as that would invalidate the index and the batch.
+    pub fn blocks_mut(&mut self) -> &mut Vec<Block> {
+        &mut self.blocks
+    }
+
+    /// Returns the queued blocks.
+    pub fn blocks(&self) -> &[Block] {
+        &self.blocks
+    }
+
+    /// Returns the queued blocks in structure-of-arrays layout, entry `i`
+    /// being the block returned by `at(i)`.
+    pub fn batch(&self) -> &BlockBatch {
+        &self.batch
+    }
+
+    /// Returns the number of queued blocks.
+    pub fn len(&self) -> usize {
+        self.blocks.len()
+    }
+
+    /// Returns true if there are no queued blocks.
+    pub fn is_empty(&self) -> bool {
+        self.blocks.is_empty()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn block(block_id: u64, remaining_size: u64) -> Block {
+        crate::scheduler::testing::block(block_id, remaining_size, 200, 1)
+    }
+
+    fn dependent(block_id: u64, remaining_size: u64, depend_id: u64) -> Block {
+        Block {
+            depend_id,
+            ..block(block_id, remaining_size)
+        }
+    }
+
+    fn unsatisfied(q: &BlockQueue, block_id: u64) -> u64 {
+        q.get(block_id).unwrap().unsatisfied_deps
+    }
+
+    /// Checks that the batch mirrors the blocks.
+    fn assert_batch(q: &BlockQueue) {
+        let mut batch = BlockBatch::default();
+        batch.fill(q.blocks());
+
+        assert_eq!(q.batch(), &batch);
+    }
+
+    #[test]
+    fn insert_update_remove() {
+        let mut q = BlockQueue::default();
+
+        q.insert(block(1, 100));
+        q.insert(block(5, 200));
+        q.insert(block(9, 300));
+        assert_eq!(q.len(), 3);
+
+        // Re-inserting replaces the existing entry.
+        q.insert(block(5, 250));
+        assert_eq!(q.len(), 3);
+        assert_eq!(q.get(5).unwrap().remaining_size, 250);
+
+        q.set_remaining(9, 10);
+        assert_eq!(q.get(9).unwrap().remaining_size, 10);
+        assert_batch(&q);
+
+        // Removing from the front moves the last block into its slot.
+        assert_eq!(q.remove(1).unwrap().block_id, 1);
+        assert!(!q.contains(1));
+        assert_eq!(q.at(0).unwrap().block_id, 9);
+        assert_eq!(q.get(9).unwrap().remaining_size, 10);
+        assert_eq!(q.get(5).unwrap().remaining_size, 250);
+        assert_batch(&q);
+
+        assert!(q.remove(1).is_none());
+
+        assert!(q.remove(9).is_some());
+        assert!(q.remove(5).is_some());
+        assert!(q.is_empty());
+    }
+
+    #[test]
+    fn dependencies() {
+        let mut q = BlockQueue::default();
+
+        // Dependent queued before the block it depends on.
+        q.insert(dependent(5, 100, 1));
+        assert_eq!(unsatisfied(&q, 5), 0);
+
+        q.insert(block(1, 100));
+        assert_eq!(unsatisfied(&q, 5), 1);
+
+        q.insert(dependent(9, 100, 1));
+        q.insert(dependent(13, 100, 5));
+        assert_eq!(unsatisfied(&q, 9), 1);
+        assert_eq!(unsatisfied(&q, 13), 1);
+
+        // All of block 1 was sent.
+        while q.pop_dependency_update().is_some() {}
+        q.set_remaining(1, 0);
+        assert_eq!(unsatisfied(&q, 5), 0);
+        assert_eq!(unsatisfied(&q, 9), 0);
+        assert_eq!(unsatisfied(&q, 13), 1);
+        assert_batch(&q);
+
+        // Only the blocks whose counter changed are reported.
+        let mut updated = vec![];
+        while let Some(id) = q.pop_dependency_update() {
+            updated.push(id);
+        }
+        updated.sort_unstable();
+        assert_eq!(updated, [5, 9]);
+
+        // Part of block 1 needs to be retransmitted.
+        q.set_remaining(1, 10);
+        assert_eq!(unsatisfied(&q, 5), 1);
+        assert_eq!(unsatisfied(&q, 9), 1);
+
+        // Replacing a block keeps its dependency state.
+        q.insert(dependent(9, 200, 1));
+        assert_eq!(unsatisfied(&q, 9), 1);
+
+        // Removing a block releases its dependents.
+        q.remove(1);
+        assert_eq!(unsatisfied(&q, 5), 0);
+        assert_eq!(unsatisfied(&q, 9), 0);
+        assert_batch(&q);
+
+        q.remove(5);
+        assert_eq!(unsatisfied(&q, 13), 0);
+
+        q.remove(9);
+        q.remove(13);
+        assert!(q.is_empty());
+        assert!(q.dependents.is_empty());
+    }
+
+    #[test]
+    fn expire() {
+        let mut q = BlockQueue::default();
+        let mut expired = Vec::new();
+
+        // Expiring at 200ms, 50ms and 100ms respectively.
+        q.insert(block(1, 100));
+        q.insert(Block {
+            block_deadline: 50,
+            ..block(5, 100)
+        });
+        q.insert(Block {
+            block_create_time: 50_000,
+            block_deadline: 50,
+            ..block(9, 100)
+        });
+
+        // Reaching the deadline isn't enough to miss it.
+        q.expire(50_000, &mut expired);
+        assert!(expired.is_empty());
+
+        q.expire(150_000, &mut expired);
+        let ids: Vec<u64> = expired.iter().map(|b| b.block_id).collect();
+        assert_eq!(ids, [5, 9]);
+        assert!(!q.contains(5));
+        assert!(!q.contains(9));
+        assert_eq!(q.len(), 1);
+
+        // Replacing a block with a later deadline postpones its expiry.
+        q.insert(Block {
+            block_deadline: 300,
+            ..block(1, 100)
+        });
+
+        expired.clear();
+        q.expire(250_000, &mut expired);
+        assert!(expired.is_empty());
+
+        q.expire(300_001, &mut expired);
+        assert_eq!(expired.len(), 1);
+        assert!(q.is_empty());
+        assert!(q.expiry.is_empty());
+    }
+
+    #[test]
+    fn deadline_order() {
+        let mut q = BlockQueue::default();
+
+        q.insert(block(1, 100));
+        q.insert(Block {
+            block_deadline: 50,
+            ..block(5, 200)
+        });
+        q.insert(Block {
+            block_create_time: 100_000,
+            block_deadline: 50,
+            ..block(9, 300)
+        });
+
+        let order: Vec<u64> = q.iter_by_expiry().map(|b| b.block_id).collect();
+        assert_eq!(order, [5, 9, 1]);
+        assert_eq!(q.queued_bytes(), 600);
+
+        q.set_remaining(9, 10);
+        q.insert(block(5, 150));
+        assert_eq!(q.queued_bytes(), 260);
+
+        let order: Vec<u64> = q.iter_by_expiry().map(|b| b.block_id).collect();
+        assert_eq!(order, [9, 1, 5]);
+
+        q.remove(1);
+        assert_eq!(q.queued_bytes(), 160);
+    }
+
+    #[test]
+    fn queued_bytes_per_priority() {
+        let mut q = BlockQueue::default();
+
+        q.insert(block(1, 100));
+        q.insert(Block {
+            block_priority: 0,
+            ..block(5, 200)
+        });
+        q.insert(Block {
+            block_priority: 2,
+            ..block(9, 300)
+        });
+
+        assert_eq!(q.queued_bytes_up_to(0), 200);
+        assert_eq!(q.queued_bytes_up_to(1), 300);
+        assert_eq!(q.queued_bytes_up_to(5), 600);
+
+        // Replacing a block can move its data to another priority.
+        q.set_remaining(5, 50);
+        q.insert(Block {
+            block_priority: 2,
+            ..block(1, 80)
+        });
+        assert_eq!(q.queued_bytes_up_to(0), 50);
+        assert_eq!(q.queued_bytes_up_to(1), 50);
+        assert_eq!(q.queued_bytes_up_to(2), 430);
+
+        q.remove(9);
+        q.remove(5);
+        assert_eq!(q.queued_bytes_up_to(2), 80);
+        assert_eq!(q.priority_bytes.len(), 1);
+    }
+
+    fn ids(blocks: &[Block]) -> Vec<u64> {
+        blocks.iter().map(|b| b.block_id).collect()
+    }
+
+    #[test]
+    fn cancel_dependents() {
+        let mut q = BlockQueue::default();
+        let mut canceled = Vec::new();
+
+        q.insert(block(1, 100));
+        q.insert(dependent(5, 100, 1));
+        q.insert(dependent(9, 100, 5));
+        q.insert(dependent(13, 100, 1));
+        q.insert(block(17, 100));
+        q.insert(Block {
+            block_create_time: 100_000,
+            ..dependent(21, 100, 17)
+        });
+
+        // The whole dependency tree is canceled, parents first.
+        q.cancel(1, &mut canceled);
+        assert_eq!(ids(&canceled), [1, 5, 13, 9]);
+        assert_eq!(q.len(), 2);
+        assert!(q.is_canceled(9));
+        assert!(!q.is_canceled(17));
+
+        // Blocks that are not queued can be canceled too.
+        canceled.clear();
+        q.cancel(25, &mut canceled);
+        assert!(canceled.is_empty());
+        assert!(q.is_canceled(25));
+
+        // Dependents of expired blocks are canceled even if still on time.
+        q.expire(250_000, &mut canceled);
+        assert_eq!(ids(&canceled), [17, 21]);
+        assert!(q.is_empty());
+        assert!(q.dependents.is_empty());
+        assert!(q.expiry.is_empty());
+    }
+
+    #[test]
+    fn cancel_bounded() {
+        let mut q = BlockQueue::default();
+        let mut canceled = Vec::new();
+
+        for id in 0..MAX_CANCELED_BLOCKS as u64 + 10 {
+            q.cancel(id, &mut canceled);
+        }
+
+        // Only the most recent cancellations are remembered.
+        assert!(!q.is_canceled(9));
+        assert!(q.is_canceled(10));
+        assert_eq!(q.canceled.len(), MAX_CANCELED_BLOCKS);
+        assert_eq!(q.canceled_set.len(), MAX_CANCELED_BLOCKS);
+    }
+}
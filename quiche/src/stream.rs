@@ -28,6 +28,8 @@ use std::cmp;
 
 use std::sync::Arc;
 
+use std::ffi::c_void;
+
 use std::collections::hash_map;
 
 use std::collections::BTreeMap;
@@ -45,7 +47,7 @@ use crate::flowcontrol;
 use crate::ranges;
 
 use crate::Config;
-use crate::scheduler::{Scheduler, DynScheduler};
+use crate::scheduler::{Scheduler, DynScheduler, PathEstimates};
 use crate::scheduler;
 
 const DEFAULT_URGENCY: u64 = 127;
@@ -71,12 +73,24 @@ pub struct Block {
     pub block_id: u64,
     pub block_deadline: u64,
     pub block_priority: u64,
+    /// Creation time of the block, in microseconds on the scheduler clock
+    /// (see `clock_micros()`).
     pub block_create_time: u64,
     pub block_size: u64,
     pub remaining_size: u64,
     pub depend_id: u64,
+    /// Number of unsatisfied dependencies of this block, that is, whether the
+    /// block it depends on still has data left to send.
+    pub unsatisfied_deps: u64,
 }
 
+impl Block {
+    /// Returns the time elapsed since the block was created in milliseconds,
+    /// given the current time on the scheduler clock.
+    pub fn passed_time(&self, current_time: u64) -> f64 {
+        current_time.saturating_sub(self.block_create_time) as f64 / 1000.0
+    }
+}
 
 /// A simple no-op hasher for Stream IDs.
 ///
@@ -122,7 +136,7 @@ pub struct StreamMap {
     /// Instead of keeping the full stream state forever, we collect completed
     /// streams to save memory, but we still need to keep track of previously
     /// created streams, to prevent peers from re-creating them.
-    collected: StreamIdHashSet,
+    collected: CollectedSet,
 
     /// Peer's maximum bidirectional stream count limit.
     peer_max_streams_bidi: u64,
@@ -163,6 +177,17 @@ pub struct StreamMap {
     /// round-robin fashion after all non-incremental streams have been flushed.
     flushable: BTreeMap<u64, (BinaryHeap<std::cmp::Reverse<u64>>, VecDeque<u64>)>,
 
+    /// Blocks corresponding to incremental streams that have buffered data
+    /// ready to be sent, when deadline scheduling is enabled. These are
+    /// scheduled by `scheduler` instead of being queued in `flushable`.
+    ///
+    /// This is updated incrementally as data is written, emitted or canceled,
+    /// so that `peek_flushable()` doesn't need to rebuild it for every packet.
+    blocks: scheduler::BlockQueue,
+
+    /// Whether incremental streams are scheduled as blocks by `scheduler`.
+    deadline_scheduling: bool,
+
     /// Set of stream IDs corresponding to streams that have outstanding data
     /// to read. This is used to generate a `StreamIter` of streams without
     /// having to iterate over the full list of streams.
@@ -204,6 +229,20 @@ pub struct StreamMap {
     /// The maximum size of a stream window.
     max_stream_window: u64,
 
+    /// Collected streams kept for reuse by new streams, so that their buffers
+    /// don't need to be allocated again.
+    pool: Vec<Stream>,
+
+    /// Scratch buffer for the blocks being canceled, kept to avoid allocating
+    /// it every time.
+    canceled: Vec<Block>,
+
+    /// The number of blocks dropped before being fully sent.
+    dropped_blocks: u64,
+
+    /// The number of unsent bytes discarded along with the dropped blocks.
+    dropped_bytes: u64,
+
     scheduler: DynScheduler,
 }
 
@@ -211,6 +250,9 @@ impl StreamMap {
     pub fn new(
         max_streams_bidi: u64, max_streams_uni: u64, max_stream_window: u64, config: &Config
     ) -> StreamMap {
+        // Make sure the scheduler clock starts before any block is created.
+        lazy_static::initialize(&CLOCK_ORIGIN);
+
         StreamMap {
             local_max_streams_bidi: max_streams_bidi,
             local_max_streams_bidi_next: max_streams_bidi,
@@ -220,7 +262,12 @@ impl StreamMap {
 
             max_stream_window,
 
-            scheduler: DynScheduler::init(config.scheduler_type),
+            scheduler: DynScheduler::init(
+                config.scheduler_type,
+                config.scheduler_ops,
+            ),
+
+            deadline_scheduling: config.deadline_scheduling,
 
             ..StreamMap::default()
         }
@@ -256,7 +303,7 @@ impl StreamMap {
         let stream = match self.streams.entry(id) {
             hash_map::Entry::Vacant(v) => {
                 // Stream has already been closed and garbage collected.
-                if self.collected.contains(&id) {
+                if self.collected.contains(id) {
                     return Err(Error::Done);
                 }
 
@@ -299,7 +346,6 @@ impl StreamMap {
                         );
                         //eprintln!("stream_n {}, {}", self.local_opened_streams_bidi, stream_sequence + 1);
                         if n > self.peer_max_streams_bidi {
-                            eprintln!("n > self.peer_max_streams_bidi");
                             return Err(Error::StreamLimit);
                         }
 
@@ -346,16 +392,34 @@ impl StreamMap {
                     },
                 };
 
-                let s = Stream::new_full(
-                    max_rx_data,
-                    max_tx_data,
-                    is_bidi(id),
-                    local,
-                    self.max_stream_window,
-                    deadline,
-                    priority,
-                    depend_id,
-                );
+                let s = match self.pool.pop() {
+                    Some(mut s) => {
+                        s.reuse(
+                            max_rx_data,
+                            max_tx_data,
+                            is_bidi(id),
+                            local,
+                            self.max_stream_window,
+                            deadline,
+                            priority,
+                            depend_id,
+                        );
+
+                        s
+                    },
+
+                    None => Stream::new_full(
+                        max_rx_data,
+                        max_tx_data,
+                        is_bidi(id),
+                        local,
+                        self.max_stream_window,
+                        deadline,
+                        priority,
+                        depend_id,
+                    ),
+                };
+
                 v.insert(s)
             },
 
@@ -380,6 +444,27 @@ impl StreamMap {
     /// unfairly scheduled more often than other streams, and might also cause
     /// spurious cycles through the queue, so it should be avoided.
     pub fn push_flushable(&mut self, stream_id: u64, urgency: u64, incr: bool) {
+        // Incremental streams are handed to the scheduler as blocks instead,
+        // regardless of their urgency.
+        if incr && self.deadline_scheduling {
+            if let Some(block) = self.get_block(stream_id) {
+                // The block it depends on was canceled after the stream was
+                // admitted, so it can't be used. New blocks depending on a
+                // canceled block are rejected by `admit_block()` already.
+                if block.depend_id != block.block_id &&
+                    self.blocks.is_canceled(block.depend_id)
+                {
+                    self.cancel_block(stream_id).ok();
+                    return;
+                }
+
+                self.blocks.insert(block);
+                self.notify_block_updated(stream_id);
+            }
+
+            return;
+        }
+
         // Push the element to the back of the queue corresponding to the given
         // urgency. If the queue doesn't exist yet, create it first.
         let queues = self
@@ -435,127 +520,288 @@ impl StreamMap {
         }
     }
 
+    /// Returns the stream ID of the next stream to send data from.
+    ///
+    /// Without deadline scheduling this is the same as `pop_flushable()`.
+    /// Otherwise, non-incremental streams are returned first, in order of
+    /// their urgency and stream ID, and then the block chosen by the scheduler
+    /// among the queued ones. Blocks that the scheduler decides to drop are
+    /// canceled before selection, starting with all those that missed their
+    /// deadline if the scheduler always drops them. In that case, the other
+    /// blocks are only checked if the scheduler may drop them as well.
+    ///
+    /// The returned stream is not removed from the queue, the caller needs to
+    /// call `remove_peeked()` once it is no longer flushable.
     pub fn peek_flushable(
         &mut self, bandwidth: f64, rtt: f64, next_packet_id: u64,
         current_time: u64,
     ) -> Option<u64> {
+        if let Some(stream_id) = self.pop_flushable() {
+            return Some(stream_id);
+        }
+
+        if !self.deadline_scheduling {
+            return None;
+        }
+
+        let mut pos = 0;
 
-        if let Some(o_queues) = self.flushable.get_mut(&DEFAULT_URGENCY) {
-            let mut queues = (*o_queues).clone();
-            let node = if !queues.0.is_empty() {
-                queues.0.pop().map(|x| x.0)
+        if self.scheduler.drops_expired_blocks() {
+            self.expire_blocks(current_time);
+
+            if !self.scheduler.drops_unexpired_blocks() {
+                pos = self.blocks.len();
             }
-            else {
-                //instead of pop_front(Round robin), we use a scheduler to decide the stream
-                //queues.1.pop_front();
-                let mut blocks_vec = vec![];
-                let mut peek_blocks_vec = vec![];
-
-                for i in (0..queues.1.len()).rev() {
-                    let &id = queues.1.get(i).unwrap();
-                    let block = self.get_block(id);
-                    peek_blocks_vec.push(block);
-                }
+        }
 
+        while let Some(&block) = self.blocks.at(pos) {
+            if self.scheduler.should_drop_block(
+                &block,
+                bandwidth,
+                rtt,
+                next_packet_id,
+                current_time,
+            ) {
+                // Canceling removes the block and its dependents from the
+                // queue, which moves other blocks around, starting with the
+                // current position. Blocks moved before it are checked on
+                // the next call.
+                self.cancel_block(block.block_id).ok();
+                continue;
+            }
 
-                for i in (0..queues.1.len()).rev() {
-                    let &id = queues.1.get(i).unwrap();
-                    // check if need to cancel this block
-                    // let stream = self.get(id).unwrap();
-                    // let passed_time =
-                    //     stream.send.start_instant.unwrap().elapsed().as_millis();
-                    // create block structure for C++
-                    let block = self.get_block(id);
-                    //eprintln!("{} ms, block in queue: id {}", current_time, block.block_id);
-                    if self.scheduler.should_drop_block(&block, bandwidth, rtt, next_packet_id, current_time) {
-                        self.cancel_block(id).ok()?;
-                        // Block canceled, so non-flushable
-                        eprintln!("drop block: {}", id);
-                        queues.1.swap_remove_back(i);
-                        continue;
-                    }
-                    // add the block struct to blocks, and used by C++ code later
-                    blocks_vec.push(block);
-                }
+            pos += 1;
+        }
 
-                if blocks_vec.is_empty() {
-                    None
-                } else {
-                    let b_id = self.scheduler.select_block(
-                                                       &mut blocks_vec,
-                                                       bandwidth,
-                                                       rtt,
-                                                       next_packet_id,
-                                                       current_time,
-                                                   );
-                    let best_block_id = Some(b_id);
-                    //eprintln!("best_block_id: {}", b_id);
-                    // pop(return and remove) highest_stream_id
-                    // for i in 0..queues.1.len() {
-                    //     let &id = queues.1.get(i).unwrap();
-                    //     if Some(id) == best_block_id {
-                    //         queues.1.swap_remove_front(i);
-                    //         break;
-                    //     }
-                    // }
-                    best_block_id
-                }
-            };
-            self.flushable.remove(&DEFAULT_URGENCY);
-            self.flushable.insert(DEFAULT_URGENCY, queues);
-            node
+        if self.blocks.is_empty() {
+            return None;
         }
-        else {
-            None
+
+        let block_id = match self.scheduler.select_from_queue(
+            &self.blocks,
+            bandwidth,
+            rtt,
+            current_time,
+        ) {
+            Some(v) => v,
+
+            None => self.scheduler.select_block(
+                self.blocks.blocks_mut(),
+                bandwidth,
+                rtt,
+                next_packet_id,
+                current_time,
+            ),
+        };
+
+        if self.blocks.contains(block_id) {
+            return Some(block_id);
         }
+
+        // The scheduler returned a block that is not queued anymore, so fall
+        // back to the first queued one.
+        self.blocks.at(0).map(|b| b.block_id)
     }
 
+    /// Returns whether the scheduler accepts a new block of `len` bytes for
+    /// the given stream, which doesn't exist yet.
+    ///
+    /// Blocks depending on a canceled block are always rejected. When the
+    /// block is rejected, it is counted as dropped along with all its data,
+    /// and blocks depending on it are canceled.
+    pub fn admit_block(
+        &mut self, stream_id: u64, len: usize, deadline: u64, priority: u64,
+        depend_id: u64,
+    ) -> bool {
+        if !self.deadline_scheduling {
+            return true;
+        }
 
-    pub fn get_block(&mut self, id: u64) -> Block {
-        let block = self.get(id).unwrap();
-        let create_time = match block
-            .send
-            .start_time
-            .unwrap()
-            .duration_since(time::SystemTime::UNIX_EPOCH)
-        {
-            Ok(n) => n.as_millis(),
-            Err(_) => panic!("SystemTime before UNIX EPOCH!"),
+        let block = Block {
+            block_id: stream_id,
+            block_deadline: deadline,
+            block_priority: priority,
+            block_create_time: clock_micros(time::Instant::now()),
+            block_size: len as u64,
+            remaining_size: len as u64,
+            depend_id,
+            unsatisfied_deps: 0,
         };
-        Block {
+
+        let parent_canceled =
+            depend_id != stream_id && self.blocks.is_canceled(depend_id);
+
+        if !parent_canceled &&
+            self.scheduler
+                .admit_block(&block, self.blocks.queued_bytes_up_to(priority))
+        {
+            return true;
+        }
+
+        trace_event!(Info, BlockDropped, block.block_id, [
+            block.block_priority,
+            block.remaining_size,
+            block.block_size,
+            block.depend_id
+        ]);
+
+        self.dropped_blocks += 1;
+        self.dropped_bytes += len as u64;
+
+        // There is no stream to reset, but dependents need to be canceled.
+        self.cancel_block(stream_id).ok();
+
+        false
+    }
+
+    /// Updates the path estimates used by the scheduler.
+    pub fn update_path_estimates(&mut self, estimates: &PathEstimates) {
+        self.scheduler.update_path_estimates(estimates);
+    }
+
+    /// Removes the stream last returned by `peek_flushable()` from the queue.
+    pub fn remove_peeked(&mut self, stream_id: u64) {
+        match self.blocks.remove(stream_id) {
+            Some(block) => {
+                self.scheduler.on_block_removed(&block);
+                self.notify_dependency_updates();
+            },
+
+            None => self.remove_flushable(),
+        }
+    }
+
+    /// Refreshes the queued block of the given stream after its send buffer
+    /// changed (e.g. new data was written, emitted or retransmitted).
+    ///
+    /// If the stream is not queued, this does nothing.
+    pub fn update_block(&mut self, stream_id: u64) {
+        if !self.blocks.contains(stream_id) {
+            return;
+        }
+
+        if let Some(stream) = self.streams.get(&stream_id) {
+            self.blocks.set_remaining(stream_id, stream.send.len);
+            self.notify_block_updated(stream_id);
+        }
+    }
+
+    /// Tells the scheduler about the current state of a queued block, and of
+    /// the blocks whose dependency was satisfied or became unsatisfied.
+    fn notify_block_updated(&mut self, stream_id: u64) {
+        if let Some(block) = self.blocks.get(stream_id) {
+            self.scheduler.on_block_updated(block);
+        }
+
+        self.notify_dependency_updates();
+    }
+
+    fn notify_dependency_updates(&mut self) {
+        while let Some(id) = self.blocks.pop_dependency_update() {
+            if let Some(block) = self.blocks.get(id) {
+                self.scheduler.on_block_updated(block);
+            }
+        }
+    }
+
+    /// Builds the scheduler's view of the given stream.
+    pub fn get_block(&self, id: u64) -> Option<Block> {
+        let block = self.get(id)?;
+        let create_time = clock_micros(block.send.start_instant.unwrap());
+        Some(Block {
             block_id: id,
             block_deadline: block.send.deadline,
             block_priority: block.send.priority,
-            block_create_time: create_time as u64,
+            block_create_time: create_time,
             block_size: block.send.block_size(),
             remaining_size: block.send.len,
             depend_id: block.send.depend_id,
-        }
+            unsatisfied_deps: 0,
+        })
     }
 
     /// cancel this block
+    ///
+    /// The blocks depending on it, directly or not, are canceled as well.
     pub fn cancel_block(&mut self, stream_id: u64) -> Result<()> {
-        let stream = self.streams.get_mut(&stream_id).unwrap();
+        let mut canceled = std::mem::take(&mut self.canceled);
+
+        self.blocks.cancel(stream_id, &mut canceled);
+
+        // The block itself might not be queued.
+        let res = self.reset_block(stream_id);
+
+        self.drop_blocks(&mut canceled, stream_id);
+
+        self.canceled = canceled;
+
+        res
+    }
+
+    /// Shuts down the send side of a block that was removed from the queue.
+    fn reset_block(&mut self, stream_id: u64) -> Result<()> {
+        let stream = self
+            .streams
+            .get_mut(&stream_id)
+            .ok_or(Error::InvalidStreamState(stream_id))?;
         // add id into Set of canceled, will send RESET_STREAM of this IDs in
         // lib::send
-        //self.canceled.insert(stream_id);
-        //self.canceled_depend.insert(stream_id);
-        let (final_size, _) = stream.send.shutdown()?;
+        let (final_size, unsent_len) = stream.send.shutdown()?;
         self.mark_reset(stream_id, true, 0, final_size);
-        //self.canceled.insert(stream_id);
         // Once shutdown, the stream is guaranteed to be non-writable.
         self.mark_writable(stream_id, false);
-        //eprintln!("block {} miss deadline, canceled\n", stream_id);
-        //println!("block {} miss deadline, canceled\n", stream_id);
-        //eprintln!(
-        //    "cancel block {},len of streams: {}",
-        //    stream_id,
-        //    self.streams.len()
-        //);
+
+        self.dropped_blocks += 1;
+        self.dropped_bytes += unsent_len;
+
         Ok(())
     }
 
+    /// Resets the streams of the given canceled blocks, except for `skip_id`
+    /// which the caller takes care of, and tells the scheduler about them.
+    fn drop_blocks(&mut self, blocks: &mut Vec<Block>, skip_id: u64) {
+        for block in blocks.drain(..) {
+            trace_event!(Info, BlockDropped, block.block_id, [
+                block.block_priority,
+                block.remaining_size,
+                block.block_size,
+                block.depend_id
+            ]);
+
+            self.scheduler.on_block_removed(&block);
+            self.scheduler.on_block_dropped(&block);
+
+            if block.block_id != skip_id {
+                self.reset_block(block.block_id).ok();
+            }
+        }
+
+        self.notify_dependency_updates();
+    }
+
+    /// Drops all the queued blocks that missed their deadline at the given
+    /// time, along with the blocks depending on them.
+    ///
+    /// This is equivalent to calling `cancel_block()` on each of them, but
+    /// the expired blocks are found through the queue's deadline order, so
+    /// the blocks that are still on time are not visited. The RESET_STREAM
+    /// frames of the dropped streams are sent together by
+    /// `Connection::send()`.
+    fn expire_blocks(&mut self, current_time: u64) {
+        let mut canceled = std::mem::take(&mut self.canceled);
+
+        self.blocks.expire(current_time, &mut canceled);
+
+        self.drop_blocks(&mut canceled, u64::MAX);
+
+        self.canceled = canceled;
+    }
 
+    /// Returns the number of blocks dropped before being fully sent, and the
+    /// number of unsent bytes discarded with them.
+    pub fn dropped(&self) -> (u64, u64) {
+        (self.dropped_blocks, self.dropped_bytes)
+    }
 
     /// Adds or removes the stream ID to/from the readable streams set.
     ///
@@ -613,7 +859,8 @@ impl StreamMap {
         &mut self, stream_id: u64, reset: bool, error_code: u64, final_size: u64,
     ) {
         if reset {
-            eprintln!("Mark rest block {}, error_code {}, final_size{}", stream_id, error_code, final_size);
+            trace_event!(Info, StreamReset, stream_id, [error_code, final_size]);
+
             self.reset.insert(stream_id, (error_code, final_size));
         } else {
             self.reset.remove(&stream_id);
@@ -698,7 +945,13 @@ impl StreamMap {
             }
         }
 
-        self.streams.remove(&stream_id);
+        if let Some(mut stream) = self.streams.remove(&stream_id) {
+            if self.pool.len() < MAX_POOLED_STREAMS {
+                stream.clear();
+                self.pool.push(stream);
+            }
+        }
+
         self.collected.insert(stream_id);
     }
 
@@ -712,6 +965,18 @@ impl StreamMap {
         StreamIter::from(&self.writable)
     }
 
+    /// Copies the IDs of the streams that have outstanding data to read into
+    /// `out`, and returns the number of such streams.
+    pub fn readable_into(&self, out: &mut [u64]) -> usize {
+        copy_ids(&self.readable, out)
+    }
+
+    /// Copies the IDs of the streams that can be written to into `out`, and
+    /// returns the number of such streams.
+    pub fn writable_into(&self, out: &mut [u64]) -> usize {
+        copy_ids(&self.writable, out)
+    }
+
     /// Creates an iterator over streams that need to send MAX_STREAM_DATA.
     pub fn almost_full(&self) -> StreamIter {
         StreamIter::from(&self.almost_full)
@@ -734,12 +999,12 @@ impl StreamMap {
 
     /// Returns true if the stream has been collected.
     pub fn is_collected(&self, stream_id: u64) -> bool {
-        self.collected.contains(&stream_id)
+        self.collected.contains(stream_id)
     }
 
     /// Returns true if there are any streams that have data to write.
     pub fn has_flushable(&self) -> bool {
-        !self.flushable.is_empty()
+        !self.flushable.is_empty() || !self.blocks.is_empty()
     }
 
     /// Returns true if there are any streams that have data to read.
@@ -849,6 +1114,41 @@ impl Stream {
         }
     }
 
+    /// Drops the data and application state held by a collected stream, and
+    /// trims its buffers, before it is pooled.
+    fn clear(&mut self) {
+        self.recv.data.clear();
+        self.recv.data.shrink_to(MAX_POOLED_BUFS);
+
+        self.send.data.clear();
+        self.send.data.shrink_to(MAX_POOLED_BUFS);
+
+        self.data = None;
+    }
+
+    /// Reinitializes a pooled stream, as if it was created by `new_full()`,
+    /// keeping the memory allocated by its buffers.
+    fn reuse(
+        &mut self, max_rx_data: u64, max_tx_data: u64, bidi: bool, local: bool,
+        max_window: u64, deadline: u64, priority: u64, depend_id: u64,
+    ) {
+        let recv_data = std::mem::take(&mut self.recv.data);
+        let send_data = std::mem::take(&mut self.send.data);
+
+        *self = Stream::new_full(
+            max_rx_data,
+            max_tx_data,
+            bidi,
+            local,
+            max_window,
+            deadline,
+            priority,
+            depend_id,
+        );
+
+        self.recv.data = recv_data;
+        self.send.data = send_data;
+    }
 
     /// Returns true if the stream has data to read.
     pub fn is_readable(&self) -> bool {
@@ -895,6 +1195,20 @@ impl Stream {
     }
 }
 
+lazy_static::lazy_static! {
+    /// Reference point of the scheduler clock.
+    static ref CLOCK_ORIGIN: time::Instant = time::Instant::now();
+}
+
+/// Returns the given instant in microseconds on the scheduler clock.
+///
+/// The scheduler clock is monotonic and shared by all connections in the
+/// process, so block timestamps are not affected by wall-clock adjustments
+/// and don't require querying the system time.
+pub fn clock_micros(t: time::Instant) -> u64 {
+    t.saturating_duration_since(*CLOCK_ORIGIN).as_micros() as u64
+}
+
 /// Returns true if the stream was created locally.
 pub fn is_local(stream_id: u64, is_server: bool) -> bool {
     (stream_id & 0x1) == (is_server as u64)
@@ -905,6 +1219,76 @@ pub fn is_bidi(stream_id: u64) -> bool {
     (stream_id & 0x2) == 0
 }
 
+/// Maximum number of collected streams kept for reuse.
+const MAX_POOLED_STREAMS: usize = 64;
+
+/// Number of data chunks that the buffers of pooled streams keep room for.
+const MAX_POOLED_BUFS: usize = 64;
+
+/// Maximum number of ranges of collected streams tracked per stream type.
+const MAX_COLLECTED_RANGES: usize = 256;
+
+/// Compact set of the IDs of collected streams.
+///
+/// IDs of the streams of a given type are consecutive multiples of 4, and
+/// streams are mostly collected in the order they were opened, so the
+/// sequence numbers (i.e. the ID without the type bits) of collected streams
+/// are kept as ranges, per stream type.
+///
+/// Streams that are never collected leave gaps between ranges, so to bound
+/// memory, once there are too many ranges the lowest one is folded into a low
+/// watermark, below which all streams are considered collected. Those are
+/// streams that are older than the `MAX_COLLECTED_RANGES` most recent gaps.
+#[derive(Default)]
+struct CollectedSet {
+    /// Ranges of collected stream sequence numbers, per stream type.
+    ranges: [ranges::RangeSet; 4],
+
+    /// Sequence number below which all streams are collected, per stream type.
+    low: [u64; 4],
+}
+
+impl CollectedSet {
+    fn insert(&mut self, stream_id: u64) {
+        let (ty, seq) = ((stream_id & 0x3) as usize, stream_id >> 2);
+
+        if seq < self.low[ty] {
+            return;
+        }
+
+        let ranges = &mut self.ranges[ty];
+        ranges.insert(seq..seq + 1);
+
+        // Fold the lowest range into the watermark if it extends it, or if
+        // there are too many ranges.
+        while let Some(first) = ranges.iter().next() {
+            if first.start > self.low[ty] && ranges.len() <= MAX_COLLECTED_RANGES
+            {
+                break;
+            }
+
+            self.low[ty] = first.end;
+            ranges.pop_first();
+        }
+    }
+
+    fn contains(&self, stream_id: u64) -> bool {
+        let (ty, seq) = ((stream_id & 0x3) as usize, stream_id >> 2);
+
+        seq < self.low[ty] || self.ranges[ty].contains(seq)
+    }
+}
+
+/// Copies as many of the stream IDs of `set` as fit into `out`, and returns
+/// the total number of IDs in the set.
+fn copy_ids(set: &StreamIdHashSet, out: &mut [u64]) -> usize {
+    for (slot, id) in out.iter_mut().zip(set.iter()) {
+        *slot = *id;
+    }
+
+    set.len()
+}
+
 /// An iterator over QUIC streams.
 #[derive(Default)]
 pub struct StreamIter {
@@ -992,20 +1376,17 @@ impl RecvBuf {
         if let Some(fin_off) = self.fin_off {
             // Stream's size is known, forbid data beyond that point.
             if buf.max_off() > fin_off {
-                eprintln!("buf.max_off() {} > fin_off {}", buf.max_off(), fin_off);
                 return Err(Error::FinalSize);
             }
 
             // Stream's size is already known, forbid changing it.
             if buf.fin() && fin_off != buf.max_off() {
-                eprintln!("buf.fin() && fin_off {} != buf.max_off() {}", fin_off, buf.max_off());
                 return Err(Error::FinalSize);
             }
         }
 
         // Stream's known size is lower than data already received.
         if buf.fin() && buf.max_off() < self.len {
-            eprintln!("buf.fin() && buf.max_off() {} < self.len {}", buf.max_off(), self.len);
             return Err(Error::FinalSize);
         }
 
@@ -1103,8 +1484,58 @@ impl RecvBuf {
     /// On success the amount of data read, and a flag indicating if there is
     /// no more data in the buffer, are returned as a tuple.
     pub fn emit(&mut self, out: &mut [u8]) -> Result<(usize, bool)> {
+        self.advance(out.len(), |off, buf| {
+            out[off..off + buf.len()].copy_from_slice(buf)
+        })
+    }
+
+    /// Returns the contiguous data at the current read offset, without reading
+    /// it.
+    ///
+    /// This is the first of the buffered chunks, so there might be more data
+    /// to read once it's consumed. If there is no data at the expected read
+    /// offset, the `Done` error is returned.
+    ///
+    /// On success the data, and a flag indicating if it reaches the end of the
+    /// stream, are returned as a tuple.
+    pub fn peek(&self) -> Result<(&[u8], bool)> {
+        if !self.ready() {
+            return Err(Error::Done);
+        }
+
+        // The stream was reset, so return the error code instead.
+        if let Some(e) = self.error {
+            return Err(Error::StreamReset(e));
+        }
+
+        let buf = match self.data.peek() {
+            Some(v) => v,
+
+            None => return Err(Error::Done),
+        };
+
+        let fin = self.fin_off == Some(self.off + buf.len() as u64);
+
+        Ok((&buf[..], fin))
+    }
+
+    /// Reads up to `len` bytes of contiguous data out of the receive buffer,
+    /// discarding them, like `emit()` does without the copy.
+    pub fn consume(&mut self, len: usize) -> Result<(usize, bool)> {
+        self.advance(len, |_, _| ())
+    }
+
+    /// Advances the read offset over up to `max_len` bytes of contiguous data,
+    /// calling `read` with the offset of each chunk relative to the initial
+    /// read offset, and its data.
+    fn advance<F>(
+        &mut self, max_len: usize, mut read: F,
+    ) -> Result<(usize, bool)>
+    where
+        F: FnMut(usize, &[u8]),
+    {
         let mut len = 0;
-        let mut cap = out.len();
+        let mut cap = max_len;
 
         if !self.ready() {
             return Err(Error::Done);
@@ -1124,7 +1555,7 @@ impl RecvBuf {
 
             let buf_len = cmp::min(buf.len(), cap);
 
-            out[len..len + buf_len].copy_from_slice(&buf[..buf_len]);
+            read(len, &buf[..buf_len]);
 
             self.off += buf_len as u64;
 
@@ -1151,13 +1582,11 @@ impl RecvBuf {
     pub fn reset(&mut self, error_code: u64, final_size: u64) -> Result<usize> {
         // Stream's size is already known, forbid changing it.
         if let Some(fin_off) = self.fin_off {
-            eprintln!("recv rest fn finoff {}, final size {}", fin_off, final_size);
             if fin_off != final_size {
                 return Err(Error::FinalSize);
             }
         }
 
-        eprintln!("recv rest fn selflen {}, final size {}", self.len, final_size);
         // Stream's known size is lower than data already received.
         if final_size < self.len {
             return Err(Error::FinalSize);
@@ -1170,7 +1599,6 @@ impl RecvBuf {
         //let max_data_delta = (final_size).saturating_sub(self.len);
 
         if self.error.is_some() {
-            eprintln!("error is some");
             return Ok(max_data_delta as usize);
         }
 
@@ -1311,8 +1739,6 @@ pub struct SendBuf {
     priority: u64,
 
     depend_id: u64,
-    /// Beginning timestamp of the block.
-    start_time: Option<time::SystemTime>,
 
     /// Beginning Instant of the block, Instant is a monotonically nondecreasing
     /// clock.
@@ -1341,7 +1767,6 @@ impl SendBuf {
     ) -> SendBuf {
         SendBuf {
             max_data,
-            start_time: Some(time::SystemTime::now()),
             start_instant: Some(time::Instant::now()),
             deadline,
             priority,
@@ -1363,26 +1788,65 @@ impl SendBuf {
     /// The number of bytes that were actually stored in the buffer is returned
     /// (this may be lower than the size of the input buffer, in case of partial
     /// writes).
-    pub fn write(&mut self, mut data: &[u8], mut fin: bool) -> Result<usize> {
-        let max_off = self.off + data.len() as u64;
+    pub fn write(&mut self, data: &[u8], fin: bool) -> Result<usize> {
+        self.append(data.len(), fin, |range, off, fin| {
+            RangeBuf::from(&data[range], off, fin)
+        })
+    }
+
+    /// Inserts the given owned buffer at the end of the buffer, without
+    /// copying it.
+    ///
+    /// The buffer is dropped once none of its data is needed anymore, that is,
+    /// once it has all been acked, or the stream was reset.
+    ///
+    /// Unlike `write()`, the buffer is either stored whole or not at all, so
+    /// that the caller never has to keep track of a tail that wasn't stored.
+    /// `Error::Done` is returned if the stream's capacity is too low, and the
+    /// buffer is then dropped right away.
+    pub fn write_owned<B: Into<OwnedBuf>>(
+        &mut self, data: B, fin: bool,
+    ) -> Result<usize> {
+        let data = data.into();
+        let len = data.len();
+
+        if self.cap()? < len {
+            return Err(Error::Done);
+        }
+
+        let data = Arc::new(data);
+
+        self.append(len, fin, |range, off, fin| {
+            RangeBuf::from_shared(&data, range, off, fin)
+        })
+    }
+
+    /// Inserts `len` bytes at the end of the buffer, as `RangeBuf`s created
+    /// by `make_buf` from a range of the input data, the stream offset of
+    /// that range and its fin flag.
+    fn append<F>(
+        &mut self, len: usize, mut fin: bool, mut make_buf: F,
+    ) -> Result<usize>
+    where
+        F: FnMut(std::ops::Range<usize>, u64, bool) -> RangeBuf,
+    {
+        let mut data_len = len;
+        let max_off = self.off + data_len as u64;
         // Get the stream send capacity. This will return an error if the stream
         // was stopped.
         let capacity = self.cap()?;
         //println!("capacity {}", capacity);
-        if data.len() > capacity {
+        if data_len > capacity {
             // Truncate the input buffer according to the stream's capacity.
-            let len = capacity;
-            data = &data[..len];
+            data_len = capacity;
 
             // We are not buffering the full input, so clear the fin flag.
             fin = false;
-            eprintln!("partial write capacity {}", capacity);
         }
         if let Some(fin_off) = self.fin_off {
             // Can't write past final offset.
 
             if max_off > fin_off {
-                eprintln!("error0");
                 return Err(Error::FinalSize);
             }
 
@@ -1398,13 +1862,13 @@ impl SendBuf {
 
         // Don't queue data that was already fully acked.
         if self.ack_off() >= max_off {
-            return Ok(data.len());
+            return Ok(data_len);
         }
 
         // We already recorded the final offset, so we can just discard the
         // empty buffer now.
-        if data.is_empty() {
-            return Ok(data.len());
+        if data_len == 0 {
+            return Ok(data_len);
         }
 
         let mut len = 0;
@@ -1412,18 +1876,20 @@ impl SendBuf {
         // Split the remaining input data into consistently-sized buffers to
         // avoid fragmentation.
         //println!("fin2 {}", fin);
-        for chunk in data.chunks(SEND_BUFFER_SIZE) {
-            len += chunk.len();
+        while len < data_len {
+            let chunk_len = cmp::min(SEND_BUFFER_SIZE, data_len - len);
+
+            let fin = len + chunk_len == data_len && fin;
 
-            let fin = len == data.len() && fin;
+            let buf = make_buf(len..len + chunk_len, self.off, fin);
 
-            let buf = RangeBuf::from(chunk, self.off, fin);
+            len += chunk_len;
 
             // The new data can simply be appended at the end of the send buffer.
             self.data.push_back(buf);
 
-            self.off += chunk.len() as u64;
-            self.len += chunk.len() as u64;
+            self.off += chunk_len as u64;
+            self.len += chunk_len as u64;
             //eprintln!("fin {}, off {}, len {}, max_off {}, cap {}", fin, self.off, self.len, max_off, capacity);
         }
         //eprintln!("off {}, len {} ", self.off, self.len);
@@ -1730,10 +2196,145 @@ impl SendBuf {
     }
 }
 
+/// Memory owned by the application, handed over to a stream without copying.
+///
+/// The release callback is called with its context, exactly once, when the
+/// memory isn't needed anymore.
+pub struct ForeignBuf {
+    ptr: *const u8,
+    len: usize,
+    release: extern fn(*mut c_void),
+    ctx: *mut c_void,
+}
+
+// The memory is only ever read, and the application is responsible for making
+// the release callback safe to call from any thread.
+unsafe impl Send for ForeignBuf {}
+unsafe impl Sync for ForeignBuf {}
+
+impl ForeignBuf {
+    /// Creates a buffer referencing `len` bytes at `ptr`.
+    ///
+    /// # Safety
+    ///
+    /// The memory must stay valid and unmodified until `release` is called
+    /// with `ctx`.
+    pub unsafe fn new(
+        ptr: *const u8, len: usize, release: extern fn(*mut c_void),
+        ctx: *mut c_void,
+    ) -> ForeignBuf {
+        ForeignBuf {
+            ptr,
+            len,
+            release,
+            ctx,
+        }
+    }
+
+    /// Returns the length of the buffer.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Returns true if the buffer has a length of zero bytes.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Shortens the buffer to its first `len` bytes. The whole buffer is still
+    /// released at once.
+    pub fn truncate(&mut self, len: usize) {
+        self.len = cmp::min(self.len, len);
+    }
+}
+
+impl std::ops::Deref for ForeignBuf {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for ForeignBuf {
+    fn drop(&mut self) {
+        (self.release)(self.ctx);
+    }
+}
+
+/// Memory backing one or more `RangeBuf`s.
+///
+/// Buffers that are already owned can be handed over to a stream as they are,
+/// without being copied, using any of the `From` conversions.
+pub enum OwnedBuf {
+    /// A vector moved into the stream.
+    Vec(Vec<u8>),
+
+    /// A reference-counted slice, possibly shared with the application.
+    Shared(Arc<[u8]>),
+
+    /// Memory owned by the application.
+    Foreign(ForeignBuf),
+}
+
+impl Default for OwnedBuf {
+    fn default() -> OwnedBuf {
+        OwnedBuf::Vec(Vec::new())
+    }
+}
+
+impl From<Vec<u8>> for OwnedBuf {
+    fn from(v: Vec<u8>) -> OwnedBuf {
+        OwnedBuf::Vec(v)
+    }
+}
+
+impl From<Arc<[u8]>> for OwnedBuf {
+    fn from(v: Arc<[u8]>) -> OwnedBuf {
+        OwnedBuf::Shared(v)
+    }
+}
+
+impl From<ForeignBuf> for OwnedBuf {
+    fn from(v: ForeignBuf) -> OwnedBuf {
+        OwnedBuf::Foreign(v)
+    }
+}
+
+impl std::ops::Deref for OwnedBuf {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            OwnedBuf::Vec(v) => v,
+
+            OwnedBuf::Shared(v) => v,
+
+            OwnedBuf::Foreign(v) => v,
+        }
+    }
+}
+
+impl std::fmt::Debug for OwnedBuf {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        match self {
+            OwnedBuf::Vec(v) => write!(f, "Vec({:?})", v),
+
+            OwnedBuf::Shared(v) => write!(f, "Shared({:?})", v),
+
+            OwnedBuf::Foreign(v) => write!(f, "Foreign({} bytes)", v.len()),
+        }
+    }
+}
+
 /// Buffer holding data at a specific offset.
 ///
-/// The data is stored in a `Vec<u8>` in such a way that it can be shared
-/// between multiple `RangeBuf` objects.
+/// The data is stored in a `Vec<u8>` (or in memory owned by the application)
+/// in such a way that it can be shared between multiple `RangeBuf` objects.
 ///
 /// Each `RangeBuf` will have its own view of that buffer, where the `start`
 /// value indicates the initial offset within the `Vec`, and `len` indicates the
@@ -1744,14 +2345,14 @@ impl SendBuf {
 ///
 /// Finally, `off` is the starting offset for the specific `RangeBuf` within the
 /// stream the buffer belongs to.
-#[derive(Clone, Debug, Default, Eq)]
+#[derive(Clone, Debug, Default)]
 pub struct RangeBuf {
     /// The internal buffer holding the data.
     ///
     /// To avoid needless allocations when a RangeBuf is split, this field is
     /// reference-counted and can be shared between multiple RangeBuf objects,
     /// and sliced using the `start` and `len` values.
-    data: Arc<Vec<u8>>,
+    data: Arc<OwnedBuf>,
 
     /// The initial offset within the internal buffer.
     start: usize,
@@ -1773,7 +2374,7 @@ impl RangeBuf {
     /// Creates a new `RangeBuf` from the given slice.
     pub fn from(buf: &[u8], off: u64, fin: bool) -> RangeBuf {
         RangeBuf {
-            data: Arc::new(Vec::from(buf)),
+            data: Arc::new(OwnedBuf::Vec(Vec::from(buf))),
             start: 0,
             pos: 0,
             len: buf.len(),
@@ -1782,6 +2383,20 @@ impl RangeBuf {
         }
     }
 
+    /// Creates a new `RangeBuf` referencing the given range of `data`.
+    fn from_shared(
+        data: &Arc<OwnedBuf>, range: std::ops::Range<usize>, off: u64, fin: bool,
+    ) -> RangeBuf {
+        RangeBuf {
+            data: data.clone(),
+            start: range.start,
+            pos: range.start,
+            len: range.end - range.start,
+            off,
+            fin,
+        }
+    }
+
     /// Returns whether `self` holds the final offset in the stream.
     pub fn fin(&self) -> bool {
         self.fin
@@ -1865,10 +2480,14 @@ impl PartialEq for RangeBuf {
     }
 }
 
+impl Eq for RangeBuf {}
+
 #[cfg(test)]
 mod tests {
     use super::*;
 
+    use crate::scheduler::SchedulerType;
+
     #[test]
     fn empty_read() {
         let mut recv = RecvBuf::new(std::u64::MAX, DEFAULT_STREAM_WINDOW);
@@ -2508,6 +3127,75 @@ mod tests {
         assert_eq!(send.len, 0);
     }
 
+    #[test]
+    fn foreign_write() {
+        use std::sync::atomic;
+
+        static RELEASED: atomic::AtomicUsize = atomic::AtomicUsize::new(0);
+
+        extern fn release(_ctx: *mut c_void) {
+            RELEASED.fetch_add(1, atomic::Ordering::SeqCst);
+        }
+
+        let data = b"helloworld";
+        let mut buf = [0; 16];
+
+        let mut send = SendBuf::new(std::u64::MAX);
+
+        let foreign = unsafe {
+            ForeignBuf::new(
+                data.as_ptr(),
+                data.len(),
+                release,
+                std::ptr::null_mut(),
+            )
+        };
+        assert_eq!(send.write_owned(foreign, true), Ok(10));
+        assert_eq!(RELEASED.load(atomic::Ordering::SeqCst), 0);
+
+        let (written, fin) = send.emit(&mut buf).unwrap();
+        assert_eq!(written, 10);
+        assert_eq!(fin, true);
+        assert_eq!(&buf[..written], b"helloworld");
+
+        // The data is kept until all of it is acked.
+        send.ack_and_drop(0, 5);
+        assert_eq!(RELEASED.load(atomic::Ordering::SeqCst), 0);
+
+        send.ack_and_drop(5, 5);
+        assert_eq!(RELEASED.load(atomic::Ordering::SeqCst), 1);
+    }
+
+    #[test]
+    fn owned_write() {
+        let mut buf = [0; 32];
+
+        let mut send = SendBuf::new(std::u64::MAX);
+
+        let shared: Arc<[u8]> = Arc::from(&b"something"[..]);
+        assert_eq!(send.write_owned(shared.clone(), false), Ok(9));
+        assert_eq!(Arc::strong_count(&shared), 2);
+
+        assert_eq!(send.write_owned(b"helloworld".to_vec(), true), Ok(10));
+        assert_eq!(send.len, 19);
+
+        let (written, fin) = send.emit(&mut buf).unwrap();
+        assert_eq!(written, 19);
+        assert_eq!(fin, true);
+        assert_eq!(&buf[..written], b"somethinghelloworld");
+
+        send.ack_and_drop(0, 9);
+        assert_eq!(Arc::strong_count(&shared), 1);
+
+        // A buffer that doesn't fit whole isn't stored at all.
+        let mut send = SendBuf::new(5);
+
+        assert_eq!(send.write_owned(shared.clone(), true), Err(Error::Done));
+        assert_eq!(Arc::strong_count(&shared), 1);
+        assert_eq!(send.len, 0);
+        assert_eq!(send.off_back(), 0);
+    }
+
     #[test]
     fn split_write() {
         let mut buf = [0; 10];
@@ -3541,4 +4229,325 @@ mod tests {
             Some(Error::StreamLimit)
         );
     }
+
+    fn now_us() -> u64 {
+        clock_micros(time::Instant::now())
+    }
+
+    /// Returns a client's stream map, with deadline scheduling enabled if a
+    /// scheduler is given, and the local and peer transport parameters. The
+    /// client can open 100 bidirectional streams of `max_stream_data` bytes.
+    fn stream_map(
+        scheduler: Option<SchedulerType>, max_stream_data: u64,
+    ) -> (StreamMap, crate::TransportParams, crate::TransportParams) {
+        let mut config = Config::new(crate::PROTOCOL_VERSION).unwrap();
+
+        if let Some(scheduler) = scheduler {
+            config.enable_deadline_scheduling(true);
+            config.set_scheduler_type(scheduler);
+        }
+
+        let local_tp = crate::TransportParams::default();
+        let peer_tp = crate::TransportParams {
+            initial_max_stream_data_bidi_remote: max_stream_data,
+            ..crate::TransportParams::default()
+        };
+
+        let mut streams = StreamMap::new(100, 100, max_stream_data, &config);
+        streams.update_peer_max_streams_bidi(100);
+
+        (streams, local_tp, peer_tp)
+    }
+
+    #[test]
+    fn peek_flushable_block_index() {
+        let (mut streams, local_tp, peer_tp) =
+            stream_map(Some(SchedulerType::Dynamic), 100);
+
+        for &id in &[0, 4, 8] {
+            let stream = streams
+                .get_or_create(id, &local_tp, &peer_tp, true, false, 200, 1, id)
+                .unwrap();
+            assert_eq!(stream.send.write(b"hello", true), Ok(5));
+
+            streams.push_flushable(id, DEFAULT_URGENCY, true);
+        }
+
+        assert_eq!(streams.blocks.len(), 3);
+
+        let id = streams.peek_flushable(1_000_000.0, 10.0, 0, now_us());
+        let id = id.unwrap();
+        assert!(streams.blocks.contains(id));
+
+        // Peeking doesn't change the queue.
+        assert_eq!(streams.blocks.len(), 3);
+
+        // Emitting data updates the block in place.
+        let mut buf = [0; 3];
+        let stream = streams.get_mut(id).unwrap();
+        assert_eq!(stream.send.emit(&mut buf), Ok((3, false)));
+        streams.update_block(id);
+        assert_eq!(streams.blocks.get(id).unwrap().remaining_size, 2);
+
+        streams.remove_peeked(id);
+        assert!(!streams.blocks.contains(id));
+        assert_eq!(streams.blocks.len(), 2);
+
+        // Canceling a block resets the stream and removes it from the queue.
+        let id = streams.peek_flushable(1_000_000.0, 10.0, 0, now_us());
+        let id = id.unwrap();
+        assert_eq!(streams.cancel_block(id), Ok(()));
+        assert!(!streams.blocks.contains(id));
+        assert_eq!(streams.blocks.len(), 1);
+        assert!(streams.has_reset());
+        assert!(streams.has_flushable());
+        assert_eq!(streams.dropped(), (1, 5));
+    }
+
+    #[test]
+    fn peek_flushable_expired_blocks() {
+        let (mut streams, local_tp, peer_tp) =
+            stream_map(Some(SchedulerType::Dynamic), 100);
+
+        // Streams 0 and 8 expire after 200ms, stream 4 after 1000s.
+        for &(id, deadline) in &[(0, 200), (4, 1_000_000), (8, 200)] {
+            let stream = streams
+                .get_or_create(
+                    id, &local_tp, &peer_tp, true, false, deadline, 1, id,
+                )
+                .unwrap();
+            assert_eq!(stream.send.write(b"hello", true), Ok(5));
+
+            streams.push_flushable(id, DEFAULT_URGENCY, true);
+        }
+
+        let now = now_us();
+        assert!(streams.peek_flushable(1_000_000.0, 10.0, 0, now).is_some());
+        assert_eq!(streams.blocks.len(), 3);
+        assert_eq!(streams.dropped(), (0, 0));
+
+        // Both expired blocks are dropped at once.
+        let id = streams.peek_flushable(1_000_000.0, 10.0, 0, now + 500_000);
+        assert_eq!(id, Some(4));
+        assert_eq!(streams.blocks.len(), 1);
+        assert_eq!(streams.dropped(), (2, 10));
+
+        let mut reset: Vec<u64> = streams.reset().map(|(&id, _)| id).collect();
+        reset.sort_unstable();
+        assert_eq!(reset, [0, 8]);
+        assert!(!streams.writable.contains(&0));
+        assert!(!streams.writable.contains(&8));
+    }
+
+    #[test]
+    fn cancel_block_dependents() {
+        let (mut streams, local_tp, peer_tp) =
+            stream_map(Some(SchedulerType::Dynamic), 100);
+
+        // Stream 8 depends on stream 4, which depends on stream 0.
+        for &(id, depend_id) in &[(0, 0), (4, 0), (8, 4), (12, 12)] {
+            let stream = streams
+                .get_or_create(
+                    id, &local_tp, &peer_tp, true, false, 200, 1, depend_id,
+                )
+                .unwrap();
+            assert_eq!(stream.send.write(b"hello", true), Ok(5));
+
+            if id != 8 {
+                streams.push_flushable(id, DEFAULT_URGENCY, true);
+            }
+        }
+
+        assert_eq!(streams.cancel_block(0), Ok(()));
+        assert_eq!(streams.blocks.len(), 1);
+        assert!(streams.blocks.contains(12));
+        assert_eq!(streams.dropped(), (2, 10));
+
+        // Blocks depending on a canceled block are canceled when queued.
+        streams.push_flushable(8, DEFAULT_URGENCY, true);
+        assert!(!streams.blocks.contains(8));
+        assert_eq!(streams.dropped(), (3, 15));
+
+        let mut reset: Vec<u64> = streams.reset().map(|(&id, _)| id).collect();
+        reset.sort_unstable();
+        assert_eq!(reset, [0, 4, 8]);
+    }
+
+    #[test]
+    fn admission_control() {
+        let (mut streams, local_tp, peer_tp) =
+            stream_map(Some(SchedulerType::EDF), 100_000);
+
+        // Admitted while the bandwidth is unknown.
+        assert!(streams.admit_block(0, 50_000, 100, 1, 0));
+
+        let stream = streams
+            .get_or_create(0, &local_tp, &peer_tp, true, false, 100, 1, 0)
+            .unwrap();
+        assert_eq!(stream.send.write(&[0; 50_000], true), Ok(50_000));
+        streams.push_flushable(0, DEFAULT_URGENCY, true);
+
+        streams.update_path_estimates(&PathEstimates {
+            btlbw: 1_000_000.0,
+            min_rtt: 20.0,
+        });
+
+        // 60ms to drain the queue with the new block, plus 10ms one-way delay.
+        assert!(streams.admit_block(4, 10_000, 100, 1, 0));
+        assert!(!streams.admit_block(8, 10_000, 50, 1, 0));
+
+        // Blocks depending on the rejected block are canceled.
+        assert!(streams.blocks.is_canceled(8));
+        assert_eq!(streams.dropped(), (1, 10_000));
+
+        // New blocks depending on it are rejected even if they fit.
+        assert!(!streams.admit_block(12, 100, 1_000, 1, 8));
+        assert!(streams.blocks.is_canceled(12));
+        assert_eq!(streams.dropped(), (2, 10_100));
+
+        // Data queued at a lower priority doesn't count.
+        assert!(streams.admit_block(16, 10_000, 50, 0, 16));
+        assert_eq!(streams.dropped(), (2, 10_100));
+    }
+
+    #[test]
+    fn collected_set() {
+        let mut c = CollectedSet::default();
+
+        // Streams 1, 5 and 13 are never collected.
+        for seq in (2..1000).filter(|&seq| seq != 3) {
+            c.insert(seq << 2 | 1);
+        }
+
+        assert!(!c.contains(1));
+        assert!(!c.contains(5));
+        assert!(c.contains(9));
+        assert!(!c.contains(13));
+        assert!(c.contains(17));
+        assert!(c.contains(999 << 2 | 1));
+        assert!(!c.contains(1000 << 2 | 1));
+        assert_eq!(c.ranges[1].len(), 2);
+
+        // Other stream types are tracked separately.
+        assert!(!c.contains(8));
+
+        c.insert(0);
+        c.insert(4);
+        assert!(c.contains(0));
+        assert!(c.contains(4));
+        assert_eq!(c.ranges[0].len(), 0);
+        assert_eq!(c.low[0], 2);
+    }
+
+    #[test]
+    fn collected_set_bounded() {
+        let mut c = CollectedSet::default();
+
+        // Every other stream is collected, so each one is a separate range.
+        for seq in 0..10 * MAX_COLLECTED_RANGES as u64 {
+            c.insert((2 * seq + 1) << 2);
+        }
+
+        assert!(c.ranges[0].len() <= MAX_COLLECTED_RANGES);
+
+        // The most recent gaps are still tracked...
+        let last = (20 * MAX_COLLECTED_RANGES as u64 - 1) << 2;
+        assert!(c.contains(last));
+        assert!(!c.contains(last - 4));
+
+        // ...while the oldest ones are below the watermark.
+        assert!(c.contains(0));
+    }
+
+    #[test]
+    fn collected_streams_reused() {
+        let (mut streams, local_tp, peer_tp) = stream_map(None, 100);
+
+        let stream = streams
+            .get_or_create(0, &local_tp, &peer_tp, true, false, 200, 1, 0)
+            .unwrap();
+        for _ in 0..16 {
+            assert_eq!(stream.send.write(b"a", false), Ok(1));
+        }
+        assert_eq!(stream.send.write(b"hello", true), Ok(5));
+        stream.urgency = 3;
+
+        streams.collect(0, true);
+        assert_eq!(streams.pool.len(), 1);
+        assert!(streams.is_collected(0));
+
+        // The pooled stream keeps room for the 17 chunks it buffered.
+        let capacity = streams.pool[0].send.data.capacity();
+        assert!(capacity >= 17);
+
+        // The pooled stream is handed out again, in its initial state.
+        let stream = streams
+            .get_or_create(4, &local_tp, &peer_tp, true, false, 300, 2, 4)
+            .unwrap();
+        assert_eq!(stream.send.len, 0);
+        assert_eq!(stream.send.off_front(), 0);
+        assert!(!stream.send.is_fin());
+        assert_eq!(stream.send.deadline, 300);
+        assert_eq!(stream.urgency, 2);
+
+        // ...along with its memory.
+        assert_eq!(stream.send.data.capacity(), capacity);
+        assert_eq!(streams.pool.len(), 0);
+    }
+
+    /// Counts the allocations made by each thread, so that tests running in
+    /// parallel don't affect each other's counts.
+    struct CountingAllocator;
+
+    thread_local! {
+        static ALLOCATIONS: std::cell::Cell<usize> =
+            const { std::cell::Cell::new(0) };
+    }
+
+    unsafe impl std::alloc::GlobalAlloc for CountingAllocator {
+        unsafe fn alloc(&self, layout: std::alloc::Layout) -> *mut u8 {
+            ALLOCATIONS.with(|n| n.set(n.get() + 1));
+            std::alloc::System.alloc(layout)
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: std::alloc::Layout) {
+            std::alloc::System.dealloc(ptr, layout)
+        }
+    }
+
+    #[global_allocator]
+    static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+    /// Returns the number of allocations made by the current thread while
+    /// writing `frames` one-byte chunks to a new stream.
+    fn write_allocations(
+        streams: &mut StreamMap, local_tp: &crate::TransportParams,
+        peer_tp: &crate::TransportParams, stream_id: u64, frames: usize,
+    ) -> usize {
+        let stream = streams
+            .get_or_create(stream_id, local_tp, peer_tp, true, false, 200, 1, 0)
+            .unwrap();
+
+        let before = ALLOCATIONS.with(|n| n.get());
+
+        for _ in 0..frames {
+            assert_eq!(stream.send.write(b"a", false), Ok(1));
+        }
+
+        ALLOCATIONS.with(|n| n.get()) - before
+    }
+
+    #[test]
+    fn collected_streams_allocations() {
+        let (mut streams, local_tp, peer_tp) = stream_map(None, 100);
+
+        let fresh = write_allocations(&mut streams, &local_tp, &peer_tp, 0, 32);
+        streams.collect(0, true);
+
+        let pooled = write_allocations(&mut streams, &local_tp, &peer_tp, 4, 32);
+
+        // Every frame still allocates its own chunk, but the buffer of the
+        // pooled stream doesn't need to grow anymore.
+        assert!(pooled < fresh);
+    }
 }
@@ -0,0 +1,245 @@
+//! Binary tracing of scheduler and stream events.
+//!
+//! Events are recorded as fixed-size records into a per-thread ring buffer,
+//! without formatting or locking, and can be drained by the application with
+//! [`drain_trace_events()`].
+//!
+//! Recording is only compiled in when the `trace` feature is enabled, and is
+//! filtered at runtime by the level set with [`set_trace_level()`]. Without
+//! the feature, the `trace_event!` call sites compile to nothing.
+//!
+//! [`drain_trace_events()`]: fn.drain_trace_events.html
+//! [`set_trace_level()`]: fn.set_trace_level.html
+
+use std::sync::atomic;
+
+/// Maximum number of events kept per thread. Older events are overwritten.
+#[cfg(feature = "trace")]
+pub const TRACE_RING_CAPACITY: usize = 4096;
+
+/// Verbosity of the recorded events.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord)]
+pub enum TraceLevel {
+    /// Nothing is recorded.
+    Off   = 0,
+
+    /// Block and stream lifecycle events.
+    Info  = 1,
+
+    /// Per-candidate scheduler decisions.
+    Debug = 2,
+}
+
+/// Type of a recorded event, which defines the meaning of its arguments.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum TraceEventType {
+    /// A block was skipped because its dependency wasn't sent yet.
+    /// Arguments: depend ID.
+    BlockSkipped      = 1,
+
+    /// The scheduler estimated the slack of a block. Arguments: passed time
+    /// (ms, f64), one-way delay (ms, f64), remaining size, remaining time
+    /// (ms, f64).
+    BlockEvaluated    = 2,
+
+    /// The scheduler computed the weight of a block. Arguments: weight (f64),
+    /// priority, deadline (ms), depend ID.
+    BlockWeighted     = 3,
+
+    /// The scheduler selected a block. Arguments: whether no block could meet
+    /// its deadline.
+    BlockSelected     = 4,
+
+    /// A block was dropped or rejected, recorded once per block by the stream
+    /// map. Arguments: priority, remaining size, block size, depend ID.
+    BlockDropped      = 5,
+
+    /// A RESET_STREAM frame was scheduled. Arguments: error code, final size.
+    StreamReset       = 6,
+
+    /// A RESET_STREAM frame was received. Arguments: error code, final size.
+    ResetReceived     = 7,
+
+    /// Stream flow control limited a write. Arguments: requested length,
+    /// written length.
+    PartialWrite      = 8,
+
+    /// Connection flow control limited a write. Arguments: max data, data
+    /// sent, requested length.
+    ConnectionBlocked = 9,
+}
+
+/// A recorded event.
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub struct TraceEvent {
+    /// Time of the event, in microseconds on the scheduler clock.
+    pub time: u64,
+
+    /// Type of the event.
+    pub ty: TraceEventType,
+
+    /// Stream the event refers to.
+    pub stream_id: u64,
+
+    /// Type-specific arguments. Floating point values are stored as their
+    /// IEEE 754 bit patterns.
+    pub args: [u64; 4],
+}
+
+static LEVEL: atomic::AtomicU8 = atomic::AtomicU8::new(TraceLevel::Info as u8);
+
+/// Sets the level of the events to record.
+pub fn set_trace_level(level: TraceLevel) {
+    LEVEL.store(level as u8, atomic::Ordering::Relaxed);
+}
+
+/// Returns true if events of the given level should be recorded.
+#[cfg(feature = "trace")]
+#[inline]
+pub fn enabled(level: TraceLevel) -> bool {
+    level as u8 <= LEVEL.load(atomic::Ordering::Relaxed)
+}
+
+/// Conversion of event arguments to their binary representation.
+#[cfg(feature = "trace")]
+pub trait TraceArg {
+    /// Returns the argument as stored in `TraceEvent::args`.
+    fn into_arg(self) -> u64;
+}
+
+#[cfg(feature = "trace")]
+impl TraceArg for u64 {
+    fn into_arg(self) -> u64 {
+        self
+    }
+}
+
+#[cfg(feature = "trace")]
+impl TraceArg for usize {
+    fn into_arg(self) -> u64 {
+        self as u64
+    }
+}
+
+#[cfg(feature = "trace")]
+impl TraceArg for bool {
+    fn into_arg(self) -> u64 {
+        self as u64
+    }
+}
+
+#[cfg(feature = "trace")]
+impl TraceArg for f64 {
+    fn into_arg(self) -> u64 {
+        self.to_bits()
+    }
+}
+
+#[cfg(feature = "trace")]
+#[derive(Default)]
+struct Ring {
+    events: Vec<TraceEvent>,
+
+    /// Position of the next event to be written, once the ring is full.
+    next: usize,
+}
+
+#[cfg(feature = "trace")]
+impl Ring {
+    fn push(&mut self, ev: TraceEvent) {
+        if self.events.len() < TRACE_RING_CAPACITY {
+            self.events.push(ev);
+            return;
+        }
+
+        self.events[self.next] = ev;
+        self.next = (self.next + 1) % TRACE_RING_CAPACITY;
+    }
+
+    fn drain<F: FnMut(&TraceEvent)>(&mut self, mut f: F) -> usize {
+        let (newer, older) = self.events.split_at(self.next);
+
+        older.iter().chain(newer.iter()).for_each(&mut f);
+
+        let n = self.events.len();
+
+        // Keep the allocation around for the next events.
+        self.events.clear();
+        self.next = 0;
+
+        n
+    }
+}
+
+#[cfg(feature = "trace")]
+thread_local! {
+    static RING: std::cell::RefCell<Ring> = Default::default();
+}
+
+/// Records an event into the current thread's ring buffer.
+///
+/// This is called through the `trace_event!` macro, which also checks the
+/// trace level.
+#[cfg(feature = "trace")]
+pub fn record(ty: TraceEventType, stream_id: u64, args: &[u64]) {
+    let mut ev = TraceEvent {
+        time: crate::clock_micros(),
+        ty,
+        stream_id,
+        args: [0; 4],
+    };
+
+    let n = std::cmp::min(args.len(), ev.args.len());
+    ev.args[..n].copy_from_slice(&args[..n]);
+
+    RING.with(|r| r.borrow_mut().push(ev));
+}
+
+/// Calls `f` with every event recorded by the current thread, from oldest to
+/// newest, and empties the ring buffer.
+///
+/// Returns the number of events drained. This is always 0 when the `trace`
+/// feature is disabled.
+pub fn drain_trace_events<F: FnMut(&TraceEvent)>(f: F) -> usize {
+    #[cfg(feature = "trace")]
+    return RING.with(|r| r.borrow_mut().drain(f));
+
+    #[cfg(not(feature = "trace"))]
+    {
+        let _ = f;
+        0
+    }
+}
+
+#[cfg(all(test, feature = "trace"))]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn ring_wraps_around() {
+        set_trace_level(TraceLevel::Info);
+
+        for i in 0..TRACE_RING_CAPACITY + 10 {
+            trace_event!(Info, PartialWrite, i as u64, [i, 0_usize]);
+
+            // Filtered by the trace level.
+            trace_event!(Debug, BlockSkipped, i as u64, [0_u64]);
+        }
+
+        let mut ids = Vec::new();
+        let n = drain_trace_events(|ev| {
+            assert_eq!(ev.ty, TraceEventType::PartialWrite);
+            assert_eq!(ev.args[0], ev.stream_id);
+            ids.push(ev.stream_id);
+        });
+
+        assert_eq!(n, TRACE_RING_CAPACITY);
+        assert_eq!(ids.first(), Some(&10));
+        assert_eq!(ids.last(), Some(&(TRACE_RING_CAPACITY as u64 + 9)));
+
+        assert_eq!(drain_trace_events(|_| ()), 0);
+    }
+}